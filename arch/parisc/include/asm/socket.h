@@ -13,7 +13,7 @@
 #define SO_BROADCAST	0x0020
 #define SO_LINGER	0x0080
 #define SO_OOBINLINE	0x0100
-/* To add :#define SO_REUSEPORT 0x0200 */
+#define SO_REUSEPORT	0x0200
 #define SO_SNDBUF	0x1001
 #define SO_RCVBUF	0x1002
 #define SO_SNDBUFFORCE	0x100a
@@ -67,6 +67,9 @@
 
 /* Instruct lower device to use last 4-bytes of skb data as FCS */
 #define SO_NOFCS		0x4024
+#define SO_ZEROCOPY		0x4025
+#define SO_MAX_PACING_RATE	0x4026
+#define SO_BUSY_POLL		0x4027
 
 
 /* O_NONBLOCK clashes with the bits used for socket types.  Therefore we
@@ -15,7 +15,7 @@
 #define SO_PEERCRED	0x0040
 #define SO_LINGER	0x0080
 #define SO_OOBINLINE	0x0100
-/* To add :#define SO_REUSEPORT 0x0200 */
+#define SO_REUSEPORT	0x0200
 #define SO_BSDCOMPAT    0x0400
 #define SO_RCVLOWAT     0x0800
 #define SO_SNDLOWAT     0x1000
@@ -64,6 +64,9 @@
 
 /* Instruct lower device to use last 4-bytes of skb data as FCS */
 #define SO_NOFCS		0x0027
+#define SO_ZEROCOPY		0x0028
+#define SO_MAX_PACING_RATE	0x0029
+#define SO_BUSY_POLL		0x002a
 
 
 /* Security levels - as per NRL IPv6 - don't actually do anything */
@@ -11,12 +11,14 @@
 #include <asm/cacheflush.h>
 #include <linux/netdevice.h>
 #include <linux/filter.h>
+#include <linux/seccomp.h>
 
 /*
  * Conventions :
  *  EAX : BPF A accumulator
  *  EBX : BPF X accumulator
- *  RDI : pointer to skb   (first argument given to JIT function)
+ *  RDI : pointer to skb   (first argument given to JIT function, NULL
+ *        for seccomp filters, which never reference packet data)
  *  RBP : frame pointer (even if CONFIG_FRAME_POINTER=n)
  *  ECX,EDX,ESI : scratch registers
  *  r9d : skb->len - skb->data_len (headlen)
@@ -213,6 +215,7 @@ void bpf_jit_compile(struct sk_filter *fp)
 		case BPF_S_ANC_RXHASH:
 		case BPF_S_ANC_CPU:
 		case BPF_S_ANC_QUEUE:
+		case BPF_S_ANC_SECCOMP_LD_W:
 		case BPF_S_LD_W_ABS:
 		case BPF_S_LD_H_ABS:
 		case BPF_S_LD_B_ABS:
@@ -477,6 +480,17 @@ void bpf_jit_compile(struct sk_filter *fp)
 				CLEAR_A();
 #endif
 				break;
+#ifdef CONFIG_SECCOMP_FILTER
+			case BPF_S_ANC_SECCOMP_LD_W:
+				/* A = seccomp_bpf_load(K); only X lives in a
+				 * callee saved register, nothing else to keep.
+				 */
+				func = (u8 *)seccomp_bpf_load;
+				t_offset = func - (image + addrs[i]);
+				EMIT1_off32(0xbf, K); /* mov imm32,%edi */
+				EMIT1_off32(0xe8, t_offset); /* call */
+				break;
+#endif
 			case BPF_S_LD_W_ABS:
 				func = CHOOSE_LOAD_FUNC(K, sk_load_word);
 common_load:			seen |= SEEN_DATAREF;
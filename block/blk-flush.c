@@ -69,8 +69,10 @@
 #include <linux/bio.h>
 #include <linux/blkdev.h>
 #include <linux/gfp.h>
+#include <linux/blk-mq.h>
 
 #include "blk.h"
+#include "blk-mq.h"
 
 /* FLUSH/FUA sequences */
 enum {
@@ -384,6 +386,146 @@ void blk_abort_flushes(struct request_queue *q)
 	}
 }
 
+/*
+ * Multi-queue devices have no queue_lock to batch flushes under, so each
+ * FLUSH/FUA request is sequenced on its own.  The PREFLUSH and POSTFLUSH
+ * steps need a flush request and thus a tag, which may mean sleeping, so
+ * every step is issued from q->mq_flush_work.  Completions only record
+ * progress and punt to the work item.
+ */
+static void mq_flush_complete_seq(struct request *rq, unsigned int seq,
+				  int error)
+{
+	struct request_queue *q = rq->q;
+	unsigned long flags;
+
+	BUG_ON(rq->flush.seq & seq);
+	rq->flush.seq |= seq;
+
+	if (unlikely(error) || blk_flush_cur_seq(rq) == REQ_FSEQ_DONE) {
+		blk_flush_restore_request(rq);
+		blk_mq_end_io(rq, error);
+		return;
+	}
+
+	spin_lock_irqsave(&q->mq_flush_lock, flags);
+	list_add_tail(&rq->flush.list, &q->mq_flush_list);
+	spin_unlock_irqrestore(&q->mq_flush_lock, flags);
+
+	kblockd_schedule_work(q, &q->mq_flush_work);
+}
+
+static void mq_flush_end_io(struct request *flush_rq, int error)
+{
+	struct request *rq = flush_rq->end_io_data;
+
+	blk_mq_free_request(flush_rq);
+	mq_flush_complete_seq(rq, blk_flush_cur_seq(rq), error);
+}
+
+static void mq_flush_data_end_io(struct request *rq, int error)
+{
+	mq_flush_complete_seq(rq, REQ_FSEQ_DATA, error);
+}
+
+void blk_mq_flush_work(struct work_struct *work)
+{
+	struct request_queue *q =
+		container_of(work, struct request_queue, mq_flush_work);
+	struct request *rq, *flush_rq;
+	LIST_HEAD(list);
+
+	spin_lock_irq(&q->mq_flush_lock);
+	list_splice_init(&q->mq_flush_list, &list);
+	spin_unlock_irq(&q->mq_flush_lock);
+
+	while (!list_empty(&list)) {
+		rq = list_first_entry(&list, struct request, flush.list);
+		list_del_init(&rq->flush.list);
+
+		if (blk_flush_cur_seq(rq) == REQ_FSEQ_DATA) {
+			rq->end_io = mq_flush_data_end_io;
+			blk_mq_insert_request(q, rq, false, true);
+			continue;
+		}
+
+		flush_rq = blk_mq_alloc_reserved_request(q, WRITE_FLUSH,
+							 GFP_NOIO);
+		if (unlikely(!flush_rq)) {
+			/* @q is dead */
+			mq_flush_complete_seq(rq, blk_flush_cur_seq(rq),
+					      -ENODEV);
+			continue;
+		}
+
+		flush_rq->cmd_type = REQ_TYPE_FS;
+		flush_rq->cmd_flags |= REQ_FLUSH_SEQ;
+		flush_rq->rq_disk = rq->rq_disk;
+		flush_rq->end_io = mq_flush_end_io;
+		flush_rq->end_io_data = rq;
+
+		blk_mq_insert_request(q, flush_rq, false, true);
+	}
+}
+
+/**
+ * blk_mq_insert_flush - insert a new FLUSH/FUA request on a multi-queue device
+ * @rq: request to insert
+ *
+ * Multi-queue counterpart of blk_insert_flush(), called from the
+ * make_request path in process context.
+ */
+void blk_mq_insert_flush(struct request *rq)
+{
+	struct request_queue *q = rq->q;
+	unsigned int fflags = q->flush_flags;
+	unsigned int policy = blk_flush_policy(fflags, rq);
+
+	/*
+	 * @policy now records what operations need to be done.  Adjust
+	 * REQ_FLUSH and FUA for the driver.
+	 */
+	rq->cmd_flags &= ~REQ_FLUSH;
+	if (!(fflags & REQ_FUA))
+		rq->cmd_flags &= ~REQ_FUA;
+
+	/*
+	 * An empty flush handed down to a device without write cache
+	 * can be completed immediately.
+	 */
+	if (!policy) {
+		blk_mq_end_io(rq, 0);
+		return;
+	}
+
+	/*
+	 * If there's data but flush is not necessary, the request can be
+	 * processed directly without going through flush machinery.  An
+	 * empty flush is simply handed to the driver as one.
+	 */
+	if ((policy & REQ_FSEQ_DATA) &&
+	    !(policy & (REQ_FSEQ_PREFLUSH | REQ_FSEQ_POSTFLUSH))) {
+		blk_mq_insert_request(q, rq, false, true);
+		return;
+	}
+	if (policy == REQ_FSEQ_PREFLUSH) {
+		rq->cmd_flags |= REQ_FLUSH;
+		blk_mq_insert_request(q, rq, false, true);
+		return;
+	}
+
+	/*
+	 * @rq should go through flush machinery.  Mark it part of flush
+	 * sequence and submit for further processing.
+	 */
+	memset(&rq->flush, 0, sizeof(rq->flush));
+	INIT_LIST_HEAD(&rq->flush.list);
+	rq->cmd_flags |= REQ_FLUSH_SEQ | REQ_NOMERGE;
+	rq->flush.saved_end_io = rq->end_io; /* Usually NULL */
+
+	mq_flush_complete_seq(rq, REQ_FSEQ_ACTIONS & ~policy, 0);
+}
+
 static void bio_end_flush(struct bio *bio, int err)
 {
 	if (err)
@@ -0,0 +1,180 @@
+/*
+ * Tag allocation for blk-mq hardware queues.
+ *
+ * Tags are preallocated per hardware queue and double as the index into
+ * the hardware context's request array.  The low @reserved_tags tags are
+ * kept apart for internal requests (flushes) so that they can always make
+ * progress even if regular IO has exhausted the normal tag space.
+ *
+ * Allocation is a lockless bitmap search.  Each CPU starts its search at
+ * its own offset into the map so that concurrent submitters on different
+ * CPUs mostly touch different cachelines.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/bitops.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
+
+#include <linux/blk-mq.h>
+#include "blk.h"
+#include "blk-mq.h"
+
+struct blk_mq_tags {
+	unsigned int nr_tags;
+	unsigned int nr_reserved_tags;
+
+	wait_queue_head_t wait;
+	wait_queue_head_t reserved_wait;
+
+	unsigned long map[];
+};
+
+static unsigned int __blk_mq_find_tag(struct blk_mq_tags *tags,
+				      unsigned int start, unsigned int end,
+				      unsigned int hint)
+{
+	unsigned int tag;
+
+	if (hint < start || hint >= end)
+		hint = start;
+
+	tag = hint;
+	do {
+		tag = find_next_zero_bit(tags->map, end, tag);
+		if (tag >= end) {
+			if (hint == start)
+				break;
+			/* wrap around once */
+			end = hint;
+			hint = tag = start;
+			continue;
+		}
+		if (!test_and_set_bit(tag, tags->map))
+			return tag;
+	} while (1);
+
+	return BLK_MQ_TAG_FAIL;
+}
+
+static unsigned int __blk_mq_get_tag(struct blk_mq_tags *tags, bool reserved)
+{
+	unsigned int start, end, hint;
+
+	if (reserved) {
+		start = 0;
+		end = tags->nr_reserved_tags;
+		hint = 0;
+	} else {
+		start = tags->nr_reserved_tags;
+		end = tags->nr_tags;
+		hint = start + ((raw_smp_processor_id() * BITS_PER_LONG) %
+				(end - start));
+	}
+
+	if (start == end)
+		return BLK_MQ_TAG_FAIL;
+
+	return __blk_mq_find_tag(tags, start, end, hint);
+}
+
+unsigned int blk_mq_get_tag(struct blk_mq_tags *tags, gfp_t gfp,
+			    bool reserved)
+{
+	wait_queue_head_t *wq = reserved ? &tags->reserved_wait : &tags->wait;
+	unsigned int tag;
+	DEFINE_WAIT(wait);
+
+	tag = __blk_mq_get_tag(tags, reserved);
+	if (tag != BLK_MQ_TAG_FAIL || !(gfp & __GFP_WAIT))
+		return tag;
+
+	do {
+		prepare_to_wait_exclusive(wq, &wait, TASK_UNINTERRUPTIBLE);
+
+		tag = __blk_mq_get_tag(tags, reserved);
+		if (tag != BLK_MQ_TAG_FAIL)
+			break;
+
+		io_schedule();
+	} while (1);
+
+	finish_wait(wq, &wait);
+	return tag;
+}
+
+void blk_mq_put_tag(struct blk_mq_tags *tags, unsigned int tag)
+{
+	wait_queue_head_t *wq;
+
+	BUG_ON(tag >= tags->nr_tags);
+
+	clear_bit(tag, tags->map);
+	smp_mb__after_clear_bit();
+
+	wq = tag < tags->nr_reserved_tags ? &tags->reserved_wait : &tags->wait;
+	if (waitqueue_active(wq))
+		wake_up(wq);
+}
+
+/*
+ * Wait for a tag to become free, without grabbing it.  Used by callers
+ * that have to drop per-cpu state before they can sleep.
+ */
+void blk_mq_wait_for_tags(struct blk_mq_tags *tags, bool reserved)
+{
+	unsigned int tag = blk_mq_get_tag(tags, __GFP_WAIT, reserved);
+
+	blk_mq_put_tag(tags, tag);
+}
+
+bool blk_mq_has_free_tags(struct blk_mq_tags *tags)
+{
+	return find_next_zero_bit(tags->map, tags->nr_tags,
+				  tags->nr_reserved_tags) < tags->nr_tags;
+}
+
+bool blk_mq_tags_busy(struct blk_mq_tags *tags)
+{
+	return !bitmap_empty(tags->map, tags->nr_tags);
+}
+
+/*
+ * Hand the busy map to @fn.  The map is live, tags may be freed or
+ * allocated while @fn runs.
+ */
+void blk_mq_tag_busy_iter(struct blk_mq_tags *tags,
+			  void (*fn)(void *, unsigned long *), void *data)
+{
+	fn(data, tags->map);
+}
+
+struct blk_mq_tags *blk_mq_init_tags(unsigned int nr_tags,
+				     unsigned int reserved_tags, int node)
+{
+	struct blk_mq_tags *tags;
+
+	if (nr_tags > BLK_MQ_TAG_MAX) {
+		pr_err("blk-mq: tag depth too large\n");
+		return NULL;
+	}
+
+	tags = kzalloc_node(sizeof(*tags) +
+			    BITS_TO_LONGS(nr_tags) * sizeof(long),
+			    GFP_KERNEL, node);
+	if (!tags)
+		return NULL;
+
+	tags->nr_tags = nr_tags;
+	tags->nr_reserved_tags = reserved_tags;
+	init_waitqueue_head(&tags->wait);
+	init_waitqueue_head(&tags->reserved_wait);
+
+	return tags;
+}
+
+void blk_mq_free_tags(struct blk_mq_tags *tags)
+{
+	kfree(tags);
+}
@@ -0,0 +1,52 @@
+#ifndef INT_BLK_MQ_H
+#define INT_BLK_MQ_H
+
+/*
+ * Per-cpu software staging queue.  Submitters only ever touch the queue
+ * of the CPU they run on, so the lock is normally uncontended.
+ */
+struct blk_mq_ctx {
+	struct {
+		spinlock_t		lock;
+		struct list_head	rq_list;
+	}  ____cacheline_aligned_in_smp;
+
+	unsigned int		cpu;
+	unsigned int		index_hw;	/* bit in hctx->ctx_map */
+
+	struct request_queue	*queue;
+} ____cacheline_aligned_in_smp;
+
+void blk_mq_run_hw_queue(struct blk_mq_hw_ctx *hctx, bool async);
+void blk_mq_flush_plug_list(struct blk_plug *plug, bool from_schedule);
+void blk_mq_insert_flush(struct request *rq);
+void blk_mq_flush_work(struct work_struct *work);
+
+/*
+ * Tag allocation, blk-mq-tag.c
+ */
+struct blk_mq_tags *blk_mq_init_tags(unsigned int nr_tags,
+				     unsigned int reserved_tags, int node);
+void blk_mq_free_tags(struct blk_mq_tags *tags);
+unsigned int blk_mq_get_tag(struct blk_mq_tags *tags, gfp_t gfp,
+			    bool reserved);
+void blk_mq_put_tag(struct blk_mq_tags *tags, unsigned int tag);
+void blk_mq_wait_for_tags(struct blk_mq_tags *tags, bool reserved);
+bool blk_mq_has_free_tags(struct blk_mq_tags *tags);
+bool blk_mq_tags_busy(struct blk_mq_tags *tags);
+void blk_mq_tag_busy_iter(struct blk_mq_tags *tags,
+			  void (*fn)(void *, unsigned long *), void *data);
+
+enum {
+	BLK_MQ_TAG_FAIL		= -1U,
+	BLK_MQ_TAG_MIN		= 1,
+	BLK_MQ_TAG_MAX		= BLK_MQ_TAG_FAIL - 1,
+};
+
+/*
+ * CPU -> hardware queue mapping, blk-mq-cpumap.c
+ */
+int blk_mq_update_queue_map(unsigned int *map, unsigned int nr_queues);
+unsigned int *blk_mq_make_queue_map(struct blk_mq_reg *reg);
+
+#endif
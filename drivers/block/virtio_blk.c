@@ -2,6 +2,7 @@
 #include <linux/spinlock.h>
 #include <linux/slab.h>
 #include <linux/blkdev.h>
+#include <linux/blk-mq.h>
 #include <linux/hdreg.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
@@ -15,6 +16,9 @@
 #define PART_BITS 4
 
 static int major;
+static bool use_mq;
+module_param(use_mq, bool, 0444);
+MODULE_PARM_DESC(use_mq, "Use the multi-queue block layer (default: no)");
 static DEFINE_IDA(vd_index_ida);
 
 struct workqueue_struct *virtblk_wq;
@@ -60,8 +64,42 @@ struct virtblk_req
 	struct virtio_blk_outhdr out_hdr;
 	struct virtio_scsi_inhdr in_hdr;
 	u8 status;
+	/* Only used by the blk-mq path, sized by vblk->sg_elems. */
+	struct scatterlist sg[];
 };
 
+static int virtblk_result(struct virtblk_req *vbr)
+{
+	int error;
+
+	switch (vbr->status) {
+	case VIRTIO_BLK_S_OK:
+		error = 0;
+		break;
+	case VIRTIO_BLK_S_UNSUPP:
+		error = -ENOTTY;
+		break;
+	default:
+		error = -EIO;
+		break;
+	}
+
+	switch (vbr->req->cmd_type) {
+	case REQ_TYPE_BLOCK_PC:
+		vbr->req->resid_len = vbr->in_hdr.residual;
+		vbr->req->sense_len = vbr->in_hdr.sense_len;
+		vbr->req->errors = vbr->in_hdr.errors;
+		break;
+	case REQ_TYPE_SPECIAL:
+		vbr->req->errors = (error != 0);
+		break;
+	default:
+		break;
+	}
+
+	return error;
+}
+
 static void blk_done(struct virtqueue *vq)
 {
 	struct virtio_blk *vblk = vq->vdev->priv;
@@ -71,54 +109,40 @@ static void blk_done(struct virtqueue *vq)
 
 	spin_lock_irqsave(&vblk->lock, flags);
 	while ((vbr = virtqueue_get_buf(vblk->vq, &len)) != NULL) {
-		int error;
-
-		switch (vbr->status) {
-		case VIRTIO_BLK_S_OK:
-			error = 0;
-			break;
-		case VIRTIO_BLK_S_UNSUPP:
-			error = -ENOTTY;
-			break;
-		default:
-			error = -EIO;
-			break;
-		}
-
-		switch (vbr->req->cmd_type) {
-		case REQ_TYPE_BLOCK_PC:
-			vbr->req->resid_len = vbr->in_hdr.residual;
-			vbr->req->sense_len = vbr->in_hdr.sense_len;
-			vbr->req->errors = vbr->in_hdr.errors;
-			break;
-		case REQ_TYPE_SPECIAL:
-			vbr->req->errors = (error != 0);
-			break;
-		default:
-			break;
+		if (use_mq) {
+			/* virtblk_request_done() runs on the submitting cpu */
+			blk_mq_complete_request(vbr->req);
+			continue;
 		}
 
-		__blk_end_request_all(vbr->req, error);
+		__blk_end_request_all(vbr->req, virtblk_result(vbr));
 		list_del(&vbr->list);
 		mempool_free(vbr, vblk->pool);
 	}
 	/* In case queue is stopped waiting for more buffers. */
-	blk_start_queue(vblk->disk->queue);
+	if (use_mq)
+		blk_mq_start_stopped_hw_queues(vblk->disk->queue);
+	else
+		blk_start_queue(vblk->disk->queue);
 	spin_unlock_irqrestore(&vblk->lock, flags);
 }
 
-static bool do_req(struct request_queue *q, struct virtio_blk *vblk,
-		   struct request *req)
+static void virtblk_request_done(struct request *req)
 {
-	unsigned long num, out = 0, in = 0;
-	struct virtblk_req *vbr;
+	struct virtblk_req *vbr = blk_mq_rq_to_pdu(req);
 
-	vbr = mempool_alloc(vblk->pool, GFP_ATOMIC);
-	if (!vbr)
-		/* When another request finishes we'll try again. */
-		return false;
+	blk_mq_end_io(req, virtblk_result(vbr));
+}
 
-	vbr->req = req;
+/*
+ * Build the descriptor chain for @vbr in @sg and add it to the ring.
+ * Called with vblk->lock held.
+ */
+static int virtblk_add_req(struct request_queue *q, struct virtio_blk *vblk,
+			   struct virtblk_req *vbr, struct scatterlist *sg)
+{
+	struct request *req = vbr->req;
+	unsigned long num, out = 0, in = 0;
 
 	if (req->cmd_flags & REQ_FLUSH) {
 		vbr->out_hdr.type = VIRTIO_BLK_T_FLUSH;
@@ -147,7 +171,7 @@ static bool do_req(struct request_queue *q, struct virtio_blk *vblk,
 		}
 	}
 
-	sg_set_buf(&vblk->sg[out++], &vbr->out_hdr, sizeof(vbr->out_hdr));
+	sg_set_buf(&sg[out++], &vbr->out_hdr, sizeof(vbr->out_hdr));
 
 	/*
 	 * If this is a packet command we need a couple of additional headers.
@@ -156,17 +180,17 @@ static bool do_req(struct request_queue *q, struct virtio_blk *vblk,
 	 * inhdr with additional status information before the normal inhdr.
 	 */
 	if (vbr->req->cmd_type == REQ_TYPE_BLOCK_PC)
-		sg_set_buf(&vblk->sg[out++], vbr->req->cmd, vbr->req->cmd_len);
+		sg_set_buf(&sg[out++], vbr->req->cmd, vbr->req->cmd_len);
 
-	num = blk_rq_map_sg(q, vbr->req, vblk->sg + out);
+	num = blk_rq_map_sg(q, vbr->req, sg + out);
 
 	if (vbr->req->cmd_type == REQ_TYPE_BLOCK_PC) {
-		sg_set_buf(&vblk->sg[num + out + in++], vbr->req->sense, SCSI_SENSE_BUFFERSIZE);
-		sg_set_buf(&vblk->sg[num + out + in++], &vbr->in_hdr,
+		sg_set_buf(&sg[num + out + in++], vbr->req->sense, SCSI_SENSE_BUFFERSIZE);
+		sg_set_buf(&sg[num + out + in++], &vbr->in_hdr,
 			   sizeof(vbr->in_hdr));
 	}
 
-	sg_set_buf(&vblk->sg[num + out + in++], &vbr->status,
+	sg_set_buf(&sg[num + out + in++], &vbr->status,
 		   sizeof(vbr->status));
 
 	if (num) {
@@ -179,7 +203,22 @@ static bool do_req(struct request_queue *q, struct virtio_blk *vblk,
 		}
 	}
 
-	if (virtqueue_add_buf(vblk->vq, vblk->sg, out, in, vbr, GFP_ATOMIC)<0) {
+	return virtqueue_add_buf(vblk->vq, sg, out, in, vbr, GFP_ATOMIC);
+}
+
+static bool do_req(struct request_queue *q, struct virtio_blk *vblk,
+		   struct request *req)
+{
+	struct virtblk_req *vbr;
+
+	vbr = mempool_alloc(vblk->pool, GFP_ATOMIC);
+	if (!vbr)
+		/* When another request finishes we'll try again. */
+		return false;
+
+	vbr->req = req;
+
+	if (virtblk_add_req(q, vblk, vbr, vblk->sg) < 0) {
 		mempool_free(vbr, vblk->pool);
 		return false;
 	}
@@ -211,6 +250,52 @@ static void do_virtblk_request(struct request_queue *q)
 		virtqueue_kick(vblk->vq);
 }
 
+static int virtblk_queue_rq(struct blk_mq_hw_ctx *hctx, struct request *req)
+{
+	struct virtio_blk *vblk = hctx->queue->queuedata;
+	struct virtblk_req *vbr = blk_mq_rq_to_pdu(req);
+	unsigned long flags;
+
+	BUG_ON(req->nr_phys_segments + 2 > vblk->sg_elems);
+
+	vbr->req = req;
+	sg_init_table(vbr->sg, vblk->sg_elems);
+
+	spin_lock_irqsave(&vblk->lock, flags);
+	if (virtblk_add_req(hctx->queue, vblk, vbr, vbr->sg) < 0) {
+		/* blk_done() restarts us once buffers are returned. */
+		blk_mq_stop_hw_queue(hctx);
+		spin_unlock_irqrestore(&vblk->lock, flags);
+		return BLK_MQ_RQ_QUEUE_BUSY;
+	}
+	virtqueue_kick(vblk->vq);
+	spin_unlock_irqrestore(&vblk->lock, flags);
+
+	return BLK_MQ_RQ_QUEUE_OK;
+}
+
+static struct blk_mq_ops virtio_mq_ops = {
+	.queue_rq	= virtblk_queue_rq,
+	.map_queue	= blk_mq_map_queue,
+	.complete	= virtblk_request_done,
+};
+
+static struct request_queue *virtblk_init_mq(struct virtio_blk *vblk)
+{
+	struct blk_mq_reg reg = {
+		.ops		= &virtio_mq_ops,
+		.nr_hw_queues	= 1,
+		.queue_depth	= min_t(unsigned int, BLK_MQ_MAX_DEPTH,
+					virtqueue_get_vring_size(vblk->vq)),
+		.cmd_size	= sizeof(struct virtblk_req) +
+				  sizeof(struct scatterlist) * vblk->sg_elems,
+		.numa_node	= NUMA_NO_NODE,
+		.flags		= BLK_MQ_F_SHOULD_MERGE,
+	};
+
+	return blk_mq_init_queue(&reg, vblk);
+}
+
 /* return id (s/n) string for *disk to *id_str
  */
 static int virtblk_get_id(struct gendisk *disk, char *id_str)
@@ -463,7 +548,11 @@ static int __devinit virtblk_probe(struct virtio_device *vdev)
 		goto out_mempool;
 	}
 
-	q = vblk->disk->queue = blk_init_queue(do_virtblk_request, &vblk->lock);
+	if (use_mq)
+		q = virtblk_init_mq(vblk);
+	else
+		q = blk_init_queue(do_virtblk_request, &vblk->lock);
+	vblk->disk->queue = q;
 	if (!q) {
 		err = -ENOMEM;
 		goto out_put_disk;
@@ -621,9 +710,13 @@ static int virtblk_freeze(struct virtio_device *vdev)
 
 	flush_work(&vblk->config_work);
 
-	spin_lock_irq(vblk->disk->queue->queue_lock);
-	blk_stop_queue(vblk->disk->queue);
-	spin_unlock_irq(vblk->disk->queue->queue_lock);
+	if (use_mq) {
+		blk_mq_stop_hw_queues(vblk->disk->queue);
+	} else {
+		spin_lock_irq(vblk->disk->queue->queue_lock);
+		blk_stop_queue(vblk->disk->queue);
+		spin_unlock_irq(vblk->disk->queue->queue_lock);
+	}
 	blk_sync_queue(vblk->disk->queue);
 
 	vdev->config->del_vqs(vdev);
@@ -637,7 +730,9 @@ static int virtblk_restore(struct virtio_device *vdev)
 
 	vblk->config_enable = true;
 	ret = init_vq(vdev->priv);
-	if (!ret) {
+	if (!ret && use_mq) {
+		blk_mq_start_stopped_hw_queues(vblk->disk->queue);
+	} else if (!ret) {
 		spin_lock_irq(vblk->disk->queue->queue_lock);
 		blk_start_queue(vblk->disk->queue);
 		spin_unlock_irq(vblk->disk->queue->queue_lock);
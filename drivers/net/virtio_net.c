@@ -26,6 +26,7 @@
 #include <linux/scatterlist.h>
 #include <linux/if_vlan.h>
 #include <linux/slab.h>
+#include <net/busy_poll.h>
 
 static int napi_weight = 128;
 module_param(napi_weight, int, 0444);
@@ -38,6 +39,16 @@ module_param(gso, bool, 0444);
 #define MAX_PACKET_LEN (ETH_HLEN + VLAN_HLEN + ETH_DATA_LEN)
 #define GOOD_COPY_LEN	128
 
+/* Small receive buffers are page fragments laid out as the skb head they
+ * become: headroom, the virtio header, the frame, then room for the
+ * skb_shared_info.  The padded header keeps the IP header aligned.
+ */
+#define VIRTNET_RX_PAD (NET_SKB_PAD + NET_IP_ALIGN)
+#define VIRTNET_RX_HEADROOM (VIRTNET_RX_PAD + sizeof(struct padded_vnet_hdr))
+#define VIRTNET_SMALL_BUF_LEN \
+	(SKB_DATA_ALIGN(VIRTNET_RX_HEADROOM + MAX_PACKET_LEN) + \
+	 SKB_DATA_ALIGN(sizeof(struct skb_shared_info)))
+
 #define VIRTNET_SEND_COMMAND_SG_MAX    2
 #define VIRTNET_DRIVER_VERSION "1.0.0"
 
@@ -220,6 +231,26 @@ static struct sk_buff *page_to_skb(struct virtnet_info *vi,
 	return skb;
 }
 
+/* Wrap a small buffer filled by the device in an skb, without a copy */
+static struct sk_buff *receive_small(struct virtnet_info *vi, void *buf,
+				     unsigned int len)
+{
+	struct sk_buff *skb;
+
+	skb = build_skb(buf, VIRTNET_SMALL_BUF_LEN);
+	if (unlikely(!skb))
+		return NULL;
+
+	memcpy(skb_vnet_hdr(skb), buf + VIRTNET_RX_PAD,
+	       sizeof(struct virtio_net_hdr));
+	len -= sizeof(struct virtio_net_hdr);
+	skb_reserve(skb, VIRTNET_RX_HEADROOM);
+	skb_put(skb, min_t(unsigned int, len, MAX_PACKET_LEN));
+	skb->dev = vi->dev;
+
+	return skb;
+}
+
 static int receive_mergeable(struct virtnet_info *vi, struct sk_buff *skb)
 {
 	struct skb_vnet_hdr *hdr = skb_vnet_hdr(skb);
@@ -266,14 +297,17 @@ static void receive_buf(struct net_device *dev, void *buf, unsigned int len)
 		if (vi->mergeable_rx_bufs || vi->big_packets)
 			give_pages(vi, buf);
 		else
-			dev_kfree_skb(buf);
+			put_page(virt_to_head_page(buf));
 		return;
 	}
 
 	if (!vi->mergeable_rx_bufs && !vi->big_packets) {
-		skb = buf;
-		len -= sizeof(struct virtio_net_hdr);
-		skb_trim(skb, len);
+		skb = receive_small(vi, buf, len);
+		if (unlikely(!skb)) {
+			dev->stats.rx_dropped++;
+			put_page(virt_to_head_page(buf));
+			return;
+		}
 	} else {
 		page = buf;
 		skb = page_to_skb(vi, page, len);
@@ -345,6 +379,7 @@ static void receive_buf(struct net_device *dev, void *buf, unsigned int len)
 		skb_shinfo(skb)->gso_segs = 0;
 	}
 
+	skb_mark_napi_id(skb, &vi->napi);
 	netif_receive_skb(skb);
 	return;
 
@@ -355,24 +390,20 @@ frame_err:
 
 static int add_recvbuf_small(struct virtnet_info *vi, gfp_t gfp)
 {
-	struct sk_buff *skb;
-	struct skb_vnet_hdr *hdr;
+	char *buf;
 	int err;
 
-	skb = __netdev_alloc_skb_ip_align(vi->dev, MAX_PACKET_LEN, gfp);
-	if (unlikely(!skb))
+	buf = __netdev_alloc_frag(VIRTNET_SMALL_BUF_LEN, gfp);
+	if (unlikely(!buf))
 		return -ENOMEM;
 
-	skb_put(skb, MAX_PACKET_LEN);
-
-	hdr = skb_vnet_hdr(skb);
-	sg_set_buf(vi->rx_sg, &hdr->hdr, sizeof hdr->hdr);
+	sg_set_buf(vi->rx_sg, buf + VIRTNET_RX_PAD,
+		   sizeof(struct virtio_net_hdr));
+	sg_set_buf(vi->rx_sg + 1, buf + VIRTNET_RX_HEADROOM, MAX_PACKET_LEN);
 
-	skb_to_sgvec(skb, vi->rx_sg + 1, 0, skb->len);
-
-	err = virtqueue_add_buf(vi->rvq, vi->rx_sg, 0, 2, skb, gfp);
+	err = virtqueue_add_buf(vi->rvq, vi->rx_sg, 0, 2, buf, gfp);
 	if (err < 0)
-		dev_kfree_skb(skb);
+		put_page(virt_to_head_page(buf));
 
 	return err;
 }
@@ -1146,7 +1177,7 @@ static void free_unused_bufs(struct virtnet_info *vi)
 		if (vi->mergeable_rx_bufs || vi->big_packets)
 			give_pages(vi, buf);
 		else
-			dev_kfree_skb(buf);
+			put_page(virt_to_head_page(buf));
 		--vi->num;
 	}
 	BUG_ON(vi->num != 0);
@@ -0,0 +1,708 @@
+/*
+ * virtio-blk server in host kernel.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ *
+ * Requests are taken from the guest ring by the vhost worker.  On a block
+ * device backend they are mapped straight from guest memory into bios,
+ * which complete back on the worker; on a regular file they are served
+ * with synchronous reads and writes.  Completions are signalled through
+ * the call eventfd, normally a KVM irqfd.
+ */
+
+#include <linux/compat.h>
+#include <linux/eventfd.h>
+#include <linux/vhost.h>
+#include <linux/virtio_blk.h>
+#include <linux/miscdevice.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/file.h>
+#include <linux/fs.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/llist.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+
+#include "vhost.h"
+
+/* Max number of requests started before requeueing the job.
+ * Using this limit prevents one virtqueue from starving others. */
+#define VHOST_BLK_WEIGHT 256
+
+/* Max number of pages a request on a block device may pin: what one bio
+ * carries.  Userspace should advertise size_max and seg_max to the guest
+ * to match; bigger requests fail with VIRTIO_BLK_S_IOERR. */
+#define VHOST_BLK_MAX_PAGES BIO_MAX_PAGES
+
+enum {
+	VHOST_BLK_VQ = 0,
+	VHOST_BLK_VQ_MAX = 1,
+};
+
+enum {
+	VHOST_BLK_FEATURES = (1ULL << VIRTIO_F_NOTIFY_ON_EMPTY) |
+			     (1ULL << VIRTIO_RING_F_INDIRECT_DESC) |
+			     (1ULL << VIRTIO_RING_F_EVENT_IDX) |
+			     (1ULL << VIRTIO_RING_F_PACKED),
+};
+
+struct vhost_blk {
+	struct vhost_dev dev;
+	struct vhost_virtqueue vqs[VHOST_BLK_VQ_MAX];
+	/* Requests whose bios are all done, to be completed by the worker */
+	struct llist_head done;
+	struct vhost_work done_work;
+	/* Requests submitted as bios and not yet completed to the guest */
+	atomic_t inflight;
+	wait_queue_head_t inflight_wait;
+};
+
+/* A request served with bios */
+struct vhost_blk_req {
+	struct llist_node node;
+	struct vhost_blk *blk;
+	u8 __user *status;
+	u16 head;
+	/* Whether data goes to guest memory */
+	bool to_guest;
+	/* Bytes written to guest memory, status excluded */
+	unsigned int len;
+	/* Bios in flight, plus one held while submitting */
+	atomic_t pending;
+	int error;
+	int nr_pages;
+	struct page *pages[0];
+};
+
+static unsigned long iov_num_pages(const struct iovec *iov, int iov_count)
+{
+	unsigned long base, n = 0;
+	int i;
+
+	for (i = 0; i < iov_count; ++i) {
+		if (!iov[i].iov_len)
+			continue;
+		base = (unsigned long)iov[i].iov_base;
+		n += ((base + iov[i].iov_len + PAGE_SIZE - 1) >> PAGE_SHIFT) -
+		     (base >> PAGE_SHIFT);
+	}
+	return n;
+}
+
+/* Caller must have VQ lock */
+static void vhost_blk_complete(struct vhost_blk *blk, u16 head,
+			       u8 __user *status, u8 s, unsigned int len)
+{
+	struct vhost_virtqueue *vq = &blk->vqs[VHOST_BLK_VQ];
+
+	if (put_user(s, status))
+		vq_err(vq, "Failed to write status at %p\n", status);
+	vhost_add_used(vq, head, len + sizeof(s));
+}
+
+static void vhost_blk_req_free(struct vhost_blk_req *req)
+{
+	int i;
+
+	for (i = 0; i < req->nr_pages; ++i) {
+		if (req->to_guest)
+			set_page_dirty_lock(req->pages[i]);
+		put_page(req->pages[i]);
+	}
+	kfree(req);
+}
+
+static void vhost_blk_req_put(struct vhost_blk_req *req)
+{
+	struct vhost_blk *blk = req->blk;
+
+	if (atomic_dec_and_test(&req->pending)) {
+		llist_add(&req->node, &blk->done);
+		vhost_vq_work_queue(&blk->vqs[VHOST_BLK_VQ], &blk->done_work);
+	}
+}
+
+static void vhost_blk_bio_end_io(struct bio *bio, int error)
+{
+	struct vhost_blk_req *req = bio->bi_private;
+
+	if (!error && !test_bit(BIO_UPTODATE, &bio->bi_flags))
+		error = -EIO;
+	if (error)
+		req->error = error;
+	bio_put(bio);
+	vhost_blk_req_put(req);
+}
+
+static struct bio *vhost_blk_bio_alloc(struct vhost_blk_req *req,
+				       struct block_device *bdev,
+				       sector_t sector, int nr_pages)
+{
+	struct bio *bio;
+
+	bio = bio_alloc(GFP_KERNEL, min(nr_pages, BIO_MAX_PAGES));
+	if (!bio)
+		return NULL;
+	bio->bi_sector = sector;
+	bio->bi_bdev = bdev;
+	bio->bi_private = req;
+	bio->bi_end_io = vhost_blk_bio_end_io;
+	return bio;
+}
+
+static void vhost_blk_bio_submit(struct vhost_blk_req *req, struct bio *bio,
+				 int rw)
+{
+	atomic_inc(&req->pending);
+	submit_bio(rw, bio);
+}
+
+/* Pin the data buffers of a request, map them into bios and submit those.
+ * The request is completed by handle_blk_done() once the last bio is done;
+ * a flush carries no data and is a single empty bio.  Returns an error
+ * only if nothing was submitted.  Caller must have VQ lock. */
+static int vhost_blk_req_bio(struct vhost_blk *blk, struct block_device *bdev,
+			     u16 head, u8 __user *status, int rw,
+			     sector_t sector, struct iovec *iov, int iov_count)
+{
+	struct vhost_blk_req *req;
+	struct bio *bio = NULL;
+	unsigned long base;
+	size_t size, bytes, len = 0;
+	unsigned long nr_pages;
+	int i, n, r, pg;
+
+	nr_pages = iov_num_pages(iov, iov_count);
+	if (nr_pages > VHOST_BLK_MAX_PAGES)
+		return -E2BIG;
+	req = kmalloc(sizeof(*req) + nr_pages * sizeof(struct page *),
+		      GFP_KERNEL);
+	if (!req)
+		return -ENOMEM;
+	req->blk = blk;
+	req->status = status;
+	req->head = head;
+	req->to_guest = !(rw & WRITE);
+	atomic_set(&req->pending, 1);
+	req->error = 0;
+	req->nr_pages = 0;
+
+	for (i = 0; i < iov_count; ++i) {
+		base = (unsigned long)iov[i].iov_base;
+		size = iov[i].iov_len;
+		if (!size)
+			continue;
+		/* Whole sectors only, as for O_DIRECT */
+		if ((base | size) & 511) {
+			r = -EINVAL;
+			goto err;
+		}
+		n = ((base + size + PAGE_SIZE - 1) >> PAGE_SHIFT) -
+		    (base >> PAGE_SHIFT);
+		r = get_user_pages_fast(base, n, req->to_guest,
+					req->pages + req->nr_pages);
+		if (r > 0)
+			req->nr_pages += r;
+		if (r != n) {
+			r = -EFAULT;
+			goto err;
+		}
+		len += size;
+	}
+	req->len = req->to_guest ? len : 0;
+	atomic_inc(&blk->inflight);
+
+	pg = 0;
+	for (i = 0; i < iov_count; ++i) {
+		base = (unsigned long)iov[i].iov_base;
+		size = iov[i].iov_len;
+		while (size) {
+			if (!bio) {
+				bio = vhost_blk_bio_alloc(req, bdev, sector,
+							  req->nr_pages - pg);
+				if (!bio) {
+					req->error = -ENOMEM;
+					goto out;
+				}
+			}
+			bytes = min_t(size_t, PAGE_SIZE - (base & ~PAGE_MASK),
+				      size);
+			if (bio_add_page(bio, req->pages[pg], bytes,
+					 base & ~PAGE_MASK) < bytes) {
+				/* Full: send it and start another one */
+				if (!bio->bi_vcnt) {
+					bio_put(bio);
+					req->error = -EIO;
+					goto out;
+				}
+				vhost_blk_bio_submit(req, bio, rw);
+				bio = NULL;
+				continue;
+			}
+			sector += bytes >> 9;
+			base += bytes;
+			size -= bytes;
+			++pg;
+		}
+	}
+	if (!req->nr_pages) {
+		bio = vhost_blk_bio_alloc(req, bdev, sector, 0);
+		if (!bio)
+			req->error = -ENOMEM;
+	}
+	if (bio)
+		vhost_blk_bio_submit(req, bio, rw);
+out:
+	vhost_blk_req_put(req);
+	return 0;
+err:
+	vhost_blk_req_free(req);
+	return r;
+}
+
+/* Start the request at head.  I/O errors go to the guest in the status
+ * byte; returns an error only for a request we cannot make sense of.
+ * Caller must have VQ lock. */
+static int vhost_blk_req_start(struct vhost_blk *blk, struct file *file,
+			       u16 head, unsigned out, unsigned in)
+{
+	struct vhost_virtqueue *vq = &blk->vqs[VHOST_BLK_VQ];
+	struct inode *inode = file->f_mapping->host;
+	struct block_device *bdev = NULL;
+	struct virtio_blk_outhdr hdr;
+	struct iovec *iov;
+	u8 __user *status;
+	u8 s = VIRTIO_BLK_S_OK;
+	unsigned int len = 0;
+	int iov_count, rw;
+	ssize_t r;
+	loff_t pos;
+
+	if (unlikely(!out || !in || vq->iov[0].iov_len < sizeof hdr)) {
+		vq_err(vq, "Unexpected descriptor format for request: "
+		       "out %d, in %d\n", out, in);
+		return -EINVAL;
+	}
+	if (unlikely(copy_from_user(&hdr, vq->iov[0].iov_base, sizeof hdr))) {
+		vq_err(vq, "Failed to read request header at %p\n",
+		       vq->iov[0].iov_base);
+		return -EFAULT;
+	}
+	vq->iov[0].iov_base += sizeof hdr;
+	vq->iov[0].iov_len -= sizeof hdr;
+
+	/* The status is the last byte of the last buffer for us to write */
+	iov = vq->iov + out + in - 1;
+	if (unlikely(!iov->iov_len)) {
+		vq_err(vq, "No room for request status\n");
+		return -EINVAL;
+	}
+	iov->iov_len--;
+	status = iov->iov_base + iov->iov_len;
+
+	if (S_ISBLK(inode->i_mode))
+		bdev = I_BDEV(inode);
+
+	switch (hdr.type & ~VIRTIO_BLK_T_BARRIER) {
+	case VIRTIO_BLK_T_IN:
+	case VIRTIO_BLK_T_OUT:
+		if (hdr.type & VIRTIO_BLK_T_OUT) {
+			rw = WRITE;
+			iov = vq->iov;
+			iov_count = out;
+		} else {
+			rw = READ;
+			iov = vq->iov + out;
+			iov_count = in;
+		}
+		if (rw == WRITE && !(file->f_mode & FMODE_WRITE)) {
+			s = VIRTIO_BLK_S_IOERR;
+			break;
+		}
+		if (!iov_length(iov, iov_count))
+			break;
+		if (bdev) {
+			if (!vhost_blk_req_bio(blk, bdev, head, status, rw,
+					       hdr.sector, iov, iov_count))
+				return 0;
+			s = VIRTIO_BLK_S_IOERR;
+			break;
+		}
+		/* vhost workers run with KERNEL_DS: guest buffers will do */
+		pos = (loff_t)hdr.sector << 9;
+		if (rw == WRITE)
+			r = vfs_writev(file, (const struct iovec __user *)iov,
+				       iov_count, &pos);
+		else
+			r = vfs_readv(file, (const struct iovec __user *)iov,
+				      iov_count, &pos);
+		if (r != iov_length(iov, iov_count))
+			s = VIRTIO_BLK_S_IOERR;
+		else if (rw == READ)
+			len = r;
+		break;
+	case VIRTIO_BLK_T_FLUSH:
+		if (bdev) {
+			if (!vhost_blk_req_bio(blk, bdev, head, status,
+					       WRITE_FLUSH, 0, NULL, 0))
+				return 0;
+			s = VIRTIO_BLK_S_IOERR;
+		} else if (vfs_fsync(file, 1))
+			s = VIRTIO_BLK_S_IOERR;
+		break;
+	default:
+		s = VIRTIO_BLK_S_UNSUPP;
+		break;
+	}
+
+	vhost_blk_complete(blk, head, status, s, len);
+	vhost_signal(&blk->dev, vq);
+	return 0;
+}
+
+/* The backend only changes under the VQ lock, which we hold throughout. */
+static void handle_blk(struct vhost_blk *blk)
+{
+	struct vhost_virtqueue *vq = &blk->vqs[VHOST_BLK_VQ];
+	struct blk_plug plug;
+	struct file *file;
+	unsigned out, in;
+	int head, nreq = 0;
+
+	mutex_lock(&vq->mutex);
+	file = rcu_dereference_protected(vq->private_data,
+					 lockdep_is_held(&vq->mutex));
+	if (!file) {
+		mutex_unlock(&vq->mutex);
+		return;
+	}
+
+	vhost_disable_notify(&blk->dev, vq);
+	blk_start_plug(&plug);
+
+	for (;;) {
+		head = vhost_get_vq_desc(&blk->dev, vq, vq->iov,
+					 ARRAY_SIZE(vq->iov),
+					 &out, &in,
+					 NULL, NULL);
+		/* On error, stop handling until the next kick. */
+		if (unlikely(head < 0))
+			break;
+		/* Nothing new?  Wait for eventfd to tell us they refilled. */
+		if (head == vq->num) {
+			if (unlikely(vhost_enable_notify(&blk->dev, vq))) {
+				vhost_disable_notify(&blk->dev, vq);
+				continue;
+			}
+			break;
+		}
+		if (vhost_blk_req_start(blk, file, head, out, in) < 0) {
+			vhost_discard_vq_desc(vq, 1);
+			break;
+		}
+		if (unlikely(++nreq >= VHOST_BLK_WEIGHT)) {
+			vhost_poll_queue(&vq->poll);
+			break;
+		}
+	}
+
+	blk_finish_plug(&plug);
+	mutex_unlock(&vq->mutex);
+}
+
+static void handle_blk_kick(struct vhost_work *work)
+{
+	struct vhost_virtqueue *vq = container_of(work, struct vhost_virtqueue,
+						  poll.work);
+	struct vhost_blk *blk = container_of(vq->dev, struct vhost_blk, dev);
+
+	handle_blk(blk);
+}
+
+/* Complete the requests whose bios are done */
+static void handle_blk_done(struct vhost_work *work)
+{
+	struct vhost_blk *blk = container_of(work, struct vhost_blk,
+					     done_work);
+	struct vhost_virtqueue *vq = &blk->vqs[VHOST_BLK_VQ];
+	struct vhost_blk_req *req;
+	struct llist_node *node;
+	int n = 0;
+
+	node = llist_del_all(&blk->done);
+	if (!node)
+		return;
+
+	mutex_lock(&vq->mutex);
+	while (node) {
+		req = llist_entry(node, struct vhost_blk_req, node);
+		node = llist_next(node);
+		vhost_blk_complete(blk, req->head, req->status,
+				   req->error ? VIRTIO_BLK_S_IOERR :
+						VIRTIO_BLK_S_OK,
+				   req->error ? 0 : req->len);
+		vhost_blk_req_free(req);
+		++n;
+	}
+	vhost_signal(&blk->dev, vq);
+	mutex_unlock(&vq->mutex);
+
+	if (atomic_sub_and_test(n, &blk->inflight))
+		wake_up(&blk->inflight_wait);
+}
+
+static int vhost_blk_open(struct inode *inode, struct file *f)
+{
+	struct vhost_blk *blk = kmalloc(sizeof *blk, GFP_KERNEL);
+	int r;
+
+	if (!blk)
+		return -ENOMEM;
+
+	blk->vqs[VHOST_BLK_VQ].handle_kick = handle_blk_kick;
+	r = vhost_dev_init(&blk->dev, blk->vqs, VHOST_BLK_VQ_MAX, false);
+	if (r < 0) {
+		kfree(blk);
+		return r;
+	}
+
+	init_llist_head(&blk->done);
+	vhost_work_init(&blk->done_work, handle_blk_done);
+	atomic_set(&blk->inflight, 0);
+	init_waitqueue_head(&blk->inflight_wait);
+
+	f->private_data = blk;
+
+	return 0;
+}
+
+static struct file *vhost_blk_stop(struct vhost_blk *blk)
+{
+	struct vhost_virtqueue *vq = &blk->vqs[VHOST_BLK_VQ];
+	struct file *file;
+
+	mutex_lock(&vq->mutex);
+	file = rcu_dereference_protected(vq->private_data,
+					 lockdep_is_held(&vq->mutex));
+	rcu_assign_pointer(vq->private_data, NULL);
+	mutex_unlock(&vq->mutex);
+	return file;
+}
+
+/* Wait for the kick handler and for all requests in flight, after which
+ * no I/O refers to the backend any more. */
+static void vhost_blk_flush(struct vhost_blk *blk)
+{
+	struct vhost_virtqueue *vq = &blk->vqs[VHOST_BLK_VQ];
+
+	vhost_poll_flush(&vq->poll);
+	wait_event(blk->inflight_wait, !atomic_read(&blk->inflight));
+	vhost_vq_work_flush(vq, &blk->done_work);
+}
+
+static int vhost_blk_release(struct inode *inode, struct file *f)
+{
+	struct vhost_blk *blk = f->private_data;
+	struct file *file;
+
+	file = vhost_blk_stop(blk);
+	vhost_blk_flush(blk);
+	vhost_dev_cleanup(&blk->dev, false);
+	if (file)
+		fput(file);
+	kfree(blk);
+	return 0;
+}
+
+static struct file *vhost_blk_get_file(int fd)
+{
+	struct file *file;
+	umode_t mode;
+
+	/* special case to disable backend */
+	if (fd == -1)
+		return NULL;
+	file = fget(fd);
+	if (!file)
+		return ERR_PTR(-EBADF);
+
+	mode = file->f_mapping->host->i_mode;
+	if ((!S_ISBLK(mode) && !S_ISREG(mode)) ||
+	    !(file->f_mode & FMODE_READ)) {
+		fput(file);
+		return ERR_PTR(-EINVAL);
+	}
+	return file;
+}
+
+static long vhost_blk_set_backend(struct vhost_blk *blk, unsigned index,
+				  int fd)
+{
+	struct file *file, *oldfile;
+	struct vhost_virtqueue *vq;
+	int r;
+
+	mutex_lock(&blk->dev.mutex);
+	r = vhost_dev_check_owner(&blk->dev);
+	if (r)
+		goto err;
+
+	if (index >= VHOST_BLK_VQ_MAX) {
+		r = -ENOBUFS;
+		goto err;
+	}
+	vq = blk->vqs + index;
+	mutex_lock(&vq->mutex);
+
+	/* Verify that ring has been setup correctly. */
+	if (!vhost_vq_access_ok(vq)) {
+		r = -EFAULT;
+		goto err_vq;
+	}
+	file = vhost_blk_get_file(fd);
+	if (IS_ERR(file)) {
+		r = PTR_ERR(file);
+		goto err_vq;
+	}
+
+	oldfile = rcu_dereference_protected(vq->private_data,
+					    lockdep_is_held(&vq->mutex));
+	if (file != oldfile) {
+		rcu_assign_pointer(vq->private_data, file);
+		r = vhost_init_used(vq);
+		if (r)
+			goto err_used;
+		/* Pick up requests queued while we had no backend */
+		if (file)
+			vhost_poll_queue(&vq->poll);
+	}
+
+	mutex_unlock(&vq->mutex);
+
+	if (oldfile) {
+		vhost_blk_flush(blk);
+		fput(oldfile);
+	}
+
+	mutex_unlock(&blk->dev.mutex);
+	return 0;
+
+err_used:
+	rcu_assign_pointer(vq->private_data, oldfile);
+	if (file)
+		fput(file);
+err_vq:
+	mutex_unlock(&vq->mutex);
+err:
+	mutex_unlock(&blk->dev.mutex);
+	return r;
+}
+
+static long vhost_blk_reset_owner(struct vhost_blk *blk)
+{
+	struct file *file = NULL;
+	long err;
+
+	mutex_lock(&blk->dev.mutex);
+	err = vhost_dev_check_owner(&blk->dev);
+	if (err)
+		goto done;
+	file = vhost_blk_stop(blk);
+	vhost_blk_flush(blk);
+	err = vhost_dev_reset_owner(&blk->dev);
+done:
+	mutex_unlock(&blk->dev.mutex);
+	if (file)
+		fput(file);
+	return err;
+}
+
+static int vhost_blk_set_features(struct vhost_blk *blk, u64 features)
+{
+	mutex_lock(&blk->dev.mutex);
+	blk->dev.acked_features = features;
+	smp_wmb();
+	vhost_poll_flush(&blk->vqs[VHOST_BLK_VQ].poll);
+	mutex_unlock(&blk->dev.mutex);
+	return 0;
+}
+
+static long vhost_blk_ioctl(struct file *f, unsigned int ioctl,
+			    unsigned long arg)
+{
+	struct vhost_blk *blk = f->private_data;
+	void __user *argp = (void __user *)arg;
+	u64 __user *featurep = argp;
+	struct vhost_vring_file backend;
+	u64 features;
+	int r;
+
+	switch (ioctl) {
+	case VHOST_BLK_SET_BACKEND:
+		if (copy_from_user(&backend, argp, sizeof backend))
+			return -EFAULT;
+		return vhost_blk_set_backend(blk, backend.index, backend.fd);
+	case VHOST_GET_FEATURES:
+		features = VHOST_BLK_FEATURES;
+		if (copy_to_user(featurep, &features, sizeof features))
+			return -EFAULT;
+		return 0;
+	case VHOST_SET_FEATURES:
+		if (copy_from_user(&features, featurep, sizeof features))
+			return -EFAULT;
+		if (features & ~VHOST_BLK_FEATURES)
+			return -EOPNOTSUPP;
+		return vhost_blk_set_features(blk, features);
+	case VHOST_RESET_OWNER:
+		return vhost_blk_reset_owner(blk);
+	default:
+		mutex_lock(&blk->dev.mutex);
+		r = vhost_dev_ioctl(&blk->dev, ioctl, arg);
+		vhost_poll_flush(&blk->vqs[VHOST_BLK_VQ].poll);
+		mutex_unlock(&blk->dev.mutex);
+		return r;
+	}
+}
+
+#ifdef CONFIG_COMPAT
+static long vhost_blk_compat_ioctl(struct file *f, unsigned int ioctl,
+				   unsigned long arg)
+{
+	return vhost_blk_ioctl(f, ioctl, (unsigned long)compat_ptr(arg));
+}
+#endif
+
+static const struct file_operations vhost_blk_fops = {
+	.owner          = THIS_MODULE,
+	.release        = vhost_blk_release,
+	.unlocked_ioctl = vhost_blk_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl   = vhost_blk_compat_ioctl,
+#endif
+	.open           = vhost_blk_open,
+	.llseek		= noop_llseek,
+};
+
+static struct miscdevice vhost_blk_misc = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "vhost-blk",
+	.fops = &vhost_blk_fops,
+};
+
+static int vhost_blk_init(void)
+{
+	return misc_register(&vhost_blk_misc);
+}
+module_init(vhost_blk_init);
+
+static void vhost_blk_exit(void)
+{
+	misc_deregister(&vhost_blk_misc);
+}
+module_exit(vhost_blk_exit);
+
+MODULE_LICENSE("GPL v2");
+MODULE_DESCRIPTION("Host kernel accelerator for virtio blk");
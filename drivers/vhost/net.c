@@ -33,6 +33,10 @@ static int experimental_zcopytx;
 module_param(experimental_zcopytx, int, 0444);
 MODULE_PARM_DESC(experimental_zcopytx, "Enable Experimental Zero Copy TX");
 
+static bool vq_workers;
+module_param(vq_workers, bool, 0444);
+MODULE_PARM_DESC(vq_workers, "Run RX and TX of a device in separate threads");
+
 /* Max number of bytes transferred before requeueing the job.
  * Using this limit prevents one virtqueue from starving others. */
 #define VHOST_NET_WEIGHT 0x80000
@@ -41,6 +45,9 @@ MODULE_PARM_DESC(experimental_zcopytx, "Enable Experimental Zero Copy TX");
 #define VHOST_MAX_PEND 128
 #define VHOST_GOODCOPY_LEN 256
 
+/* Smallest busy poll budget in usec; a budget shrunk below this is 0. */
+#define VHOST_NET_BUSYLOOP_MIN 8
+
 enum {
 	VHOST_NET_VQ_RX = 0,
 	VHOST_NET_VQ_TX = 1,
@@ -53,10 +60,26 @@ enum vhost_net_poll_state {
 	VHOST_NET_POLL_STOPPED = 2,
 };
 
+/* Busy polling state of a ring.  Protected by the vq lock. */
+struct vhost_net_busyloop {
+	/* Current budget in usec, within [0, busyloop_timeout] */
+	unsigned int budget;
+	/* When the ring last went idle, in usec; 0 while it is busy */
+	u64 idle_since;
+	u64 polls;
+	u64 hits;
+	u64 misses;
+	u64 sleeps;
+};
+
 struct vhost_net {
 	struct vhost_dev dev;
 	struct vhost_virtqueue vqs[VHOST_NET_VQ_MAX];
 	struct vhost_poll poll[VHOST_NET_VQ_MAX];
+	struct vhost_net_busyloop busyloop[VHOST_NET_VQ_MAX];
+	/* Upper bound of the busy poll budgets, in usec.  0 disables busy
+	 * polling.  Written under the device lock. */
+	unsigned int busyloop_timeout;
 	/* Tells us whether we are polling a socket for TX.
 	 * We only do this when socket buffer fills up.
 	 * Protected by tx vq lock. */
@@ -125,11 +148,95 @@ static void tx_poll_start(struct vhost_net *net, struct socket *sock)
 	net->tx_poll_state = VHOST_NET_POLL_STARTED;
 }
 
+/* Precision does not matter much, only that a poll is bounded. */
+static u64 vhost_net_busy_clock(void)
+{
+	return local_clock() >> 10;
+}
+
+/* Called with the vq lock held when a ring starts to work.  If it was idle
+ * for less than the largest budget, a busy poll would have caught the
+ * notification that woke us up: grow the budget. */
+static void vhost_net_busy_adapt(struct vhost_net *net,
+				 struct vhost_net_busyloop *bl)
+{
+	unsigned int max = ACCESS_ONCE(net->busyloop_timeout);
+	u64 idle_since = bl->idle_since;
+
+	bl->idle_since = 0;
+	if (bl->budget >= max) {
+		bl->budget = max;
+		return;
+	}
+	if (idle_since && vhost_net_busy_clock() - idle_since <= max)
+		bl->budget = min(max, bl->budget ?
+				      bl->budget * 2 : VHOST_NET_BUSYLOOP_MIN);
+}
+
+/* Called with the vq lock held when a ring is about to wait for a
+ * notification. */
+static void vhost_net_busy_idle(struct vhost_net_busyloop *bl)
+{
+	bl->idle_since = vhost_net_busy_clock();
+	bl->sleeps++;
+}
+
+static bool vhost_net_busy_hit(struct vhost_net *net,
+			       struct vhost_virtqueue *vq, struct sock *sk)
+{
+	if (sk)
+		return !skb_queue_empty(&sk->sk_receive_queue);
+	return !vhost_vq_avail_empty(&net->dev, vq);
+}
+
+/* Called with the vq lock held and notification disabled when a ring ran
+ * dry.  Poll the avail ring or, given a socket, its receive queue for at
+ * most the current budget instead of going to sleep right away, unless
+ * the worker is wanted elsewhere.  A poll that runs out of budget halves
+ * it.  Returns true if work showed up. */
+static bool vhost_net_busy_poll(struct vhost_net *net,
+				struct vhost_virtqueue *vq,
+				struct vhost_net_busyloop *bl,
+				struct sock *sk)
+{
+	u64 endtime;
+	bool timeout = false;
+
+	if (!bl->budget)
+		return false;
+
+	bl->polls++;
+	endtime = vhost_net_busy_clock() + bl->budget;
+	while (!vhost_net_busy_hit(net, vq, sk)) {
+		if (need_resched() || vhost_vq_has_work(vq))
+			break;
+		if (vhost_net_busy_clock() > endtime) {
+			timeout = true;
+			break;
+		}
+		cpu_relax();
+	}
+
+	/* Work may have arrived as we gave up: it also queued a wakeup */
+	if (vhost_net_busy_hit(net, vq, sk)) {
+		bl->hits++;
+		return true;
+	}
+	bl->misses++;
+	if (timeout) {
+		bl->budget /= 2;
+		if (bl->budget < VHOST_NET_BUSYLOOP_MIN)
+			bl->budget = 0;
+	}
+	return false;
+}
+
 /* Expects to be always run from workqueue - which acts as
  * read-size critical section for our kind of RCU. */
 static void handle_tx(struct vhost_net *net)
 {
 	struct vhost_virtqueue *vq = &net->dev.vqs[VHOST_NET_VQ_TX];
+	struct vhost_net_busyloop *bl = &net->busyloop[VHOST_NET_VQ_TX];
 	unsigned out, in, s;
 	int head;
 	struct msghdr msg = {
@@ -162,6 +269,7 @@ static void handle_tx(struct vhost_net *net)
 
 	mutex_lock(&vq->mutex);
 	vhost_disable_notify(&net->dev, vq);
+	vhost_net_busy_adapt(net, bl);
 
 	if (wmem < sock->sk->sk_sndbuf / 2)
 		tx_poll_stop(net);
@@ -201,10 +309,13 @@ static void handle_tx(struct vhost_net *net)
 				set_bit(SOCK_ASYNC_NOSPACE, &sock->flags);
 				break;
 			}
+			if (vhost_net_busy_poll(net, vq, bl, NULL))
+				continue;
 			if (unlikely(vhost_enable_notify(&net->dev, vq))) {
 				vhost_disable_notify(&net->dev, vq);
 				continue;
 			}
+			vhost_net_busy_idle(bl);
 			break;
 		}
 		if (in) {
@@ -356,6 +467,7 @@ err:
 static void handle_rx(struct vhost_net *net)
 {
 	struct vhost_virtqueue *vq = &net->dev.vqs[VHOST_NET_VQ_RX];
+	struct vhost_net_busyloop *bl = &net->busyloop[VHOST_NET_VQ_RX];
 	unsigned uninitialized_var(in), log;
 	struct vhost_log *vq_log;
 	struct msghdr msg = {
@@ -382,6 +494,7 @@ static void handle_rx(struct vhost_net *net)
 
 	mutex_lock(&vq->mutex);
 	vhost_disable_notify(&net->dev, vq);
+	vhost_net_busy_adapt(net, bl);
 	vhost_hlen = vq->vhost_hlen;
 	sock_hlen = vq->sock_hlen;
 
@@ -389,7 +502,15 @@ static void handle_rx(struct vhost_net *net)
 		vq->log : NULL;
 	mergeable = vhost_has_feature(&net->dev, VIRTIO_NET_F_MRG_RXBUF);
 
-	while ((sock_len = peek_head_len(sock->sk))) {
+	for (;;) {
+		sock_len = peek_head_len(sock->sk);
+		if (!sock_len) {
+			/* Wait for the socket to tell us about more data. */
+			if (vhost_net_busy_poll(net, vq, bl, sock->sk))
+				continue;
+			vhost_net_busy_idle(bl);
+			break;
+		}
 		sock_len += sock_hlen;
 		vhost_len = sock_len + vhost_hlen;
 		headcount = get_rx_bufs(vq, vq->heads, vhost_len,
@@ -400,6 +521,8 @@ static void handle_rx(struct vhost_net *net)
 			break;
 		/* OK, now we need to know about added descriptors. */
 		if (!headcount) {
+			if (vhost_net_busy_poll(net, vq, bl, NULL))
+				continue;
 			if (unlikely(vhost_enable_notify(&net->dev, vq))) {
 				/* They have slipped one in as we were
 				 * doing that: check again. */
@@ -408,6 +531,7 @@ static void handle_rx(struct vhost_net *net)
 			}
 			/* Nothing new?  Wait for eventfd to tell us
 			 * they refilled. */
+			vhost_net_busy_idle(bl);
 			break;
 		}
 		/* We don't need to be notified again. */
@@ -504,15 +628,19 @@ static int vhost_net_open(struct inode *inode, struct file *f)
 	dev = &n->dev;
 	n->vqs[VHOST_NET_VQ_TX].handle_kick = handle_tx_kick;
 	n->vqs[VHOST_NET_VQ_RX].handle_kick = handle_rx_kick;
-	r = vhost_dev_init(dev, n->vqs, VHOST_NET_VQ_MAX);
+	r = vhost_dev_init(dev, n->vqs, VHOST_NET_VQ_MAX, vq_workers);
 	if (r < 0) {
 		kfree(n);
 		return r;
 	}
 
-	vhost_poll_init(n->poll + VHOST_NET_VQ_TX, handle_tx_net, POLLOUT, dev);
-	vhost_poll_init(n->poll + VHOST_NET_VQ_RX, handle_rx_net, POLLIN, dev);
+	vhost_vq_poll_init(n->poll + VHOST_NET_VQ_TX, handle_tx_net, POLLOUT,
+			   n->vqs + VHOST_NET_VQ_TX);
+	vhost_vq_poll_init(n->poll + VHOST_NET_VQ_RX, handle_rx_net, POLLIN,
+			   n->vqs + VHOST_NET_VQ_RX);
 	n->tx_poll_state = VHOST_NET_POLL_DISABLED;
+	memset(n->busyloop, 0, sizeof n->busyloop);
+	n->busyloop_timeout = 0;
 
 	f->private_data = n;
 
@@ -799,6 +927,46 @@ static int vhost_net_set_features(struct vhost_net *n, u64 features)
 	return 0;
 }
 
+static void vhost_net_set_busyloop_timeout(struct vhost_net *n, u32 timeout)
+{
+	int i;
+
+	mutex_lock(&n->dev.mutex);
+	n->busyloop_timeout = timeout;
+	for (i = 0; i < VHOST_NET_VQ_MAX; ++i) {
+		mutex_lock(&n->vqs[i].mutex);
+		n->busyloop[i].budget = timeout;
+		mutex_unlock(&n->vqs[i].mutex);
+	}
+	mutex_unlock(&n->dev.mutex);
+}
+
+static long vhost_net_get_busyloop_stats(struct vhost_net *n, void __user *argp)
+{
+	struct vhost_net_busyloop_stats s;
+	struct vhost_net_busyloop *bl;
+	struct vhost_virtqueue *vq;
+
+	if (copy_from_user(&s, argp, sizeof s))
+		return -EFAULT;
+	if (s.index >= VHOST_NET_VQ_MAX)
+		return -ENOBUFS;
+
+	vq = n->vqs + s.index;
+	bl = n->busyloop + s.index;
+	mutex_lock(&vq->mutex);
+	s.budget = bl->budget;
+	s.polls = bl->polls;
+	s.hits = bl->hits;
+	s.misses = bl->misses;
+	s.sleeps = bl->sleeps;
+	mutex_unlock(&vq->mutex);
+
+	if (copy_to_user(argp, &s, sizeof s))
+		return -EFAULT;
+	return 0;
+}
+
 static long vhost_net_ioctl(struct file *f, unsigned int ioctl,
 			    unsigned long arg)
 {
@@ -806,7 +974,9 @@ static long vhost_net_ioctl(struct file *f, unsigned int ioctl,
 	void __user *argp = (void __user *)arg;
 	u64 __user *featurep = argp;
 	struct vhost_vring_file backend;
+	u32 __user *timeoutp = argp;
 	u64 features;
+	u32 timeout;
 	int r;
 
 	switch (ioctl) {
@@ -827,6 +997,18 @@ static long vhost_net_ioctl(struct file *f, unsigned int ioctl,
 		return vhost_net_set_features(n, features);
 	case VHOST_RESET_OWNER:
 		return vhost_net_reset_owner(n);
+	case VHOST_NET_SET_BUSYLOOP_TIMEOUT:
+		if (copy_from_user(&timeout, timeoutp, sizeof timeout))
+			return -EFAULT;
+		vhost_net_set_busyloop_timeout(n, timeout);
+		return 0;
+	case VHOST_NET_GET_BUSYLOOP_TIMEOUT:
+		timeout = ACCESS_ONCE(n->busyloop_timeout);
+		if (copy_to_user(timeoutp, &timeout, sizeof timeout))
+			return -EFAULT;
+		return 0;
+	case VHOST_NET_GET_BUSYLOOP_STATS:
+		return vhost_net_get_busyloop_stats(n, argp);
 	default:
 		mutex_lock(&n->dev.mutex);
 		r = vhost_dev_ioctl(&n->dev, ioctl, arg);
@@ -109,7 +109,7 @@ static int vhost_test_open(struct inode *inode, struct file *f)
 
 	dev = &n->dev;
 	n->vqs[VHOST_TEST_VQ].handle_kick = handle_vq_kick;
-	r = vhost_dev_init(dev, n->vqs, VHOST_TEST_VQ_MAX);
+	r = vhost_dev_init(dev, n->vqs, VHOST_TEST_VQ_MAX, false);
 	if (r < 0) {
 		kfree(n);
 		return r;
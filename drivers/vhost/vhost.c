@@ -25,6 +25,7 @@
 #include <linux/slab.h>
 #include <linux/kthread.h>
 #include <linux/cgroup.h>
+#include <linux/cpuset.h>
 
 #include <linux/net.h>
 #include <linux/if_packet.h>
@@ -64,7 +65,7 @@ static int vhost_poll_wakeup(wait_queue_t *wait, unsigned mode, int sync,
 	return 0;
 }
 
-static void vhost_work_init(struct vhost_work *work, vhost_work_fn_t fn)
+void vhost_work_init(struct vhost_work *work, vhost_work_fn_t fn)
 {
 	INIT_LIST_HEAD(&work->node);
 	work->fn = fn;
@@ -81,10 +82,25 @@ void vhost_poll_init(struct vhost_poll *poll, vhost_work_fn_t fn,
 	init_poll_funcptr(&poll->table, vhost_poll_func);
 	poll->mask = mask;
 	poll->dev = dev;
+	poll->worker = &dev->worker;
 
 	vhost_work_init(&poll->work, fn);
 }
 
+static struct vhost_worker *vhost_vq_worker(struct vhost_virtqueue *vq)
+{
+	return vq->dev->vq_workers ? &vq->worker : &vq->dev->worker;
+}
+
+/* Like vhost_poll_init(), but the work runs on the worker of @vq: used
+ * for the virtqueue kick and for a backend file feeding that virtqueue. */
+void vhost_vq_poll_init(struct vhost_poll *poll, vhost_work_fn_t fn,
+			unsigned long mask, struct vhost_virtqueue *vq)
+{
+	vhost_poll_init(poll, fn, mask, vq->dev);
+	poll->worker = vhost_vq_worker(vq);
+}
+
 /* Start polling a file. We add ourselves to file's wait queue. The caller must
  * keep a reference to a file until after vhost_poll_stop is called. */
 void vhost_poll_start(struct vhost_poll *poll, struct file *file)
@@ -103,30 +119,31 @@ void vhost_poll_stop(struct vhost_poll *poll)
 	remove_wait_queue(poll->wqh, &poll->wait);
 }
 
-static bool vhost_work_seq_done(struct vhost_dev *dev, struct vhost_work *work,
-				unsigned seq)
+static bool vhost_work_seq_done(struct vhost_worker *worker,
+				struct vhost_work *work, unsigned seq)
 {
 	int left;
 
-	spin_lock_irq(&dev->work_lock);
+	spin_lock_irq(&worker->work_lock);
 	left = seq - work->done_seq;
-	spin_unlock_irq(&dev->work_lock);
+	spin_unlock_irq(&worker->work_lock);
 	return left <= 0;
 }
 
-static void vhost_work_flush(struct vhost_dev *dev, struct vhost_work *work)
+static void vhost_work_flush(struct vhost_worker *worker,
+			     struct vhost_work *work)
 {
 	unsigned seq;
 	int flushing;
 
-	spin_lock_irq(&dev->work_lock);
+	spin_lock_irq(&worker->work_lock);
 	seq = work->queue_seq;
 	work->flushing++;
-	spin_unlock_irq(&dev->work_lock);
-	wait_event(work->done, vhost_work_seq_done(dev, work, seq));
-	spin_lock_irq(&dev->work_lock);
+	spin_unlock_irq(&worker->work_lock);
+	wait_event(work->done, vhost_work_seq_done(worker, work, seq));
+	spin_lock_irq(&worker->work_lock);
 	flushing = --work->flushing;
-	spin_unlock_irq(&dev->work_lock);
+	spin_unlock_irq(&worker->work_lock);
 	BUG_ON(flushing < 0);
 }
 
@@ -134,26 +151,38 @@ static void vhost_work_flush(struct vhost_dev *dev, struct vhost_work *work)
  * locks that are also used by the callback. */
 void vhost_poll_flush(struct vhost_poll *poll)
 {
-	vhost_work_flush(poll->dev, &poll->work);
+	vhost_work_flush(poll->worker, &poll->work);
 }
 
-static inline void vhost_work_queue(struct vhost_dev *dev,
+static inline void vhost_work_queue(struct vhost_worker *worker,
 				    struct vhost_work *work)
 {
 	unsigned long flags;
 
-	spin_lock_irqsave(&dev->work_lock, flags);
+	spin_lock_irqsave(&worker->work_lock, flags);
 	if (list_empty(&work->node)) {
-		list_add_tail(&work->node, &dev->work_list);
+		list_add_tail(&work->node, &worker->work_list);
 		work->queue_seq++;
-		wake_up_process(dev->worker);
+		wake_up_process(worker->task);
 	}
-	spin_unlock_irqrestore(&dev->work_lock, flags);
+	spin_unlock_irqrestore(&worker->work_lock, flags);
 }
 
 void vhost_poll_queue(struct vhost_poll *poll)
 {
-	vhost_work_queue(poll->dev, &poll->work);
+	vhost_work_queue(poll->worker, &poll->work);
+}
+
+/* Run work on the worker of @vq, serialized with its kicks.  May be called
+ * from interrupt context, e.g. to complete I/O. */
+void vhost_vq_work_queue(struct vhost_virtqueue *vq, struct vhost_work *work)
+{
+	vhost_work_queue(vhost_vq_worker(vq), work);
+}
+
+void vhost_vq_work_flush(struct vhost_virtqueue *vq, struct vhost_work *work)
+{
+	vhost_work_flush(vhost_vq_worker(vq), work);
 }
 
 static void vhost_vq_reset(struct vhost_dev *dev,
@@ -168,6 +197,9 @@ static void vhost_vq_reset(struct vhost_dev *dev,
 	vq->last_used_idx = 0;
 	vq->signalled_used = 0;
 	vq->signalled_used_valid = false;
+	vq->avail_wrap_counter = true;
+	vq->used_wrap_counter = true;
+	vq->packed_fetched = 0;
 	vq->used_flags = 0;
 	vq->log_used = false;
 	vq->log_addr = -1ull;
@@ -188,7 +220,8 @@ static void vhost_vq_reset(struct vhost_dev *dev,
 
 static int vhost_worker(void *data)
 {
-	struct vhost_dev *dev = data;
+	struct vhost_worker *worker = data;
+	struct vhost_dev *dev = worker->dev;
 	struct vhost_work *work = NULL;
 	unsigned uninitialized_var(seq);
 
@@ -198,7 +231,7 @@ static int vhost_worker(void *data)
 		/* mb paired w/ kthread_stop */
 		set_current_state(TASK_INTERRUPTIBLE);
 
-		spin_lock_irq(&dev->work_lock);
+		spin_lock_irq(&worker->work_lock);
 		if (work) {
 			work->done_seq = seq;
 			if (work->flushing)
@@ -206,18 +239,18 @@ static int vhost_worker(void *data)
 		}
 
 		if (kthread_should_stop()) {
-			spin_unlock_irq(&dev->work_lock);
+			spin_unlock_irq(&worker->work_lock);
 			__set_current_state(TASK_RUNNING);
 			break;
 		}
-		if (!list_empty(&dev->work_list)) {
-			work = list_first_entry(&dev->work_list,
+		if (!list_empty(&worker->work_list)) {
+			work = list_first_entry(&worker->work_list,
 						struct vhost_work, node);
 			list_del_init(&work->node);
 			seq = work->queue_seq;
 		} else
 			work = NULL;
-		spin_unlock_irq(&dev->work_lock);
+		spin_unlock_irq(&worker->work_lock);
 
 		if (work) {
 			__set_current_state(TASK_RUNNING);
@@ -242,6 +275,8 @@ static void vhost_vq_free_iovecs(struct vhost_virtqueue *vq)
 	vq->heads = NULL;
 	kfree(vq->ubuf_info);
 	vq->ubuf_info = NULL;
+	kfree(vq->packed_ndescs);
+	vq->packed_ndescs = NULL;
 }
 
 void vhost_enable_zcopy(int vq)
@@ -288,8 +323,20 @@ static void vhost_dev_free_iovecs(struct vhost_dev *dev)
 		vhost_vq_free_iovecs(&dev->vqs[i]);
 }
 
+static void vhost_worker_init(struct vhost_worker *worker,
+			      struct vhost_dev *dev)
+{
+	spin_lock_init(&worker->work_lock);
+	INIT_LIST_HEAD(&worker->work_list);
+	worker->task = NULL;
+	worker->dev = dev;
+}
+
+/* With @vq_workers, every virtqueue gets a worker thread of its own, so
+ * that the virtqueues of one device are serviced in parallel.  Otherwise
+ * a single worker runs the work of the whole device. */
 long vhost_dev_init(struct vhost_dev *dev,
-		    struct vhost_virtqueue *vqs, int nvqs)
+		    struct vhost_virtqueue *vqs, int nvqs, bool vq_workers)
 {
 	int i;
 
@@ -300,21 +347,23 @@ long vhost_dev_init(struct vhost_dev *dev,
 	dev->log_file = NULL;
 	dev->memory = NULL;
 	dev->mm = NULL;
-	spin_lock_init(&dev->work_lock);
-	INIT_LIST_HEAD(&dev->work_list);
-	dev->worker = NULL;
+	vhost_worker_init(&dev->worker, dev);
+	dev->vq_workers = vq_workers;
 
 	for (i = 0; i < dev->nvqs; ++i) {
 		dev->vqs[i].log = NULL;
 		dev->vqs[i].indirect = NULL;
 		dev->vqs[i].heads = NULL;
 		dev->vqs[i].ubuf_info = NULL;
+		dev->vqs[i].packed_ndescs = NULL;
 		dev->vqs[i].dev = dev;
+		vhost_worker_init(&dev->vqs[i].worker, dev);
 		mutex_init(&dev->vqs[i].mutex);
 		vhost_vq_reset(dev, dev->vqs + i);
 		if (dev->vqs[i].handle_kick)
-			vhost_poll_init(&dev->vqs[i].poll,
-					dev->vqs[i].handle_kick, POLLIN, dev);
+			vhost_vq_poll_init(&dev->vqs[i].poll,
+					   dev->vqs[i].handle_kick, POLLIN,
+					   dev->vqs + i);
 	}
 
 	return 0;
@@ -341,22 +390,90 @@ static void vhost_attach_cgroups_work(struct vhost_work *work)
 	s->ret = cgroup_attach_task_all(s->owner, current);
 }
 
-static int vhost_attach_cgroups(struct vhost_dev *dev)
+static int vhost_attach_cgroups(struct vhost_worker *worker)
 {
 	struct vhost_attach_cgroups_struct attach;
 
 	attach.owner = current;
 	vhost_work_init(&attach.work, vhost_attach_cgroups_work);
-	vhost_work_queue(dev, &attach.work);
-	vhost_work_flush(dev, &attach.work);
+	vhost_work_queue(worker, &attach.work);
+	vhost_work_flush(worker, &attach.work);
 	return attach.ret;
 }
 
+/* Start the thread of a worker, named after the owner and, for a
+ * virtqueue worker, the virtqueue index. */
+static int vhost_worker_start(struct vhost_worker *worker, int index)
+{
+	struct task_struct *task;
+	int err;
+
+	if (index < 0)
+		task = kthread_create(vhost_worker, worker, "vhost-%d",
+				      current->pid);
+	else
+		task = kthread_create(vhost_worker, worker, "vhost-%d-%d",
+				      current->pid, index);
+	if (IS_ERR(task))
+		return PTR_ERR(task);
+
+	worker->task = task;
+	wake_up_process(task);	/* avoid contributing to loadavg */
+
+	err = vhost_attach_cgroups(worker);
+	if (err) {
+		kthread_stop(task);
+		worker->task = NULL;
+	}
+	return err;
+}
+
+static void vhost_worker_stop(struct vhost_worker *worker)
+{
+	WARN_ON(!list_empty(&worker->work_list));
+	if (worker->task) {
+		kthread_stop(worker->task);
+		worker->task = NULL;
+	}
+}
+
+static void vhost_dev_stop_workers(struct vhost_dev *dev)
+{
+	int i;
+
+	for (i = 0; i < dev->nvqs; ++i)
+		vhost_worker_stop(&dev->vqs[i].worker);
+	vhost_worker_stop(&dev->worker);
+}
+
+/* Bind the worker to @cpu, or let it run anywhere in its cpuset again
+ * for VHOST_VRING_WORKER_CPU_ANY. */
+static long vhost_worker_set_cpu(struct vhost_worker *worker, unsigned int cpu)
+{
+	cpumask_var_t mask;
+	long r;
+
+	if (!alloc_cpumask_var(&mask, GFP_KERNEL))
+		return -ENOMEM;
+
+	cpuset_cpus_allowed(worker->task, mask);
+	if (cpu != VHOST_VRING_WORKER_CPU_ANY) {
+		r = -EINVAL;
+		if (cpu >= nr_cpu_ids || !cpumask_test_cpu(cpu, mask))
+			goto out;
+		cpumask_clear(mask);
+		cpumask_set_cpu(cpu, mask);
+	}
+	r = set_cpus_allowed_ptr(worker->task, mask);
+out:
+	free_cpumask_var(mask);
+	return r;
+}
+
 /* Caller should have device mutex */
 static long vhost_dev_set_owner(struct vhost_dev *dev)
 {
-	struct task_struct *worker;
-	int err;
+	int i, err;
 
 	/* Is there an owner already? */
 	if (dev->mm) {
@@ -366,28 +483,25 @@ static long vhost_dev_set_owner(struct vhost_dev *dev)
 
 	/* No owner, become one */
 	dev->mm = get_task_mm(current);
-	worker = kthread_create(vhost_worker, dev, "vhost-%d", current->pid);
-	if (IS_ERR(worker)) {
-		err = PTR_ERR(worker);
+	err = vhost_worker_start(&dev->worker, -1);
+	if (err)
 		goto err_worker;
-	}
-
-	dev->worker = worker;
-	wake_up_process(worker);	/* avoid contributing to loadavg */
 
-	err = vhost_attach_cgroups(dev);
-	if (err)
-		goto err_cgroup;
+	if (dev->vq_workers) {
+		for (i = 0; i < dev->nvqs; ++i) {
+			err = vhost_worker_start(&dev->vqs[i].worker, i);
+			if (err)
+				goto err_worker;
+		}
+	}
 
 	err = vhost_dev_alloc_iovecs(dev);
 	if (err)
-		goto err_cgroup;
+		goto err_worker;
 
 	return 0;
-err_cgroup:
-	kthread_stop(worker);
-	dev->worker = NULL;
 err_worker:
+	vhost_dev_stop_workers(dev);
 	if (dev->mm)
 		mmput(dev->mm);
 	dev->mm = NULL;
@@ -477,11 +591,7 @@ void vhost_dev_cleanup(struct vhost_dev *dev, bool locked)
 					locked ==
 						lockdep_is_held(&dev->mutex)));
 	RCU_INIT_POINTER(dev->memory, NULL);
-	WARN_ON(!list_empty(&dev->work_list));
-	if (dev->worker) {
-		kthread_stop(dev->worker);
-		dev->worker = NULL;
-	}
+	vhost_dev_stop_workers(dev);
 	if (dev->mm)
 		mmput(dev->mm);
 	dev->mm = NULL;
@@ -554,6 +664,15 @@ static int vq_access_ok(struct vhost_dev *d, unsigned int num,
 			struct vring_used __user *used)
 {
 	size_t s = vhost_has_feature(d, VIRTIO_RING_F_EVENT_IDX) ? 2 : 0;
+
+	/* Packed descriptors are written back in place. */
+	if (vhost_has_feature(d, VIRTIO_RING_F_PACKED))
+		return access_ok(VERIFY_WRITE, desc,
+				 num * sizeof(struct vring_packed_desc)) &&
+		       access_ok(VERIFY_READ, avail,
+				 sizeof(struct vring_packed_desc_event)) &&
+		       access_ok(VERIFY_WRITE, used,
+				 sizeof(struct vring_packed_desc_event));
 	return access_ok(VERIFY_READ, desc, num * sizeof *desc) &&
 	       access_ok(VERIFY_READ, avail,
 			 sizeof *avail + num * sizeof *avail->ring + s) &&
@@ -632,6 +751,26 @@ static long vhost_set_memory(struct vhost_dev *d, struct vhost_memory __user *m)
 	return 0;
 }
 
+/* The used state of a packed ring is not in Guest memory: a new ring
+ * starts out with nothing in flight, used where the Guest will make
+ * buffers available next. */
+static int vhost_reset_used_packed(struct vhost_virtqueue *vq)
+{
+	if (!vq->packed_ndescs) {
+		vq->packed_ndescs = kcalloc(vq->num * 2,
+					    sizeof *vq->packed_ndescs,
+					    GFP_KERNEL);
+		if (!vq->packed_ndescs)
+			return -ENOMEM;
+	} else
+		memset(vq->packed_ndescs, 0,
+		       vq->num * 2 * sizeof *vq->packed_ndescs);
+	vq->packed_fetched = 0;
+	vq->last_used_idx = vq->last_avail_idx;
+	vq->used_wrap_counter = vq->avail_wrap_counter;
+	return 0;
+}
+
 static long vhost_set_vring(struct vhost_dev *d, int ioctl, void __user *argp)
 {
 	struct file *eventfp, *filep = NULL,
@@ -642,6 +781,8 @@ static long vhost_set_vring(struct vhost_dev *d, int ioctl, void __user *argp)
 	struct vhost_vring_state s;
 	struct vhost_vring_file f;
 	struct vhost_vring_addr a;
+	unsigned long avail_align, used_align;
+	bool packed;
 	u32 idx;
 	long r;
 
@@ -652,6 +793,7 @@ static long vhost_set_vring(struct vhost_dev *d, int ioctl, void __user *argp)
 		return -ENOBUFS;
 
 	vq = d->vqs + idx;
+	packed = vhost_has_feature(d, VIRTIO_RING_F_PACKED);
 
 	mutex_lock(&vq->mutex);
 
@@ -671,7 +813,15 @@ static long vhost_set_vring(struct vhost_dev *d, int ioctl, void __user *argp)
 			r = -EINVAL;
 			break;
 		}
+		/* Packed ring offsets share 16 bits with a wrap counter. */
+		if (packed && s.num > 1 << VRING_PACKED_EVENT_F_WRAP_CTR) {
+			r = -EINVAL;
+			break;
+		}
 		vq->num = s.num;
+		/* Sized by num: set up again for the new ring. */
+		kfree(vq->packed_ndescs);
+		vq->packed_ndescs = NULL;
 		break;
 	case VHOST_SET_VRING_BASE:
 		/* Moving base with an active backend?
@@ -688,13 +838,36 @@ static long vhost_set_vring(struct vhost_dev *d, int ioctl, void __user *argp)
 			r = -EINVAL;
 			break;
 		}
+		/* For a packed ring, the top bit is the wrap counter. */
+		if (packed &&
+		    (s.num & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR)) >= vq->num) {
+			r = -EINVAL;
+			break;
+		}
+		if (packed) {
+			vq->avail_wrap_counter =
+				s.num >> VRING_PACKED_EVENT_F_WRAP_CTR;
+			s.num &= ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+		}
 		vq->last_avail_idx = s.num;
 		/* Forget the cached index value. */
 		vq->avail_idx = vq->last_avail_idx;
+		if (packed)
+			r = vhost_reset_used_packed(vq);
+		break;
+	case VHOST_SET_VRING_WORKER_CPU:
+		if (copy_from_user(&s, argp, sizeof s)) {
+			r = -EFAULT;
+			break;
+		}
+		r = vhost_worker_set_cpu(vhost_vq_worker(vq), s.num);
 		break;
 	case VHOST_GET_VRING_BASE:
 		s.index = idx;
 		s.num = vq->last_avail_idx;
+		if (packed)
+			s.num |= vq->avail_wrap_counter <<
+				 VRING_PACKED_EVENT_F_WRAP_CTR;
 		if (copy_to_user(argp, &s, sizeof s))
 			r = -EFAULT;
 		break;
@@ -715,8 +888,20 @@ static long vhost_set_vring(struct vhost_dev *d, int ioctl, void __user *argp)
 			r = -EFAULT;
 			break;
 		}
-		if ((a.avail_user_addr & (sizeof *vq->avail->ring - 1)) ||
-		    (a.used_user_addr & (sizeof *vq->used->ring - 1)) ||
+		/* Writes to the packed ring are not logged. */
+		if (packed && (a.flags & (0x1 << VHOST_VRING_F_LOG))) {
+			r = -EOPNOTSUPP;
+			break;
+		}
+		if (packed) {
+			avail_align = sizeof *vq->driver_event;
+			used_align = sizeof *vq->device_event;
+		} else {
+			avail_align = sizeof *vq->avail->ring;
+			used_align = sizeof *vq->used->ring;
+		}
+		if ((a.avail_user_addr & (avail_align - 1)) ||
+		    (a.used_user_addr & (used_align - 1)) ||
 		    (a.log_guest_addr & (sizeof *vq->used->ring - 1))) {
 			r = -EINVAL;
 			break;
@@ -1036,12 +1221,54 @@ static int vhost_update_avail_event(struct vhost_virtqueue *vq, u16 avail_event)
 	return 0;
 }
 
+static int vhost_update_device_event(struct vhost_virtqueue *vq, u16 flags)
+{
+	u16 off_wrap = vq->last_avail_idx |
+		       vq->avail_wrap_counter << VRING_PACKED_EVENT_F_WRAP_CTR;
+
+	if (flags == VRING_PACKED_EVENT_FLAG_DESC) {
+		if (__put_user(off_wrap, &vq->device_event->off_wrap))
+			return -EFAULT;
+		/* Make sure the offset is seen before the flags. */
+		smp_wmb();
+	}
+	if (__put_user(flags, &vq->device_event->flags))
+		return -EFAULT;
+	return 0;
+}
+
+/* Packed ring: buffers still in flight are completed by the backend
+ * that replaces the one they were fetched for, so changing backends
+ * keeps the used state, and only a new ring starts it over. */
+static int vhost_init_used_packed(struct vhost_virtqueue *vq)
+{
+	int r;
+
+	if (!vq->packed_ndescs) {
+		r = vhost_reset_used_packed(vq);
+		if (r)
+			return r;
+	}
+
+	r = vhost_update_device_event(vq, vq->used_flags &
+				      VRING_USED_F_NO_NOTIFY ?
+				      VRING_PACKED_EVENT_FLAG_DISABLE :
+				      VRING_PACKED_EVENT_FLAG_ENABLE);
+	if (r)
+		return r;
+	vq->signalled_used_valid = false;
+	return 0;
+}
+
 int vhost_init_used(struct vhost_virtqueue *vq)
 {
 	int r;
 	if (!vq->private_data)
 		return 0;
 
+	if (vhost_has_feature(vq->dev, VIRTIO_RING_F_PACKED))
+		return vhost_init_used_packed(vq);
+
 	r = vhost_update_used_flags(vq);
 	if (r)
 		return r;
@@ -1195,6 +1422,221 @@ static int get_indirect(struct vhost_dev *dev, struct vhost_virtqueue *vq,
 	return 0;
 }
 
+/* A packed descriptor is available once its AVAIL bit matches the Guest's
+ * wrap counter and its USED bit does not. */
+static bool vhost_packed_desc_avail(u16 flags, bool wrap_counter)
+{
+	return !!(flags & VRING_PACKED_DESC_F_AVAIL) == wrap_counter &&
+	       !!(flags & VRING_PACKED_DESC_F_USED) != wrap_counter;
+}
+
+/* Is the next packed descriptor available?  Negative on error. */
+static int vhost_packed_avail(struct vhost_virtqueue *vq)
+{
+	struct vring_packed_desc __user *desc;
+	u16 flags;
+
+	desc = vq->desc_packed + vq->last_avail_idx;
+	if (unlikely(__get_user(flags, &desc->flags))) {
+		vq_err(vq, "Failed to access descriptor flags at %p\n",
+		       &desc->flags);
+		return -EFAULT;
+	}
+	return vhost_packed_desc_avail(flags, vq->avail_wrap_counter);
+}
+
+/* Add a packed descriptor to the iovecs, the way the split ring code does
+ * for its own. */
+static int translate_desc_packed(struct vhost_dev *dev,
+				 struct vhost_virtqueue *vq,
+				 struct vring_packed_desc *desc,
+				 struct iovec iov[], unsigned int iov_size,
+				 unsigned int *out_num, unsigned int *in_num,
+				 struct vhost_log *log, unsigned int *log_num)
+{
+	unsigned iov_count = *in_num + *out_num;
+	int ret;
+
+	ret = translate_desc(dev, desc->addr, desc->len, iov + iov_count,
+			     iov_size - iov_count);
+	if (unlikely(ret < 0))
+		return ret;
+
+	if (desc->flags & VRING_DESC_F_WRITE) {
+		/* If this is an input descriptor,
+		 * increment that count. */
+		*in_num += ret;
+		if (unlikely(log)) {
+			log[*log_num].addr = desc->addr;
+			log[*log_num].len = desc->len;
+			++*log_num;
+		}
+	} else {
+		/* If it's an output descriptor, they're all supposed
+		 * to come before any input descriptors. */
+		if (unlikely(*in_num))
+			return -EINVAL;
+		*out_num += ret;
+	}
+	return 0;
+}
+
+/* An indirect table of packed descriptors is a plain array: entries do not
+ * chain. */
+static int get_indirect_packed(struct vhost_dev *dev,
+			       struct vhost_virtqueue *vq,
+			       struct iovec iov[], unsigned int iov_size,
+			       unsigned int *out_num, unsigned int *in_num,
+			       struct vhost_log *log, unsigned int *log_num,
+			       struct vring_packed_desc *indirect)
+{
+	struct vring_packed_desc desc;
+	unsigned int i, count;
+	int ret;
+
+	/* Sanity check */
+	if (unlikely(indirect->len % sizeof desc)) {
+		vq_err(vq, "Invalid length in indirect descriptor: "
+		       "len 0x%x not multiple of 0x%zx\n",
+		       indirect->len, sizeof desc);
+		return -EINVAL;
+	}
+
+	ret = translate_desc(dev, indirect->addr, indirect->len, vq->indirect,
+			     UIO_MAXIOV);
+	if (unlikely(ret < 0)) {
+		vq_err(vq, "Translation failure %d in indirect.\n", ret);
+		return ret;
+	}
+
+	/* We will use the result as an address to read from, so most
+	 * architectures only need a compiler barrier here. */
+	read_barrier_depends();
+
+	count = indirect->len / sizeof desc;
+	/* No next field limits these, but a buffer may not be longer
+	 * than the ring. */
+	if (unlikely(count > vq->num)) {
+		vq_err(vq, "Indirect buffer length too big: %d\n",
+		       indirect->len);
+		return -E2BIG;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (unlikely(memcpy_fromiovec((unsigned char *)&desc,
+					      vq->indirect, sizeof desc))) {
+			vq_err(vq, "Failed indirect descriptor: idx %d, %zx\n",
+			       i, (size_t)indirect->addr + i * sizeof desc);
+			return -EINVAL;
+		}
+		if (unlikely(desc.flags & VRING_DESC_F_INDIRECT)) {
+			vq_err(vq, "Nested indirect descriptor: idx %d, %zx\n",
+			       i, (size_t)indirect->addr + i * sizeof desc);
+			return -EINVAL;
+		}
+		ret = translate_desc_packed(dev, vq, &desc, iov, iov_size,
+					    out_num, in_num, log, log_num);
+		if (unlikely(ret < 0)) {
+			vq_err(vq, "Failure %d in indirect idx %d\n", ret, i);
+			return ret;
+		}
+	}
+	return 0;
+}
+
+/* vhost_get_vq_desc() for a packed ring: the buffer starts at
+ * last_avail_idx and runs over consecutive ring entries.  Returns the id
+ * from its last descriptor. */
+static int vhost_get_vq_desc_packed(struct vhost_dev *dev,
+				    struct vhost_virtqueue *vq,
+				    struct iovec iov[], unsigned int iov_size,
+				    unsigned int *out_num, unsigned int *in_num,
+				    struct vhost_log *log,
+				    unsigned int *log_num)
+{
+	struct vring_packed_desc desc;
+	unsigned int i = vq->last_avail_idx, found = 0;
+	bool wrap_counter = vq->avail_wrap_counter;
+	int ret;
+
+	/* Features changed under a running backend? */
+	if (unlikely(!vq->packed_ndescs)) {
+		vq_err(vq, "Packed ring used before vhost_init_used\n");
+		return -EINVAL;
+	}
+
+	ret = vhost_packed_avail(vq);
+	if (unlikely(ret < 0))
+		return ret;
+
+	/* If there's nothing new since last we looked, return invalid. */
+	if (!ret)
+		return vq->num;
+
+	/* Only read the descriptors after the Guest has exposed the head;
+	 * it writes the rest of the chain first. */
+	smp_rmb();
+
+	/* When we start there are none of either input nor output. */
+	*out_num = *in_num = 0;
+	if (unlikely(log))
+		*log_num = 0;
+
+	do {
+		if (unlikely(++found > vq->num)) {
+			vq_err(vq, "Loop detected: last one at %u "
+			       "vq size %u head %u\n",
+			       i, vq->num, vq->last_avail_idx);
+			return -EINVAL;
+		}
+		ret = __copy_from_user(&desc, vq->desc_packed + i, sizeof desc);
+		if (unlikely(ret)) {
+			vq_err(vq, "Failed to get descriptor: idx %d addr %p\n",
+			       i, vq->desc_packed + i);
+			return -EFAULT;
+		}
+		if (desc.flags & VRING_DESC_F_INDIRECT)
+			ret = get_indirect_packed(dev, vq, iov, iov_size,
+						  out_num, in_num,
+						  log, log_num, &desc);
+		else
+			ret = translate_desc_packed(dev, vq, &desc,
+						    iov, iov_size,
+						    out_num, in_num,
+						    log, log_num);
+		if (unlikely(ret < 0)) {
+			vq_err(vq, "Failure %d in descriptor idx %d\n",
+			       ret, i);
+			return ret;
+		}
+		if (++i == vq->num) {
+			i = 0;
+			wrap_counter ^= 1;
+		}
+	} while (desc.flags & VRING_DESC_F_NEXT);
+
+	/* If their number is silly, that's an error. */
+	if (unlikely(desc.id >= vq->num)) {
+		vq_err(vq, "Guest says id %u > %u is available",
+		       desc.id, vq->num);
+		return -EINVAL;
+	}
+
+	/* Remember how far to skip when this id is used, and how far to go
+	 * back should it be discarded. */
+	vq->packed_ndescs[desc.id] = found;
+	vq->packed_ndescs[vq->num + vq->packed_fetched++ % vq->num] = found;
+
+	/* On success, move past the buffer. */
+	vq->last_avail_idx = i;
+	vq->avail_wrap_counter = wrap_counter;
+
+	/* Assume notifications from guest are disabled at this point,
+	 * if they aren't we would need to update the event offset. */
+	BUG_ON(!(vq->used_flags & VRING_USED_F_NO_NOTIFY));
+	return desc.id;
+}
+
 /* This looks in the virtqueue and for the first available buffer, and converts
  * it to an iovec for convenient access.  Since descriptors consist of some
  * number of output then some number of input descriptors, it's actually two
@@ -1213,6 +1655,11 @@ int vhost_get_vq_desc(struct vhost_dev *dev, struct vhost_virtqueue *vq,
 	u16 last_avail_idx;
 	int ret;
 
+	if (vhost_has_feature(dev, VIRTIO_RING_F_PACKED))
+		return vhost_get_vq_desc_packed(dev, vq, iov, iov_size,
+						out_num, in_num,
+						log, log_num);
+
 	/* Check it isn't doing very strange things with descriptor numbers. */
 	last_avail_idx = vq->last_avail_idx;
 	if (unlikely(__get_user(vq->avail_idx, &vq->avail->idx))) {
@@ -1328,7 +1775,61 @@ int vhost_get_vq_desc(struct vhost_dev *dev, struct vhost_virtqueue *vq,
 /* Reverse the effect of vhost_get_vq_desc. Useful for error handling. */
 void vhost_discard_vq_desc(struct vhost_virtqueue *vq, int n)
 {
-	vq->last_avail_idx -= n;
+	u16 found;
+
+	if (!vhost_has_feature(vq->dev, VIRTIO_RING_F_PACKED)) {
+		vq->last_avail_idx -= n;
+		return;
+	}
+
+	while (n--) {
+		vq->packed_fetched--;
+		found = vq->packed_ndescs[vq->num +
+					  vq->packed_fetched % vq->num];
+		if (vq->last_avail_idx < found) {
+			vq->last_avail_idx += vq->num;
+			vq->avail_wrap_counter ^= 1;
+		}
+		vq->last_avail_idx -= found;
+	}
+}
+
+/* Used buffers of a packed ring overwrite the first descriptor slot they
+ * took up, in the order they complete: the id tells the Guest which. */
+static int vhost_add_used_packed(struct vhost_virtqueue *vq,
+				 unsigned int id, int len)
+{
+	struct vring_packed_desc __user *desc;
+	u16 flags = vq->used_wrap_counter ?
+		    VRING_PACKED_DESC_F_AVAIL | VRING_PACKED_DESC_F_USED : 0;
+
+	if (unlikely(id >= vq->num)) {
+		vq_err(vq, "Used id %u out of range\n", id);
+		return -EINVAL;
+	}
+
+	desc = vq->desc_packed + vq->last_used_idx;
+	if (__put_user(id, &desc->id)) {
+		vq_err(vq, "Failed to write used id");
+		return -EFAULT;
+	}
+	if (__put_user(len, &desc->len)) {
+		vq_err(vq, "Failed to write used len");
+		return -EFAULT;
+	}
+	/* Make sure buffer is written before we update flags. */
+	smp_wmb();
+	if (__put_user(flags, &desc->flags)) {
+		vq_err(vq, "Failed to write used flags");
+		return -EFAULT;
+	}
+
+	vq->last_used_idx += vq->packed_ndescs[id];
+	if (vq->last_used_idx >= vq->num) {
+		vq->last_used_idx -= vq->num;
+		vq->used_wrap_counter ^= 1;
+	}
+	return 0;
 }
 
 /* After we've used one of their buffers, we tell them about it.  We'll then
@@ -1337,6 +1838,9 @@ int vhost_add_used(struct vhost_virtqueue *vq, unsigned int head, int len)
 {
 	struct vring_used_elem __user *used;
 
+	if (vhost_has_feature(vq->dev, VIRTIO_RING_F_PACKED))
+		return vhost_add_used_packed(vq, head, len);
+
 	/* The virtqueue contains a ring of used buffers.  Get a pointer to the
 	 * next entry in that used ring. */
 	used = &vq->used->ring[vq->last_used_idx % vq->num];
@@ -1420,6 +1924,15 @@ int vhost_add_used_n(struct vhost_virtqueue *vq, struct vring_used_elem *heads,
 {
 	int start, n, r;
 
+	if (vhost_has_feature(vq->dev, VIRTIO_RING_F_PACKED)) {
+		for (n = 0; n < count; n++) {
+			r = vhost_add_used_packed(vq, heads[n].id, heads[n].len);
+			if (r < 0)
+				return r;
+		}
+		return 0;
+	}
+
 	start = vq->last_used_idx % vq->num;
 	n = vq->num - start;
 	if (n < count) {
@@ -1448,6 +1961,46 @@ int vhost_add_used_n(struct vhost_virtqueue *vq, struct vring_used_elem *heads,
 	return r;
 }
 
+static bool vhost_notify_packed(struct vhost_dev *dev,
+				struct vhost_virtqueue *vq)
+{
+	__u16 old, new, off_wrap, flags, event;
+	bool v;
+
+	if (vhost_has_feature(dev, VIRTIO_F_NOTIFY_ON_EMPTY) &&
+	    unlikely(vhost_packed_avail(vq) == 0))
+		return true;
+
+	if (__get_user(flags, &vq->driver_event->flags)) {
+		vq_err(vq, "Failed to get driver event flags");
+		return true;
+	}
+	if (flags != VRING_PACKED_EVENT_FLAG_DESC)
+		return flags != VRING_PACKED_EVENT_FLAG_DISABLE;
+
+	old = vq->signalled_used;
+	v = vq->signalled_used_valid;
+	new = vq->signalled_used = vq->last_used_idx;
+	vq->signalled_used_valid = true;
+
+	if (unlikely(!v))
+		return true;
+
+	if (__get_user(off_wrap, &vq->driver_event->off_wrap)) {
+		vq_err(vq, "Failed to get driver event offset");
+		return true;
+	}
+
+	/* Ring offsets wrap at num: bring the last signalled offset and an
+	 * event offset in the previous lap behind new. */
+	if (new <= old)
+		old -= vq->num;
+	event = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+	if ((off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) != vq->used_wrap_counter)
+		event -= vq->num;
+	return vring_need_event(event, new, old);
+}
+
 static bool vhost_notify(struct vhost_dev *dev, struct vhost_virtqueue *vq)
 {
 	__u16 old, new, event;
@@ -1457,6 +2010,9 @@ static bool vhost_notify(struct vhost_dev *dev, struct vhost_virtqueue *vq)
 	 * interrupts. */
 	smp_mb();
 
+	if (vhost_has_feature(dev, VIRTIO_RING_F_PACKED))
+		return vhost_notify_packed(dev, vq);
+
 	if (vhost_has_feature(dev, VIRTIO_F_NOTIFY_ON_EMPTY) &&
 	    unlikely(vq->avail_idx == vq->last_avail_idx))
 		return true;
@@ -1519,6 +2075,20 @@ bool vhost_enable_notify(struct vhost_dev *dev, struct vhost_virtqueue *vq)
 	if (!(vq->used_flags & VRING_USED_F_NO_NOTIFY))
 		return false;
 	vq->used_flags &= ~VRING_USED_F_NO_NOTIFY;
+	if (vhost_has_feature(dev, VIRTIO_RING_F_PACKED)) {
+		r = vhost_update_device_event(vq,
+			vhost_has_feature(dev, VIRTIO_RING_F_EVENT_IDX) ?
+			VRING_PACKED_EVENT_FLAG_DESC :
+			VRING_PACKED_EVENT_FLAG_ENABLE);
+		if (r) {
+			vq_err(vq, "Failed to enable notification at %p: %d\n",
+			       vq->device_event, r);
+			return false;
+		}
+		/* They could have slipped one in as we were doing that. */
+		smp_mb();
+		return vhost_packed_avail(vq) > 0;
+	}
 	if (!vhost_has_feature(dev, VIRTIO_RING_F_EVENT_IDX)) {
 		r = vhost_update_used_flags(vq);
 		if (r) {
@@ -1547,6 +2117,27 @@ bool vhost_enable_notify(struct vhost_dev *dev, struct vhost_virtqueue *vq)
 	return avail_idx != vq->avail_idx;
 }
 
+/* Check for buffers added since we last looked, without touching the
+ * notification state: for busy polling the ring. */
+bool vhost_vq_avail_empty(struct vhost_dev *dev, struct vhost_virtqueue *vq)
+{
+	u16 avail_idx;
+
+	if (vhost_has_feature(dev, VIRTIO_RING_F_PACKED))
+		return vhost_packed_avail(vq) == 0;
+
+	if (__get_user(avail_idx, &vq->avail->idx))
+		return false;
+
+	return avail_idx == vq->avail_idx;
+}
+
+/* Is other work waiting for the worker running this virtqueue? */
+bool vhost_vq_has_work(struct vhost_virtqueue *vq)
+{
+	return !list_empty(&vhost_vq_worker(vq)->work_list);
+}
+
 /* We don't need to be notified again. */
 void vhost_disable_notify(struct vhost_dev *dev, struct vhost_virtqueue *vq)
 {
@@ -1555,7 +2146,15 @@ void vhost_disable_notify(struct vhost_dev *dev, struct vhost_virtqueue *vq)
 	if (vq->used_flags & VRING_USED_F_NO_NOTIFY)
 		return;
 	vq->used_flags |= VRING_USED_F_NO_NOTIFY;
-	if (!vhost_has_feature(dev, VIRTIO_RING_F_EVENT_IDX)) {
+	if (vhost_has_feature(dev, VIRTIO_RING_F_EVENT_IDX))
+		return;
+	if (vhost_has_feature(dev, VIRTIO_RING_F_PACKED)) {
+		r = vhost_update_device_event(vq,
+					      VRING_PACKED_EVENT_FLAG_DISABLE);
+		if (r)
+			vq_err(vq, "Failed to disable notification at %p: %d\n",
+			       vq->device_event, r);
+	} else {
 		r = vhost_update_used_flags(vq);
 		if (r)
 			vq_err(vq, "Failed to enable notification at %p: %d\n",
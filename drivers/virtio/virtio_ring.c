@@ -74,6 +74,17 @@
 #define END_USE(vq)
 #endif
 
+/* Per buffer id bookkeeping for the packed layout. */
+struct vring_packed_state
+{
+	/* Indirect table, if any. */
+	void *indir;
+	/* Ring descriptors the buffer takes. */
+	u16 num;
+	/* Next free id. */
+	u16 next;
+};
+
 struct vring_virtqueue
 {
 	struct virtqueue vq;
@@ -81,6 +92,10 @@ struct vring_virtqueue
 	/* Actual memory layout for this queue */
 	struct vring vring;
 
+	/* Ring uses the packed layout: vring_packed instead of vring */
+	bool packed;
+	struct vring_packed vring_packed;
+
 	/* Can we use weak barriers? */
 	bool weak_barriers;
 
@@ -103,6 +118,17 @@ struct vring_virtqueue
 	/* Last used index we've seen. */
 	u16 last_used_idx;
 
+	/* Packed layout: next ring slot we'll make available, the wrap
+	 * counters of both sides, the AVAIL/USED bits for our wrap counter
+	 * and the event suppression flags we last wrote. */
+	u16 next_avail_idx;
+	bool avail_wrap_counter;
+	bool used_wrap_counter;
+	u16 avail_used_flags;
+	u16 event_flags_shadow;
+	/* Packed layout: buffer ids, the free ones linked through next. */
+	struct vring_packed_state *packed_state;
+
 	/* How to notify other side. FIXME: commonalize hcalls! */
 	void (*notify)(struct virtqueue *vq);
 
@@ -171,6 +197,111 @@ static int vring_add_indirect(struct vring_virtqueue *vq,
 	return head;
 }
 
+/* Set up an indirect table of packed descriptors. */
+static struct vring_packed_desc *vring_packed_indirect(struct scatterlist sg[],
+						       unsigned int out,
+						       unsigned int in,
+						       gfp_t gfp)
+{
+	struct vring_packed_desc *desc;
+	unsigned int i;
+
+	desc = kmalloc((out + in) * sizeof(struct vring_packed_desc), gfp);
+	if (!desc)
+		return NULL;
+
+	for (i = 0; i < out + in; i++, sg++) {
+		desc[i].addr = sg_phys(sg);
+		desc[i].len = sg->length;
+		desc[i].id = 0;
+		desc[i].flags = i < out ? 0 : VRING_DESC_F_WRITE;
+	}
+	return desc;
+}
+
+static int vring_add_buf_packed(struct vring_virtqueue *vq,
+				struct scatterlist sg[],
+				unsigned int out,
+				unsigned int in,
+				void *data,
+				gfp_t gfp)
+{
+	struct vring_packed_desc *desc = vq->vring_packed.desc;
+	struct vring_packed_desc *indir = NULL;
+	unsigned int i, n, total = out + in;
+	u16 head, id, flags, uninitialized_var(head_flags);
+
+	BUG_ON(total == 0);
+
+	/* Same threshold as the split layout */
+	if (vq->indirect && total > 1 && vq->num_free)
+		indir = vring_packed_indirect(sg, out, in, gfp);
+
+	if (!indir) {
+		BUG_ON(total > vq->vring_packed.num);
+		if (vq->num_free < total) {
+			pr_debug("Can't add buf len %i - avail = %i\n",
+				 total, vq->num_free);
+			if (out)
+				vq->notify(&vq->vq);
+			return -ENOSPC;
+		}
+	}
+
+	head = i = vq->next_avail_idx;
+	id = vq->free_head;
+
+	for (n = 0; n < (indir ? 1 : total); n++, sg++) {
+		flags = vq->avail_used_flags;
+		if (indir) {
+			desc[i].addr = virt_to_phys(indir);
+			desc[i].len = total * sizeof(struct vring_packed_desc);
+			flags |= VRING_DESC_F_INDIRECT;
+		} else {
+			desc[i].addr = sg_phys(sg);
+			desc[i].len = sg->length;
+			if (n >= out)
+				flags |= VRING_DESC_F_WRITE;
+			if (n + 1 < total)
+				flags |= VRING_DESC_F_NEXT;
+		}
+		desc[i].id = id;
+		/* The head is made available last, see below. */
+		if (n == 0)
+			head_flags = flags;
+		else
+			desc[i].flags = flags;
+
+		if (++i == vq->vring_packed.num) {
+			i = 0;
+			vq->avail_wrap_counter ^= 1;
+			vq->avail_used_flags ^= VRING_PACKED_DESC_F_AVAIL |
+						VRING_PACKED_DESC_F_USED;
+		}
+	}
+
+	vq->num_free -= n;
+	vq->next_avail_idx = i;
+	vq->free_head = vq->packed_state[id].next;
+	vq->packed_state[id].num = n;
+	vq->packed_state[id].indir = indir;
+	vq->data[id] = data;
+
+	/* The rest of the chain needs to be set before the head makes the
+	 * whole buffer available. */
+	virtio_wmb(vq);
+	desc[head].flags = head_flags;
+	vq->num_added += n;
+
+	/* The event offsets kick_prepare compares against only cover one
+	 * lap of the ring.  Kick just in case. */
+	if (unlikely(vq->num_added >= vq->vring_packed.num))
+		virtqueue_kick(&vq->vq);
+
+	pr_debug("Added buffer id %i at %i to %p\n", id, head, vq);
+	return vq->num_free;
+}
+
 /**
  * virtqueue_add_buf - expose buffer to other end
  * @vq: the struct virtqueue we're talking about.
@@ -216,6 +347,12 @@ int virtqueue_add_buf(struct virtqueue *_vq,
 	}
 #endif
 
+	if (vq->packed) {
+		head = vring_add_buf_packed(vq, sg, out, in, data, gfp);
+		END_USE(vq);
+		return head;
+	}
+
 	/* If the host supports indirect descriptor tables, and we have multiple
 	 * buffers, then go indirect. FIXME: tune this threshold */
 	if (vq->indirect && (out + in) > 1 && vq->num_free) {
@@ -290,6 +427,28 @@ add_head:
 }
 EXPORT_SYMBOL_GPL(virtqueue_add_buf);
 
+static bool vring_kick_prepare_packed(struct vring_virtqueue *vq)
+{
+	u16 new, old, off_wrap, flags, event_idx;
+
+	old = vq->next_avail_idx - vq->num_added;
+	new = vq->next_avail_idx;
+	vq->num_added = 0;
+
+	off_wrap = vq->vring_packed.device->off_wrap;
+	flags = vq->vring_packed.device->flags;
+
+	if (flags != VRING_PACKED_EVENT_FLAG_DESC)
+		return flags != VRING_PACKED_EVENT_FLAG_DISABLE;
+
+	/* An event offset in the previous lap lies num slots behind. */
+	event_idx = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+	if ((off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) != vq->avail_wrap_counter)
+		event_idx -= vq->vring_packed.num;
+
+	return vring_need_event(event_idx, new, old);
+}
+
 /**
  * virtqueue_kick_prepare - first half of split virtqueue_kick call.
  * @vq: the struct virtqueue
@@ -312,10 +471,6 @@ bool virtqueue_kick_prepare(struct virtqueue *_vq)
 	 * event. */
 	virtio_mb(vq);
 
-	old = vq->vring.avail->idx - vq->num_added;
-	new = vq->vring.avail->idx;
-	vq->num_added = 0;
-
 #ifdef DEBUG
 	if (vq->last_add_time_valid) {
 		WARN_ON(ktime_to_ms(ktime_sub(ktime_get(),
@@ -324,6 +479,16 @@ bool virtqueue_kick_prepare(struct virtqueue *_vq)
 	vq->last_add_time_valid = false;
 #endif
 
+	if (vq->packed) {
+		needs_kick = vring_kick_prepare_packed(vq);
+		END_USE(vq);
+		return needs_kick;
+	}
+
+	old = vq->vring.avail->idx - vq->num_added;
+	new = vq->vring.avail->idx;
+	vq->num_added = 0;
+
 	if (vq->event) {
 		needs_kick = vring_need_event(vring_avail_event(&vq->vring),
 					      new, old);
@@ -392,11 +557,80 @@ static void detach_buf(struct vring_virtqueue *vq, unsigned int head)
 	vq->num_free++;
 }
 
+static void detach_buf_packed(struct vring_virtqueue *vq, unsigned int id)
+{
+	struct vring_packed_state *state = &vq->packed_state[id];
+
+	vq->data[id] = NULL;
+	vq->num_free += state->num;
+
+	kfree(state->indir);
+	state->indir = NULL;
+
+	state->next = vq->free_head;
+	vq->free_head = id;
+}
+
+/* A packed descriptor is used once both its AVAIL and USED bits match the
+ * wrap counter of the lap it was used in. */
+static inline bool vring_packed_is_used(const struct vring_virtqueue *vq,
+					u16 idx, bool wrap_counter)
+{
+	u16 flags = vq->vring_packed.desc[idx].flags;
+	bool avail = flags & VRING_PACKED_DESC_F_AVAIL;
+	bool used = flags & VRING_PACKED_DESC_F_USED;
+
+	return avail == used && used == wrap_counter;
+}
+
 static inline bool more_used(const struct vring_virtqueue *vq)
 {
+	if (vq->packed)
+		return vring_packed_is_used(vq, vq->last_used_idx,
+					    vq->used_wrap_counter);
 	return vq->last_used_idx != vq->vring.used->idx;
 }
 
+static void *vring_get_buf_packed(struct vring_virtqueue *vq, unsigned int *len)
+{
+	struct vring_packed_desc *desc = vq->vring_packed.desc;
+	unsigned int id, last_used = vq->last_used_idx;
+	void *ret;
+
+	id = desc[last_used].id;
+	*len = desc[last_used].len;
+
+	if (unlikely(id >= vq->vring_packed.num)) {
+		BAD_RING(vq, "id %u out of range\n", id);
+		return NULL;
+	}
+	if (unlikely(!vq->data[id])) {
+		BAD_RING(vq, "id %u is not a head!\n", id);
+		return NULL;
+	}
+
+	/* The used descriptor stands for the whole chain. */
+	last_used += vq->packed_state[id].num;
+	if (last_used >= vq->vring_packed.num) {
+		last_used -= vq->vring_packed.num;
+		vq->used_wrap_counter ^= 1;
+	}
+	vq->last_used_idx = last_used;
+
+	/* detach_buf_packed clears data, so grab it now. */
+	ret = vq->data[id];
+	detach_buf_packed(vq, id);
+
+	/* As in the split layout, move the event offset along if the host
+	 * is to interrupt us for the next entry. */
+	if (vq->event_flags_shadow == VRING_PACKED_EVENT_FLAG_DESC) {
+		vq->vring_packed.driver->off_wrap = last_used |
+			(vq->used_wrap_counter << VRING_PACKED_EVENT_F_WRAP_CTR);
+		virtio_mb(vq);
+	}
+	return ret;
+}
+
 /**
  * virtqueue_get_buf - get the next used buffer
  * @vq: the struct virtqueue we're talking about.
@@ -436,6 +670,11 @@ void *virtqueue_get_buf(struct virtqueue *_vq, unsigned int *len)
 	/* Only get used array entries after they have been exposed by host. */
 	virtio_rmb(vq);
 
+	if (vq->packed) {
+		ret = vring_get_buf_packed(vq, len);
+		goto out;
+	}
+
 	last_used = (vq->last_used_idx & (vq->vring.num - 1));
 	i = vq->vring.used->ring[last_used].id;
 	*len = vq->vring.used->ring[last_used].len;
@@ -461,6 +700,7 @@ void *virtqueue_get_buf(struct virtqueue *_vq, unsigned int *len)
 		virtio_mb(vq);
 	}
 
+out:
 #ifdef DEBUG
 	vq->last_add_time_valid = false;
 #endif
@@ -483,10 +723,49 @@ void virtqueue_disable_cb(struct virtqueue *_vq)
 {
 	struct vring_virtqueue *vq = to_vvq(_vq);
 
+	if (vq->packed) {
+		if (vq->event_flags_shadow != VRING_PACKED_EVENT_FLAG_DISABLE) {
+			vq->event_flags_shadow = VRING_PACKED_EVENT_FLAG_DISABLE;
+			vq->vring_packed.driver->flags = vq->event_flags_shadow;
+		}
+		return;
+	}
+
 	vq->vring.avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
 }
 EXPORT_SYMBOL_GPL(virtqueue_disable_cb);
 
+/* Point the packed event offset @bufs entries past the last used one if
+ * the host publishes event indexes, and turn callbacks back on.  Returns
+ * whether the entry the event offset names has already been used. */
+static bool vring_enable_cb_packed(struct vring_virtqueue *vq, u16 bufs)
+{
+	u16 used_idx = vq->last_used_idx + bufs;
+	bool wrap_counter = vq->used_wrap_counter;
+
+	if (used_idx >= vq->vring_packed.num) {
+		used_idx -= vq->vring_packed.num;
+		wrap_counter ^= 1;
+	}
+
+	if (vq->event) {
+		vq->vring_packed.driver->off_wrap = used_idx |
+			(wrap_counter << VRING_PACKED_EVENT_F_WRAP_CTR);
+		/* The offset must be visible before the flags enabling it. */
+		virtio_wmb(vq);
+	}
+
+	if (vq->event_flags_shadow == VRING_PACKED_EVENT_FLAG_DISABLE) {
+		vq->event_flags_shadow = vq->event ?
+					 VRING_PACKED_EVENT_FLAG_DESC :
+					 VRING_PACKED_EVENT_FLAG_ENABLE;
+		vq->vring_packed.driver->flags = vq->event_flags_shadow;
+	}
+	virtio_mb(vq);
+
+	return vring_packed_is_used(vq, used_idx, wrap_counter);
+}
+
 /**
  * virtqueue_enable_cb - restart callbacks after disable_cb.
  * @vq: the struct virtqueue we're talking about.
@@ -504,6 +783,13 @@ bool virtqueue_enable_cb(struct virtqueue *_vq)
 
 	START_USE(vq);
 
+	if (vq->packed) {
+		bool pending = vring_enable_cb_packed(vq, 0);
+
+		END_USE(vq);
+		return !pending;
+	}
+
 	/* We optimistically turn back on interrupts, then check if there was
 	 * more to do. */
 	/* Depending on the VIRTIO_RING_F_EVENT_IDX feature, we need to
@@ -542,6 +828,18 @@ bool virtqueue_enable_cb_delayed(struct virtqueue *_vq)
 
 	START_USE(vq);
 
+	if (vq->packed) {
+		bool pending;
+
+		/* Without event indexes the offset is not published, so
+		 * this only checks the next entry, like enable_cb. */
+		bufs = vq->event ?
+		       (vq->vring_packed.num - vq->num_free) * 3 / 4 : 0;
+		pending = vring_enable_cb_packed(vq, bufs);
+		END_USE(vq);
+		return !pending;
+	}
+
 	/* We optimistically turn back on interrupts, then check if there was
 	 * more to do. */
 	/* Depending on the VIRTIO_RING_F_USED_EVENT_IDX feature, we need to
@@ -578,18 +876,22 @@ void *virtqueue_detach_unused_buf(struct virtqueue *_vq)
 
 	START_USE(vq);
 
-	for (i = 0; i < vq->vring.num; i++) {
+	for (i = 0; i < virtqueue_get_vring_size(_vq); i++) {
 		if (!vq->data[i])
 			continue;
 		/* detach_buf clears data, so grab it now. */
 		buf = vq->data[i];
-		detach_buf(vq, i);
-		vq->vring.avail->idx--;
+		if (vq->packed) {
+			detach_buf_packed(vq, i);
+		} else {
+			detach_buf(vq, i);
+			vq->vring.avail->idx--;
+		}
 		END_USE(vq);
 		return buf;
 	}
 	/* That should have freed everything. */
-	BUG_ON(vq->num_free != vq->vring.num);
+	BUG_ON(vq->num_free != virtqueue_get_vring_size(_vq));
 
 	END_USE(vq);
 	return NULL;
@@ -638,7 +940,26 @@ struct virtqueue *vring_new_virtqueue(unsigned int num,
 	if (!vq)
 		return NULL;
 
-	vring_init(&vq->vring, num, pages, vring_align);
+	vq->packed = virtio_has_feature(vdev, VIRTIO_RING_F_PACKED);
+	vq->packed_state = NULL;
+	if (vq->packed) {
+		/* Ring offsets must leave room for the wrap counter bit. */
+		if (num > (1 << VRING_PACKED_EVENT_F_WRAP_CTR)) {
+			dev_warn(&vdev->dev, "Bad packed virtqueue length %u\n",
+				 num);
+			kfree(vq);
+			return NULL;
+		}
+		vq->packed_state = kcalloc(num, sizeof(*vq->packed_state),
+					   GFP_KERNEL);
+		if (!vq->packed_state) {
+			kfree(vq);
+			return NULL;
+		}
+		vring_packed_init(&vq->vring_packed, num, pages);
+	} else {
+		vring_init(&vq->vring, num, pages, vring_align);
+	}
 	vq->vq.callback = callback;
 	vq->vq.vdev = vdev;
 	vq->vq.name = name;
@@ -656,13 +977,33 @@ struct virtqueue *vring_new_virtqueue(unsigned int num,
 	vq->indirect = virtio_has_feature(vdev, VIRTIO_RING_F_INDIRECT_DESC);
 	vq->event = virtio_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX);
 
+	/* Put everything in free lists. */
+	vq->num_free = num;
+	vq->free_head = 0;
+
+	if (vq->packed) {
+		vq->next_avail_idx = 0;
+		vq->avail_wrap_counter = 1;
+		vq->used_wrap_counter = 1;
+		vq->avail_used_flags = VRING_PACKED_DESC_F_AVAIL;
+
+		/* No callback?  Tell other side not to bother us. */
+		vq->event_flags_shadow = callback ?
+					 VRING_PACKED_EVENT_FLAG_ENABLE :
+					 VRING_PACKED_EVENT_FLAG_DISABLE;
+		vq->vring_packed.driver->flags = vq->event_flags_shadow;
+
+		for (i = 0; i < num; i++) {
+			vq->packed_state[i].next = i+1;
+			vq->data[i] = NULL;
+		}
+		return &vq->vq;
+	}
+
 	/* No callback?  Tell other side not to bother us. */
 	if (!callback)
 		vq->vring.avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
 
-	/* Put everything in free lists. */
-	vq->num_free = num;
-	vq->free_head = 0;
 	for (i = 0; i < num-1; i++) {
 		vq->vring.desc[i].next = i+1;
 		vq->data[i] = NULL;
@@ -676,6 +1017,7 @@ EXPORT_SYMBOL_GPL(vring_new_virtqueue);
 void vring_del_virtqueue(struct virtqueue *vq)
 {
 	list_del(&vq->list);
+	kfree(to_vvq(vq)->packed_state);
 	kfree(to_vvq(vq));
 }
 EXPORT_SYMBOL_GPL(vring_del_virtqueue);
@@ -691,6 +1033,8 @@ void vring_transport_features(struct virtio_device *vdev)
 			break;
 		case VIRTIO_RING_F_EVENT_IDX:
 			break;
+		case VIRTIO_RING_F_PACKED:
+			break;
 		default:
 			/* We don't understand this bit. */
 			clear_bit(i, vdev->features);
@@ -711,6 +1055,8 @@ unsigned int virtqueue_get_vring_size(struct virtqueue *_vq)
 
 	struct vring_virtqueue *vq = to_vvq(_vq);
 
+	if (vq->packed)
+		return vq->vring_packed.num;
 	return vq->vring.num;
 }
 EXPORT_SYMBOL_GPL(virtqueue_get_vring_size);
@@ -28,6 +28,8 @@
 #include <linux/syscalls.h>
 #include <linux/rbtree.h>
 #include <linux/wait.h>
+#include <linux/llist.h>
+#include <linux/percpu.h>
 #include <linux/eventpoll.h>
 #include <linux/mount.h>
 #include <linux/bitops.h>
@@ -40,22 +42,22 @@
 
 /*
  * LOCKING:
- * There are three level of locking required by epoll :
+ * There are two level of locking required by epoll :
  *
  * 1) epmutex (mutex)
  * 2) ep->mtx (mutex)
- * 3) ep->lock (spinlock)
  *
- * The acquire order is the one listed above, from 1 to 3.
- * We need a spinlock (ep->lock) because we manipulate objects
- * from inside the poll callback, that might be triggered from
- * a wake_up() that in turn might be called from IRQ context.
- * So we can't sleep inside the poll callback and hence we need
- * a spinlock. During the event transfer loop (from kernel to
- * user space) we could end up sleeping due a copy_to_user(), so
- * we need a lock that will allow us to sleep. This lock is a
- * mutex (ep->mtx). It is acquired during the event transfer loop,
- * during epoll_ctl(EPOLL_CTL_DEL) and during eventpoll_release_file().
+ * The acquire order is the one listed above, from 1 to 2.
+ * The poll callback, that might be triggered from a wake_up() that in
+ * turn might be called from IRQ context, takes no epoll lock at all.
+ * It pushes the item on a per-cpu lockless list (ep->pending) and the
+ * consumers splice those lists into ep->rdllist under ep->mtx, so the
+ * ready list itself is only ever touched with ep->mtx held. During the
+ * event transfer loop (from kernel to user space) we could end up
+ * sleeping due a copy_to_user(), so we need a lock that will allow us
+ * to sleep. This lock is a mutex (ep->mtx). It is acquired during the
+ * event transfer loop, during epoll_ctl() and during
+ * eventpoll_release_file().
  * Then we also need a global mutex to serialize eventpoll_release_file()
  * and ep_free().
  * This mutex is acquired by ep_free() during the epoll file
@@ -79,7 +81,7 @@
  * of epoll file descriptors, we use the current recursion depth as
  * the lockdep subkey.
  * It is possible to drop the "ep->mtx" and to use the global
- * mutex "epmutex" (together with "ep->lock") to have it working,
+ * mutex "epmutex" to have it working,
  * but having "ep->mtx" will make the interface more scalable.
  * Events that require holding "epmutex" are very rare, while for
  * normal operations the epoll private "ep->mtx" will guarantee
@@ -87,15 +89,17 @@
  */
 
 /* Epoll private bits inside the event mask */
-#define EP_PRIVATE_BITS (EPOLLONESHOT | EPOLLET)
+#define EP_PRIVATE_BITS (EPOLLONESHOT | EPOLLET | EPOLLEXCLUSIVE)
+
+/* Events that may be combined with EPOLLEXCLUSIVE */
+#define EPOLLEXCLUSIVE_OK_BITS (POLLIN | POLLOUT | POLLERR | POLLHUP | \
+				EPOLLET | EPOLLEXCLUSIVE)
 
 /* Maximum number of nesting allowed inside epoll sets */
 #define EP_MAX_NESTS 4
 
 #define EP_MAX_EVENTS (INT_MAX / sizeof(struct epoll_event))
 
-#define EP_UNACTIVE_PTR ((void *) -1L)
-
 #define EP_ITEM_COST (sizeof(struct epitem) + sizeof(struct eppoll_entry))
 
 struct epoll_filefd {
@@ -134,10 +138,13 @@ struct epitem {
 	struct list_head rdllink;
 
 	/*
-	 * Works together "struct eventpoll"->ovflist in keeping the
-	 * single linked chain of items.
+	 * Links the item on one of the "struct eventpoll"->pending lists
+	 * while EPI_PENDING is set in ->state.
 	 */
-	struct epitem *next;
+	struct llist_node llink;
+
+	/* EPI_* bits, see ep_poll_callback() */
+	unsigned long state;
 
 	/* The file descriptor information this item refers to */
 	struct epoll_filefd ffd;
@@ -164,14 +171,11 @@ struct epitem {
  * interface.
  */
 struct eventpoll {
-	/* Protect the access to this structure */
-	spinlock_t lock;
-
 	/*
 	 * This mutex is used to ensure that files are not removed
 	 * while epoll is using them. This is held during the event
 	 * collection loop, the file cleanup path, the epoll file exit
-	 * code and the ctl operations.
+	 * code and the ctl operations. It also protects ->rdllist.
 	 */
 	struct mutex mtx;
 
@@ -184,15 +188,14 @@ struct eventpoll {
 	/* List of ready file descriptors */
 	struct list_head rdllist;
 
-	/* RB tree root used to store monitored fd structs */
-	struct rb_root rbr;
-
 	/*
-	 * This is a single linked list that chains all the "struct epitem" that
-	 * happened while transferring ready events to userspace w/out
-	 * holding ->lock.
+	 * Per-cpu lockless lists the poll callback queues newly ready items
+	 * on. They are spliced into ->rdllist by ep_splice_pending().
 	 */
-	struct epitem *ovflist;
+	struct llist_head __percpu *pending;
+
+	/* RB tree root used to store monitored fd structs */
+	struct rb_root rbr;
 
 	/* The user that created the eventpoll descriptor */
 	struct user_struct *user;
@@ -222,6 +225,11 @@ struct eppoll_entry {
 	wait_queue_head_t *whead;
 };
 
+/* Bits in "struct epitem"->state */
+enum {
+	EPI_PENDING,		/* queued on one of ep->pending */
+};
+
 /* Wrapper struct used by poll queueing */
 struct ep_pqueue {
 	poll_table pt;
@@ -359,7 +367,95 @@ static void ep_nested_calls_init(struct nested_calls *ncalls)
  */
 static inline int ep_events_available(struct eventpoll *ep)
 {
-	return !list_empty(&ep->rdllist) || ep->ovflist != EP_UNACTIVE_PTR;
+	int cpu;
+
+	if (!list_empty_careful(&ep->rdllist))
+		return 1;
+
+	for_each_possible_cpu(cpu)
+		if (!llist_empty(per_cpu_ptr(ep->pending, cpu)))
+			return 1;
+
+	return 0;
+}
+
+/**
+ * ep_splice_pending - Moves the items the poll callback queued on the
+ *                     per-cpu pending lists to the tail of @head.
+ *
+ * @ep: Pointer to the eventpoll context.
+ * @head: List to move the items to.
+ *
+ * Must be called with "mtx" held. Items that are already linked on a
+ * ready list (@head, ep->rdllist or a scan's private list) stay where
+ * they are.
+ */
+static void ep_splice_pending(struct eventpoll *ep, struct list_head *head)
+{
+	struct llist_node *node, *next;
+	struct epitem *epi;
+	LIST_HEAD(batch);
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		node = llist_del_all(per_cpu_ptr(ep->pending, cpu));
+		if (!node)
+			continue;
+
+		/*
+		 * The lockless list is LIFO, build the batch backwards to
+		 * hand out events in the order they arrived.
+		 */
+		for (; node; node = next) {
+			epi = llist_entry(node, struct epitem, llink);
+			/*
+			 * Fetch ->next before clearing EPI_PENDING, the poll
+			 * callback may requeue the item right after that.
+			 */
+			next = node->next;
+			smp_mb__before_clear_bit();
+			clear_bit(EPI_PENDING, &epi->state);
+
+			if (!ep_is_linked(&epi->rdllink))
+				list_add(&epi->rdllink, &batch);
+		}
+		list_splice_tail_init(&batch, head);
+	}
+}
+
+/*
+ * Takes @epi off the ready lists before it goes away. Must be called with
+ * "mtx" held, after the poll callbacks of @epi have been unregistered.
+ */
+static void ep_unlink_ready(struct eventpoll *ep, struct epitem *epi)
+{
+	if (test_bit(EPI_PENDING, &epi->state))
+		ep_splice_pending(ep, &ep->rdllist);
+
+	if (ep_is_linked(&epi->rdllink))
+		list_del_init(&epi->rdllink);
+}
+
+/*
+ * Wakes up (if active) both the eventpoll wait list and the ->poll() wait
+ * list. Sets *@pwake if the caller has to ep_poll_safewake() the latter,
+ * which must happen outside of any wait queue lock. Returns non zero if a
+ * task sleeping in epoll_wait() has been woken up.
+ */
+static inline int ep_wake_waiters(struct eventpoll *ep, int *pwake)
+{
+	int ewake = 0;
+
+	/* Pairs with the barrier in set_current_state() inside ep_poll() */
+	smp_mb();
+	if (waitqueue_active(&ep->wq)) {
+		wake_up(&ep->wq);
+		ewake = 1;
+	}
+	if (waitqueue_active(&ep->poll_wait))
+		*pwake = 1;
+
+	return ewake;
 }
 
 /**
@@ -546,8 +642,6 @@ static int ep_scan_ready_list(struct eventpoll *ep,
 			      int depth)
 {
 	int error, pwake = 0;
-	unsigned long flags;
-	struct epitem *epi, *nepi;
 	LIST_HEAD(txlist);
 
 	/*
@@ -557,63 +651,26 @@ static int ep_scan_ready_list(struct eventpoll *ep,
 	mutex_lock_nested(&ep->mtx, depth);
 
 	/*
-	 * Steal the ready list, and re-init the original one to the
-	 * empty list. Also, set ep->ovflist to NULL so that events
-	 * happening while looping w/out locks, are not lost. We cannot
-	 * have the poll callback to queue directly on ep->rdllist,
-	 * because we want the "sproc" callback to be able to do it
-	 * in a lockless way.
+	 * Steal the ready list, together with whatever the poll callback
+	 * queued since the last scan. Events happening while "sproc" runs
+	 * keep piling up on the per-cpu pending lists, and are picked up by
+	 * the next scan.
 	 */
-	spin_lock_irqsave(&ep->lock, flags);
 	list_splice_init(&ep->rdllist, &txlist);
-	ep->ovflist = NULL;
-	spin_unlock_irqrestore(&ep->lock, flags);
+	ep_splice_pending(ep, &txlist);
 
 	/*
 	 * Now call the callback function.
 	 */
 	error = (*sproc)(ep, &txlist, priv);
 
-	spin_lock_irqsave(&ep->lock, flags);
-	/*
-	 * During the time we spent inside the "sproc" callback, some
-	 * other events might have been queued by the poll callback.
-	 * We re-insert them inside the main ready-list here.
-	 */
-	for (nepi = ep->ovflist; (epi = nepi) != NULL;
-	     nepi = epi->next, epi->next = EP_UNACTIVE_PTR) {
-		/*
-		 * We need to check if the item is already in the list.
-		 * During the "sproc" callback execution time, items are
-		 * queued into ->ovflist but the "txlist" might already
-		 * contain them, and the list_splice() below takes care of them.
-		 */
-		if (!ep_is_linked(&epi->rdllink))
-			list_add_tail(&epi->rdllink, &ep->rdllist);
-	}
-	/*
-	 * We need to set back ep->ovflist to EP_UNACTIVE_PTR, so that after
-	 * releasing the lock, events will be queued in the normal way inside
-	 * ep->rdllist.
-	 */
-	ep->ovflist = EP_UNACTIVE_PTR;
-
 	/*
 	 * Quickly re-inject items left on "txlist".
 	 */
 	list_splice(&txlist, &ep->rdllist);
 
-	if (!list_empty(&ep->rdllist)) {
-		/*
-		 * Wake up (if active) both the eventpoll wait list and
-		 * the ->poll() wait list (delayed after we release the lock).
-		 */
-		if (waitqueue_active(&ep->wq))
-			wake_up_locked(&ep->wq);
-		if (waitqueue_active(&ep->poll_wait))
-			pwake++;
-	}
-	spin_unlock_irqrestore(&ep->lock, flags);
+	if (!list_empty(&ep->rdllist))
+		ep_wake_waiters(ep, &pwake);
 
 	mutex_unlock(&ep->mtx);
 
@@ -630,16 +687,12 @@ static int ep_scan_ready_list(struct eventpoll *ep,
  */
 static int ep_remove(struct eventpoll *ep, struct epitem *epi)
 {
-	unsigned long flags;
 	struct file *file = epi->ffd.file;
 
 	/*
-	 * Removes poll wait queue hooks. We _have_ to do this without holding
-	 * the "ep->lock" otherwise a deadlock might occur. This because of the
-	 * sequence of the lock acquisition. Here we do "ep->lock" then the wait
-	 * queue head lock when unregistering the wait queue. The wakeup callback
-	 * will run by holding the wait queue head lock and will call our callback
-	 * that will try to get "ep->lock".
+	 * Removes poll wait queue hooks. Once this returns no poll callback
+	 * is running on @epi anymore, nor can one start, so the item can be
+	 * taken off the pending lists below without racing with a requeue.
 	 */
 	ep_unregister_pollwait(ep, epi);
 
@@ -651,10 +704,7 @@ static int ep_remove(struct eventpoll *ep, struct epitem *epi)
 
 	rb_erase(&epi->rbn, &ep->rbr);
 
-	spin_lock_irqsave(&ep->lock, flags);
-	if (ep_is_linked(&epi->rdllink))
-		list_del_init(&epi->rdllink);
-	spin_unlock_irqrestore(&ep->lock, flags);
+	ep_unlink_ready(ep, epi);
 
 	/* At this point it is safe to free the eventpoll item */
 	kmem_cache_free(epi_cache, epi);
@@ -696,7 +746,7 @@ static void ep_free(struct eventpoll *ep)
 	 * Walks through the whole tree by freeing each "struct epitem". At this
 	 * point we are sure no poll callbacks will be lingering around, and also by
 	 * holding "epmutex" we can be sure that no file cleanup code will hit
-	 * us during this operation. So we can avoid the lock on "ep->lock".
+	 * us during this operation. So we can avoid taking "ep->mtx".
 	 */
 	while ((rbp = rb_first(&ep->rbr)) != NULL) {
 		epi = rb_entry(rbp, struct epitem, rbn);
@@ -705,6 +755,7 @@ static void ep_free(struct eventpoll *ep)
 
 	mutex_unlock(&epmutex);
 	mutex_destroy(&ep->mtx);
+	free_percpu(ep->pending);
 	free_uid(ep->user);
 	kfree(ep);
 }
@@ -827,19 +878,23 @@ static int ep_alloc(struct eventpoll **pep)
 	if (unlikely(!ep))
 		goto free_uid;
 
-	spin_lock_init(&ep->lock);
+	ep->pending = alloc_percpu(struct llist_head);
+	if (unlikely(!ep->pending))
+		goto free_ep;
+
 	mutex_init(&ep->mtx);
 	init_waitqueue_head(&ep->wq);
 	init_waitqueue_head(&ep->poll_wait);
 	INIT_LIST_HEAD(&ep->rdllist);
 	ep->rbr = RB_ROOT;
-	ep->ovflist = EP_UNACTIVE_PTR;
 	ep->user = user;
 
 	*pep = ep;
 
 	return 0;
 
+free_ep:
+	kfree(ep);
 free_uid:
 	free_uid(user);
 	return error;
@@ -881,12 +936,12 @@ static struct epitem *ep_find(struct eventpoll *ep, struct file *file, int fd)
  */
 static int ep_poll_callback(wait_queue_t *wait, unsigned mode, int sync, void *key)
 {
-	int pwake = 0;
-	unsigned long flags;
+	int pwake = 0, ewake;
 	struct epitem *epi = ep_item_from_wait(wait);
 	struct eventpoll *ep = epi->ep;
+	bool pollfree = (unsigned long)key & POLLFREE;
 
-	if ((unsigned long)key & POLLFREE) {
+	if (pollfree) {
 		ep_pwq_from_wait(wait)->whead = NULL;
 		/*
 		 * whead = NULL above can race with ep_remove_wait_queue()
@@ -897,8 +952,6 @@ static int ep_poll_callback(wait_queue_t *wait, unsigned mode, int sync, void *k
 		list_del_init(&wait->task_list);
 	}
 
-	spin_lock_irqsave(&ep->lock, flags);
-
 	/*
 	 * If the event mask does not contain any poll(2) event, we consider the
 	 * descriptor to be disabled. This condition is likely the effect of the
@@ -906,7 +959,7 @@ static int ep_poll_callback(wait_queue_t *wait, unsigned mode, int sync, void *k
 	 * until the next EPOLL_CTL_MOD will be issued.
 	 */
 	if (!(epi->event.events & ~EP_PRIVATE_BITS))
-		goto out_unlock;
+		return 0;
 
 	/*
 	 * Check the events coming with the callback. At this stage, not
@@ -915,42 +968,36 @@ static int ep_poll_callback(wait_queue_t *wait, unsigned mode, int sync, void *k
 	 * test for "key" != NULL before the event match test.
 	 */
 	if (key && !((unsigned long) key & epi->event.events))
-		goto out_unlock;
+		return 0;
 
 	/*
-	 * If we are transferring events to userspace, we can hold no locks
-	 * (because we're accessing user memory, and because of linux f_op->poll()
-	 * semantics). All the events that happen during that period of time are
-	 * chained in ep->ovflist and requeued later on.
+	 * If this item is already queued we exit soon, whoever queued it
+	 * did the wakeup. Otherwise push it on this cpu's pending list,
+	 * without taking any lock shared with the other producers or with
+	 * the epoll_wait() side, which splices the lists under "mtx".
 	 */
-	if (unlikely(ep->ovflist != EP_UNACTIVE_PTR)) {
-		if (epi->next == EP_UNACTIVE_PTR) {
-			epi->next = ep->ovflist;
-			ep->ovflist = epi;
-		}
-		goto out_unlock;
-	}
+	if (test_and_set_bit(EPI_PENDING, &epi->state))
+		return 0;
 
-	/* If this file is already in the ready list we exit soon */
-	if (!ep_is_linked(&epi->rdllink))
-		list_add_tail(&epi->rdllink, &ep->rdllist);
+	llist_add(&epi->llink, this_cpu_ptr(ep->pending));
 
-	/*
-	 * Wake up ( if active ) both the eventpoll wait list and the ->poll()
-	 * wait list.
-	 */
-	if (waitqueue_active(&ep->wq))
-		wake_up_locked(&ep->wq);
-	if (waitqueue_active(&ep->poll_wait))
-		pwake++;
-
-out_unlock:
-	spin_unlock_irqrestore(&ep->lock, flags);
+	ewake = ep_wake_waiters(ep, &pwake);
 
 	/* We have to call this outside the lock */
 	if (pwake)
 		ep_poll_safewake(&ep->poll_wait);
 
+	/*
+	 * The return value is only looked at for exclusive waiters, where it
+	 * tells __wake_up_common() whether this wakeup has been consumed. If
+	 * nobody was sleeping on this epoll set, or it already had the event
+	 * queued, let the wakeup move on to the next set.  A POLLFREE wakeup
+	 * is never consumed: it must reach every entry, or those left behind
+	 * would keep pointing at the freed wait queue.
+	 */
+	if (epi->event.events & EPOLLEXCLUSIVE)
+		return pollfree ? 0 : ewake;
+
 	return 1;
 }
 
@@ -968,7 +1015,10 @@ static void ep_ptable_queue_proc(struct file *file, wait_queue_head_t *whead,
 		init_waitqueue_func_entry(&pwq->wait, ep_poll_callback);
 		pwq->whead = whead;
 		pwq->base = epi;
-		add_wait_queue(whead, &pwq->wait);
+		if (epi->event.events & EPOLLEXCLUSIVE)
+			add_wait_queue_exclusive(whead, &pwq->wait);
+		else
+			add_wait_queue(whead, &pwq->wait);
 		list_add_tail(&pwq->llink, &epi->pwqlist);
 		epi->nwait++;
 	} else {
@@ -1098,7 +1148,6 @@ static int ep_insert(struct eventpoll *ep, struct epoll_event *event,
 		     struct file *tfile, int fd)
 {
 	int error, revents, pwake = 0;
-	unsigned long flags;
 	long user_watches;
 	struct epitem *epi;
 	struct ep_pqueue epq;
@@ -1117,7 +1166,7 @@ static int ep_insert(struct eventpoll *ep, struct epoll_event *event,
 	ep_set_ffd(&epi->ffd, tfile, fd);
 	epi->event = *event;
 	epi->nwait = 0;
-	epi->next = EP_UNACTIVE_PTR;
+	epi->state = 0;
 
 	/* Initialize the poll table using the queue callback */
 	epq.epi = epi;
@@ -1158,22 +1207,14 @@ static int ep_insert(struct eventpoll *ep, struct epoll_event *event,
 	if (reverse_path_check())
 		goto error_remove_epi;
 
-	/* We have to drop the new item inside our item list to keep track of it */
-	spin_lock_irqsave(&ep->lock, flags);
-
 	/* If the file is already "ready" we drop it inside the ready list */
 	if ((revents & event->events) && !ep_is_linked(&epi->rdllink)) {
 		list_add_tail(&epi->rdllink, &ep->rdllist);
 
 		/* Notify waiting tasks that events are available */
-		if (waitqueue_active(&ep->wq))
-			wake_up_locked(&ep->wq);
-		if (waitqueue_active(&ep->poll_wait))
-			pwake++;
+		ep_wake_waiters(ep, &pwake);
 	}
 
-	spin_unlock_irqrestore(&ep->lock, flags);
-
 	atomic_long_inc(&ep->user->epoll_watches);
 
 	/* We have to call this outside the lock */
@@ -1195,14 +1236,9 @@ error_unregister:
 
 	/*
 	 * We need to do this because an event could have been arrived on some
-	 * allocated wait queue. Note that we don't care about the ep->ovflist
-	 * list, since that is used/cleaned only inside a section bound by "mtx".
-	 * And ep_insert() is called with "mtx" held.
+	 * allocated wait queue.
 	 */
-	spin_lock_irqsave(&ep->lock, flags);
-	if (ep_is_linked(&epi->rdllink))
-		list_del_init(&epi->rdllink);
-	spin_unlock_irqrestore(&ep->lock, flags);
+	ep_unlink_ready(ep, epi);
 
 	kmem_cache_free(epi_cache, epi);
 
@@ -1241,17 +1277,12 @@ static int ep_modify(struct eventpoll *ep, struct epitem *epi, struct epoll_even
 	 * list, push it inside.
 	 */
 	if (revents & event->events) {
-		spin_lock_irq(&ep->lock);
 		if (!ep_is_linked(&epi->rdllink)) {
 			list_add_tail(&epi->rdllink, &ep->rdllist);
 
 			/* Notify waiting tasks that events are available */
-			if (waitqueue_active(&ep->wq))
-				wake_up_locked(&ep->wq);
-			if (waitqueue_active(&ep->poll_wait))
-				pwake++;
+			ep_wake_waiters(ep, &pwake);
 		}
-		spin_unlock_irq(&ep->lock);
 	}
 
 	/* We have to call this outside the lock */
@@ -1314,7 +1345,7 @@ static int ep_send_events_proc(struct eventpoll *ep, struct list_head *head,
 				 * into ep->rdllist besides us. The epoll_ctl()
 				 * callers are locked out by
 				 * ep_scan_ready_list() holding "mtx" and the
-				 * poll callback will queue them in ep->ovflist.
+				 * poll callback only queues on ep->pending.
 				 */
 				list_add_tail(&epi->rdllink, &ep->rdllist);
 			}
@@ -1367,7 +1398,6 @@ static int ep_poll(struct eventpoll *ep, struct epoll_event __user *events,
 		   int maxevents, long timeout)
 {
 	int res = 0, eavail, timed_out = 0;
-	unsigned long flags;
 	long slack = 0;
 	wait_queue_t wait;
 	ktime_t expires, *to = NULL;
@@ -1384,13 +1414,10 @@ static int ep_poll(struct eventpoll *ep, struct epoll_event __user *events,
 		 * caller specified a non blocking operation.
 		 */
 		timed_out = 1;
-		spin_lock_irqsave(&ep->lock, flags);
 		goto check_events;
 	}
 
 fetch_events:
-	spin_lock_irqsave(&ep->lock, flags);
-
 	if (!ep_events_available(ep)) {
 		/*
 		 * We don't have any available event to return to the caller.
@@ -1398,7 +1425,7 @@ fetch_events:
 		 * ep_poll_callback() when events will become available.
 		 */
 		init_waitqueue_entry(&wait, current);
-		__add_wait_queue_exclusive(&ep->wq, &wait);
+		add_wait_queue_exclusive(&ep->wq, &wait);
 
 		for (;;) {
 			/*
@@ -1414,13 +1441,10 @@ fetch_events:
 				break;
 			}
 
-			spin_unlock_irqrestore(&ep->lock, flags);
 			if (!schedule_hrtimeout_range(to, slack, HRTIMER_MODE_ABS))
 				timed_out = 1;
-
-			spin_lock_irqsave(&ep->lock, flags);
 		}
-		__remove_wait_queue(&ep->wq, &wait);
+		remove_wait_queue(&ep->wq, &wait);
 
 		set_current_state(TASK_RUNNING);
 	}
@@ -1428,8 +1452,6 @@ check_events:
 	/* Is it worth to try to dig for events ? */
 	eavail = ep_events_available(ep);
 
-	spin_unlock_irqrestore(&ep->lock, flags);
-
 	/*
 	 * Try to transfer events to user space. In case we get 0 events and
 	 * there's still timeout left over, we go trying again in search of
@@ -1638,6 +1660,21 @@ SYSCALL_DEFINE4(epoll_ctl, int, epfd, int, op, int, fd,
 	if (file == tfile || !is_file_epoll(file))
 		goto error_tgt_fput;
 
+	/*
+	 * EPOLLEXCLUSIVE only makes sense when first registering a plain
+	 * file, and only together with the basic poll events. An exclusive
+	 * wakeup is a property of the wait queue entry, which EPOLL_CTL_MOD
+	 * cannot change, and nested epoll sets are woken through their own
+	 * ->poll_wait which has no exclusive semantics.
+	 */
+	if (ep_op_has_event(op) && (epds.events & EPOLLEXCLUSIVE)) {
+		if (op == EPOLL_CTL_MOD)
+			goto error_tgt_fput;
+		if (is_file_epoll(tfile) ||
+		    (epds.events & ~EPOLLEXCLUSIVE_OK_BITS))
+			goto error_tgt_fput;
+	}
+
 	/*
 	 * At this point it is safe to assume that the "private_data" contains
 	 * our own data structure.
@@ -1698,6 +1735,8 @@ SYSCALL_DEFINE4(epoll_ctl, int, epfd, int, op, int, fd,
 		break;
 	case EPOLL_CTL_MOD:
 		if (epi) {
+			if (epi->event.events & EPOLLEXCLUSIVE)
+				break;
 			epds.events |= POLLERR | POLLHUP;
 			error = ep_modify(ep, epi, &epds);
 		} else
@@ -258,6 +258,27 @@ NF_HOOK(uint8_t pf, unsigned int hook, struct sk_buff *skb,
 	return NF_HOOK_THRESH(pf, hook, skb, in, out, okfn, INT_MIN);
 }
 
+/* Run the hook on each skb of @head.  Accepted packets are left on @head
+ * for the caller to finish, the others have been dropped, queued or stolen.
+ */
+static inline void
+NF_HOOK_LIST(uint8_t pf, unsigned int hook, struct list_head *head,
+	     struct net_device *in, struct net_device *out,
+	     int (*okfn)(struct sk_buff *))
+{
+	struct sk_buff *skb, *next;
+	struct list_head sublist;
+
+	INIT_LIST_HEAD(&sublist);
+	list_for_each_entry_safe(skb, next, head, list) {
+		skb_list_del_init(skb);
+		if (nf_hook_thresh(pf, hook, skb, in, out, okfn, INT_MIN) == 1)
+			list_add_tail(&skb->list, &sublist);
+	}
+	/* Put passed packets back on main list */
+	list_splice(&sublist, head);
+}
+
 /* Call setsockopt() */
 int nf_setsockopt(struct sock *sk, u_int8_t pf, int optval, char __user *opt,
 		  unsigned int len);
@@ -364,6 +385,13 @@ extern struct proc_dir_entry *proc_net_netfilter;
 #else /* !CONFIG_NETFILTER */
 #define NF_HOOK(pf, hook, skb, indev, outdev, okfn) (okfn)(skb)
 #define NF_HOOK_COND(pf, hook, skb, indev, outdev, okfn, cond) (okfn)(skb)
+static inline void
+NF_HOOK_LIST(uint8_t pf, unsigned int hook, struct list_head *head,
+	     struct net_device *in, struct net_device *out,
+	     int (*okfn)(struct sk_buff *))
+{
+	/* nothing to filter */
+}
 static inline int nf_hook_thresh(u_int8_t pf, unsigned int hook,
 				 struct sk_buff *skb,
 				 struct net_device *indev,
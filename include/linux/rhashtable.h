@@ -0,0 +1,119 @@
+/*
+ * Resizable, RCU-protected hash table
+ *
+ * Lookups run under rcu_read_lock() alone.  Insertions and removals take
+ * a spinlock of the table and never allocate; when the load factor leaves
+ * the 30%-75% band they schedule a worker which doubles or halves the
+ * table, moving the entries one bucket at a time while readers keep
+ * finding them in either table.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _LINUX_RHASHTABLE_H
+#define _LINUX_RHASHTABLE_H
+
+#include <linux/compiler.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+
+struct rhash_head {
+	struct rhash_head __rcu		*next;
+};
+
+/**
+ * struct bucket_table - Table of hash buckets
+ * @size: Number of buckets, a power of two
+ * @future_tbl: Table a resize is moving the entries to, if any
+ * @buckets: Heads of the RCU-protected chains
+ */
+struct bucket_table {
+	size_t				size;
+	struct bucket_table __rcu	*future_tbl;
+	struct rhash_head __rcu		*buckets[];
+};
+
+typedef u32 (*rht_hashfn_t)(const void *data, u32 len, u32 seed);
+typedef u32 (*rht_obj_hashfn_t)(const void *data, u32 seed);
+
+/**
+ * struct rhashtable_params - Hash table construction parameters
+ * @nelem_hint: Expected number of elements, sizes the initial table
+ * @key_len: Length of the key, 0 to hash whole objects with @obj_hashfn
+ * @key_offset: Offset of the key in the object
+ * @head_offset: Offset of the struct rhash_head in the object
+ * @hash_rnd: Seed for the hash function, random if 0
+ * @max_shift: Log2 of the largest table size, 0 for the default of 24,
+ *	which is also the limit
+ * @min_shift: Log2 of the smallest table size, 0 for the default
+ * @hashfn: Hash function for keys, e.g. jhash
+ * @obj_hashfn: Hash function for objects, when @key_len is 0
+ */
+struct rhashtable_params {
+	size_t			nelem_hint;
+	size_t			key_len;
+	size_t			key_offset;
+	size_t			head_offset;
+	u32			hash_rnd;
+	unsigned int		max_shift;
+	unsigned int		min_shift;
+	rht_hashfn_t		hashfn;
+	rht_obj_hashfn_t	obj_hashfn;
+};
+
+/**
+ * struct rhashtable - Hash table handle
+ * @tbl: Bucket table readers start from
+ * @nelems: Number of elements in the table
+ * @shift: Log2 of the size of @tbl
+ * @p: Construction parameters
+ * @lock: Serializes insertions, removals and moves of entries by a resize
+ * @mutex: Serializes resizes with each other and with rhashtable_destroy()
+ * @run_work: Deferred resize
+ * @being_destroyed: Resizes are no longer allowed
+ */
+struct rhashtable {
+	struct bucket_table __rcu	*tbl;
+	size_t				nelems;
+	unsigned int			shift;
+	struct rhashtable_params	p;
+	spinlock_t			lock;
+	struct mutex			mutex;
+	struct work_struct		run_work;
+	bool				being_destroyed;
+};
+
+#define rht_dereference(p, ht) \
+	rcu_dereference_protected(p, lockdep_is_held(&(ht)->lock) || \
+				     lockdep_is_held(&(ht)->mutex))
+
+#define rht_dereference_rcu(p, ht) \
+	rcu_dereference_check(p, lockdep_is_held(&(ht)->lock))
+
+static inline void *rht_obj(const struct rhashtable *ht,
+			    const struct rhash_head *he)
+{
+	return (void *)he - ht->p.head_offset;
+}
+
+int rhashtable_init(struct rhashtable *ht,
+		    const struct rhashtable_params *params);
+void rhashtable_destroy(struct rhashtable *ht);
+
+u32 rhashtable_hashfn(const struct rhashtable *ht, const void *key, u32 len);
+
+void rhashtable_insert(struct rhashtable *ht, struct rhash_head *obj);
+bool rhashtable_remove(struct rhashtable *ht, struct rhash_head *obj);
+
+void *rhashtable_lookup(const struct rhashtable *ht, const void *key);
+void *rhashtable_lookup_compare(const struct rhashtable *ht, u32 hash,
+				bool (*compare)(void *, void *), void *arg);
+
+int rhashtable_expand(struct rhashtable *ht);
+int rhashtable_shrink(struct rhashtable *ht);
+
+#endif /* _LINUX_RHASHTABLE_H */
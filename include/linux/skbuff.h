@@ -240,13 +240,30 @@ enum {
  * lower device, the skb last reference should be 0 when calling this.
  * The ctx field is used to track device context.
  * The desc field is used to track userspace buffer index.
+ *
+ * For MSG_ZEROCOPY socket sends the callback is sock_zerocopy_callback()
+ * and the structure instead carries the range of send calls [id, id + len)
+ * it completes, whether the data was really sent without a copy, and a
+ * reference count shared by every skb that points to the user pages.
  */
 struct ubuf_info {
 	void (*callback)(struct ubuf_info *);
-	void *ctx;
-	unsigned long desc;
+	union {
+		struct {
+			void *ctx;
+			unsigned long desc;
+		};
+		struct {
+			u32 id;
+			u16 len;
+			u16 zerocopy:1;
+		};
+	};
+	atomic_t refcnt;
 };
 
+#define skb_uarg(SKB)	((struct ubuf_info *)(skb_shinfo(SKB)->destructor_arg))
+
 /* This data is invariant across clones and lives at
  * the end of the header data, ie. at skb->end.
  */
@@ -308,6 +325,9 @@ enum {
 	SKB_GSO_TCPV6 = 1 << 4,
 
 	SKB_GSO_FCOE = 1 << 5,
+
+	/* UDP datagrams of gso_size payload each, not IP fragments */
+	SKB_GSO_UDP_L4 = 1 << 6,
 };
 
 #if BITS_PER_LONG > 32
@@ -329,6 +349,7 @@ typedef unsigned char *sk_buff_data_t;
  *	struct sk_buff - socket buffer
  *	@next: Next buffer in list
  *	@prev: Previous buffer in list
+ *	@list: Queue head, for batches of buffers on a struct list_head
  *	@tstamp: Time we arrived
  *	@sk: Socket we are owned by
  *	@dev: Device we arrived on/are leaving by
@@ -371,8 +392,10 @@ typedef unsigned char *sk_buff_data_t;
  *	@wifi_acked_valid: wifi_acked was set
  *	@wifi_acked: whether frame was acked on wifi or not
  *	@no_fcs:  Request NIC to treat last 4 bytes as Ethernet FCS
+ *	@head_frag: skb->head is a page fragment, not kmalloc() memory
  *	@dma_cookie: a cookie to one of several possible DMA operations
  *		done by skb DMA functions
+ *	@napi_id: id of the NAPI struct this skb came from
  *	@secmark: security marking
  *	@mark: Generic packet mark
  *	@dropcount: total number of sk_receive_queue overflows
@@ -389,9 +412,14 @@ typedef unsigned char *sk_buff_data_t;
  */
 
 struct sk_buff {
-	/* These two members must be first. */
-	struct sk_buff		*next;
-	struct sk_buff		*prev;
+	union {
+		struct {
+			/* These two members must be first. */
+			struct sk_buff		*next;
+			struct sk_buff		*prev;
+		};
+		struct list_head	list;
+	};
 
 	ktime_t			tstamp;
 
@@ -470,11 +498,15 @@ struct sk_buff {
 	__u8			wifi_acked_valid:1;
 	__u8			wifi_acked:1;
 	__u8			no_fcs:1;
-	/* 9/11 bit hole (depending on ndisc_nodetype presence) */
+	__u8			head_frag:1;
+	/* 8/10 bit hole (depending on ndisc_nodetype presence) */
 	kmemcheck_bitfield_end(flags2);
 
-#ifdef CONFIG_NET_DMA
-	dma_cookie_t		dma_cookie;
+#if defined CONFIG_NET_DMA || defined CONFIG_NET_RX_BUSY_POLL
+	union {
+		unsigned int	napi_id;
+		dma_cookie_t	dma_cookie;
+	};
 #endif
 #ifdef CONFIG_NETWORK_SECMARK
 	__u32			secmark;
@@ -562,7 +594,7 @@ extern void consume_skb(struct sk_buff *skb);
 extern void	       __kfree_skb(struct sk_buff *skb);
 extern struct sk_buff *__alloc_skb(unsigned int size,
 				   gfp_t priority, int fclone, int node);
-extern struct sk_buff *build_skb(void *data);
+extern struct sk_buff *build_skb(void *data, unsigned int frag_size);
 static inline struct sk_buff *alloc_skb(unsigned int size,
 					gfp_t priority)
 {
@@ -580,6 +612,12 @@ extern bool skb_recycle_check(struct sk_buff *skb, int skb_size);
 
 extern struct sk_buff *skb_morph(struct sk_buff *dst, struct sk_buff *src);
 extern int skb_copy_ubufs(struct sk_buff *skb, gfp_t gfp_mask);
+extern struct ubuf_info *sock_zerocopy_alloc(struct sock *sk, size_t size);
+extern void sock_zerocopy_callback(struct ubuf_info *uarg);
+extern void sock_zerocopy_put(struct ubuf_info *uarg);
+extern void sock_zerocopy_put_abort(struct ubuf_info *uarg);
+extern int skb_zerocopy_add_frags(struct sk_buff *skb, struct ubuf_info *uarg,
+				  const char __user *from, int len);
 extern struct sk_buff *skb_clone(struct sk_buff *skb,
 				 gfp_t priority);
 extern struct sk_buff *skb_copy(const struct sk_buff *skb,
@@ -782,6 +820,24 @@ static inline int skb_header_cloned(const struct sk_buff *skb)
 	return dataref != 1;
 }
 
+/**
+ *	skb_unclone - make the shared info of a buffer private
+ *	@skb: buffer to operate on
+ *	@pri: priority for memory allocation
+ *
+ *	Copies the header if it is shared with a clone, so that frags and
+ *	tx_flags can be changed without the clone seeing it.
+ */
+static inline int skb_unclone(struct sk_buff *skb, gfp_t pri)
+{
+	might_sleep_if(pri & __GFP_WAIT);
+
+	if (skb_cloned(skb))
+		return pskb_expand_head(skb, 0, 0, pri);
+
+	return 0;
+}
+
 /**
  *	skb_header_release - release reference to header
  *	@skb: buffer to operate on
@@ -1147,6 +1203,13 @@ static inline void __skb_unlink(struct sk_buff *skb, struct sk_buff_head *list)
 	prev->next = next;
 }
 
+/* remove an skb from a struct list_head batch (see netif_receive_skb_list()) */
+static inline void skb_list_del_init(struct sk_buff *skb)
+{
+	__list_del_entry(&skb->list);
+	skb->next = NULL;
+}
+
 /**
  *	__skb_dequeue - remove from the head of the queue
  *	@list: list to dequeue from
@@ -1687,6 +1750,9 @@ static inline struct sk_buff *__dev_alloc_skb(unsigned int length,
 
 extern struct sk_buff *dev_alloc_skb(unsigned int length);
 
+extern void *__netdev_alloc_frag(unsigned int fragsz, gfp_t gfp_mask);
+extern void *netdev_alloc_frag(unsigned int fragsz);
+
 extern struct sk_buff *__netdev_alloc_skb(struct net_device *dev,
 		unsigned int length, gfp_t gfp_mask);
 
@@ -1975,6 +2041,70 @@ static inline int skb_can_coalesce(struct sk_buff *skb, int i,
 	return 0;
 }
 
+/* Does the skb point to user pages that must not be written or held? */
+static inline bool skb_zcopy(const struct sk_buff *skb)
+{
+	return skb_shinfo(skb)->tx_flags & SKBTX_DEV_ZEROCOPY;
+}
+
+static inline bool skb_zcopy_sock(const struct sk_buff *skb)
+{
+	return skb_zcopy(skb) &&
+	       skb_uarg(skb)->callback == sock_zerocopy_callback;
+}
+
+static inline void sock_zerocopy_get(struct ubuf_info *uarg)
+{
+	atomic_inc(&uarg->refcnt);
+}
+
+/**
+ *	skb_zerocopy_clone - share the user pages of @orig with @nskb
+ *	@nskb: buffer that was given references to the frags of @orig
+ *	@orig: MSG_ZEROCOPY buffer
+ *
+ *	Completion of the send call is then deferred until @nskb is freed
+ *	as well.  Returns -EEXIST if @nskb already points to other user
+ *	pages.
+ */
+static inline int skb_zerocopy_clone(struct sk_buff *nskb,
+				     const struct sk_buff *orig)
+{
+	if (!skb_zcopy_sock(orig))
+		return 0;
+	if (skb_zcopy(nskb))
+		return skb_uarg(nskb) == skb_uarg(orig) ? 0 : -EEXIST;
+
+	sock_zerocopy_get(skb_uarg(orig));
+	skb_shinfo(nskb)->destructor_arg = skb_uarg(orig);
+	skb_shinfo(nskb)->tx_flags |= SKBTX_DEV_ZEROCOPY;
+	return 0;
+}
+
+/**
+ *	skb_orphan_frags - make a private copy of device zerocopy frags
+ *	@skb: buffer about to be cloned or copied
+ *	@gfp_mask: allocation priority
+ *
+ *	Frags of MSG_ZEROCOPY sends are reference counted through their
+ *	ubuf_info and may be shared; those handed to a device by macvtap or
+ *	vhost must be copied before the skb is duplicated.
+ */
+static inline int skb_orphan_frags(struct sk_buff *skb, gfp_t gfp_mask)
+{
+	if (likely(!skb_zcopy(skb)) || skb_zcopy_sock(skb))
+		return 0;
+	return skb_copy_ubufs(skb, gfp_mask);
+}
+
+/* Frags delivered to a local socket or tap may be held indefinitely */
+static inline int skb_orphan_frags_rx(struct sk_buff *skb, gfp_t gfp_mask)
+{
+	if (likely(!skb_zcopy(skb)))
+		return 0;
+	return skb_copy_ubufs(skb, gfp_mask);
+}
+
 static inline int __skb_linearize(struct sk_buff *skb)
 {
 	return __pskb_pull_tail(skb, skb->data_len) ? 0 : -ENOMEM;
@@ -2551,6 +2681,9 @@ static inline bool skb_is_recycleable(const struct sk_buff *skb, int skb_size)
 	if (skb_is_nonlinear(skb) || skb->fclone != SKB_FCLONE_UNAVAILABLE)
 		return false;
 
+	if (skb->head_frag)
+		return false;
+
 	skb_size = SKB_DATA_ALIGN(skb_size + NET_SKB_PAD);
 	if (skb_end_pointer(skb) - skb->head < skb_size)
 		return false;
@@ -63,6 +63,20 @@ struct vhost_memory {
 	struct vhost_memory_region regions[0];
 };
 
+struct vhost_net_busyloop_stats {
+	__u32 index;
+	/* Current budget in microseconds */
+	__u32 budget;
+	/* Busy polls started */
+	__u64 polls;
+	/* Busy polls that found work */
+	__u64 hits;
+	/* Busy polls that ran out of budget or had to yield */
+	__u64 misses;
+	/* Times the ring went idle and waited for a notification */
+	__u64 sleeps;
+};
+
 /* ioctls */
 
 #define VHOST_VIRTIO 0xAF
@@ -102,6 +116,12 @@ struct vhost_memory {
 #define VHOST_SET_VRING_BASE _IOW(VHOST_VIRTIO, 0x12, struct vhost_vring_state)
 /* Get accessor: reads index, writes value in num */
 #define VHOST_GET_VRING_BASE _IOWR(VHOST_VIRTIO, 0x12, struct vhost_vring_state)
+/* Bind the worker thread servicing the ring to CPU num, which must be in the
+ * cpuset of the owner, e.g. next to the vcpu that kicks the ring.  Pass
+ * VHOST_VRING_WORKER_CPU_ANY to unbind it.  The rings of a device share one
+ * worker unless the device runs one per ring. */
+#define VHOST_SET_VRING_WORKER_CPU _IOW(VHOST_VIRTIO, 0x13, struct vhost_vring_state)
+#define VHOST_VRING_WORKER_CPU_ANY (~0U)
 
 /* The following ioctls use eventfd file descriptors to signal and poll
  * for events. */
@@ -121,6 +141,24 @@ struct vhost_memory {
  * device.  This can be used to stop the ring (e.g. for migration). */
 #define VHOST_NET_SET_BACKEND _IOW(VHOST_VIRTIO, 0x30, struct vhost_vring_file)
 
+/* Let the worker busy poll an idle ring (and, for RX, the backend socket)
+ * for up to this many microseconds before it waits for a notification.
+ * The budget used is adapted per ring between 0 and this value, following
+ * how often polling finds work.  0, the default, disables busy polling. */
+#define VHOST_NET_SET_BUSYLOOP_TIMEOUT _IOW(VHOST_VIRTIO, 0x31, __u32)
+#define VHOST_NET_GET_BUSYLOOP_TIMEOUT _IOR(VHOST_VIRTIO, 0x31, __u32)
+/* Get busy polling counters of ring index. */
+#define VHOST_NET_GET_BUSYLOOP_STATS _IOWR(VHOST_VIRTIO, 0x32, struct vhost_net_busyloop_stats)
+
+/* VHOST_BLK specific defines */
+
+/* Attach virtio blk ring to a block device or regular file, opened for
+ * reading and, unless the disk is read-only, writing.  Block devices are
+ * accessed with bios straight from guest memory, files with synchronous
+ * reads and writes.  Pass fd -1 to stop the ring; this waits for requests
+ * in flight to complete. */
+#define VHOST_BLK_SET_BACKEND _IOW(VHOST_VIRTIO, 0x50, struct vhost_vring_file)
+
 /* Feature bits */
 /* Log all write descriptors. Can be changed while device is active. */
 #define VHOST_F_LOG_ALL 26
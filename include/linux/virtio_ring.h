@@ -58,6 +58,26 @@
  * at the end of the used ring. Guest should ignore the used->flags field. */
 #define VIRTIO_RING_F_EVENT_IDX		29
 
+/* The ring uses the packed layout: a single ring of descriptors which the
+ * Guest makes available and the Host marks used in place, see struct
+ * vring_packed_desc. */
+#define VIRTIO_RING_F_PACKED		31
+
+/* Packed ring descriptor flags, besides VRING_DESC_F_*.  The Guest makes a
+ * descriptor available by setting AVAIL to its wrap counter and USED to the
+ * inverse; the Host marks it used by setting both to its own wrap counter.
+ * Wrap counters start at 1 and flip every time the ring wraps around. */
+#define VRING_PACKED_DESC_F_AVAIL	(1 << 7)
+#define VRING_PACKED_DESC_F_USED	(1 << 15)
+
+/* Packed ring event suppression flags: notify always, never, or when the
+ * ring reaches off_wrap (requires VIRTIO_RING_F_EVENT_IDX). */
+#define VRING_PACKED_EVENT_FLAG_ENABLE	0x0
+#define VRING_PACKED_EVENT_FLAG_DISABLE	0x1
+#define VRING_PACKED_EVENT_FLAG_DESC	0x2
+/* The top bit of off_wrap is the wrap counter, the rest a ring offset. */
+#define VRING_PACKED_EVENT_F_WRAP_CTR	15
+
 /* Virtio ring descriptors: 16 bytes.  These can chain together via "next". */
 struct vring_desc {
 	/* Address (guest-physical). */
@@ -100,6 +120,38 @@ struct vring {
 	struct vring_used *used;
 };
 
+/* Packed virtio ring descriptors: 16 bytes.  A buffer is a run of these,
+ * chained via VRING_DESC_F_NEXT; a used descriptor replaces its first. */
+struct vring_packed_desc {
+	/* Address (guest-physical). */
+	__u64 addr;
+	/* Length; for a used descriptor, the length written. */
+	__u32 len;
+	/* Buffer id, handed back in the used descriptor. */
+	__u16 id;
+	/* The flags as indicated above. */
+	__u16 flags;
+};
+
+struct vring_packed_desc_event {
+	/* Ring offset and wrap counter to notify at */
+	__u16 off_wrap;
+	/* VRING_PACKED_EVENT_FLAG_* */
+	__u16 flags;
+};
+
+struct vring_packed {
+	unsigned int num;
+
+	struct vring_packed_desc *desc;
+
+	/* Event suppression written by the Guest, read by the Host */
+	struct vring_packed_desc_event *driver;
+
+	/* Event suppression written by the Host, read by the Guest */
+	struct vring_packed_desc_event *device;
+};
+
 /* The standard layout for the ring is a continuous chunk of memory which looks
  * like this.  We assume num is a power of 2.
  *
@@ -146,6 +198,34 @@ static inline unsigned vring_size(unsigned int num, unsigned long align)
 		+ sizeof(__u16) * 3 + sizeof(struct vring_used_elem) * num;
 }
 
+/* The packed layout takes less room than the standard one, so transports
+ * size rings with vring_size() either way.  num is at most 32768.
+ *
+ * struct vring_packed
+ * {
+ *	// The descriptor ring (16 bytes each)
+ *	struct vring_packed_desc desc[num];
+ *
+ *	// Event suppression: the Guest's, then the Host's
+ *	struct vring_packed_desc_event driver;
+ *	struct vring_packed_desc_event device;
+ * };
+ */
+static inline void vring_packed_init(struct vring_packed *vr, unsigned int num,
+				     void *p)
+{
+	vr->num = num;
+	vr->desc = p;
+	vr->driver = p + num * sizeof(struct vring_packed_desc);
+	vr->device = vr->driver + 1;
+}
+
+static inline unsigned vring_packed_size(unsigned int num)
+{
+	return sizeof(struct vring_packed_desc) * num +
+		sizeof(struct vring_packed_desc_event) * 2;
+}
+
 /* The following is used with USED_EVENT_IDX and AVAIL_EVENT_IDX */
 /* Assuming a given event_idx value from the other size, if
  * we have just incremented index from old to new_idx,
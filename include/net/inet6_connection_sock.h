@@ -29,7 +29,6 @@ extern struct dst_entry* inet6_csk_route_req(struct sock *sk,
 					     const struct request_sock *req);
 
 extern struct request_sock *inet6_csk_search_req(const struct sock *sk,
-						 struct request_sock ***prevp,
 						 const __be16 rport,
 						 const struct in6_addr *raddr,
 						 const struct in6_addr *laddr,
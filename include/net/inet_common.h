@@ -14,6 +14,8 @@ struct sockaddr;
 struct socket;
 
 extern int inet_release(struct socket *sock);
+extern int __inet_stream_connect(struct socket *sock, struct sockaddr *uaddr,
+				 int addr_len, int flags);
 extern int inet_stream_connect(struct socket *sock, struct sockaddr * uaddr,
 			       int addr_len, int flags);
 extern int inet_dgram_connect(struct socket *sock, struct sockaddr * uaddr,
@@ -25,6 +27,10 @@ extern ssize_t inet_sendpage(struct socket *sock, struct page *page, int offset,
 			     size_t size, int flags);
 extern int inet_recvmsg(struct kiocb *iocb, struct socket *sock,
 			struct msghdr *msg, size_t size, int flags);
+extern int inet_recv_error(struct sock *sk, struct msghdr *msg, int len);
+#if IS_ENABLED(CONFIG_IPV6)
+extern int (*inet6_recv_error)(struct sock *sk, struct msghdr *msg, int len);
+#endif
 extern int inet_shutdown(struct socket *sock, int how);
 extern int inet_listen(struct socket *sock, int backlog);
 extern void inet_sock_destruct(struct sock *sk);
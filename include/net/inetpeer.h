@@ -57,6 +57,11 @@ struct inet_peer {
 		struct inet_peer	*gc_next;
 	};
 
+	/* TCP Fast Open: server MSS and cookie, see tcp_fastopen.c */
+	u16			tcp_fastopen_mss;
+	s8			tcp_fastopen_cookie_len;
+	u8			tcp_fastopen_cookie[16];
+
 	/* following fields might be frequently dirtied */
 	__u32			dtime;	/* the time of last use of not referenced entries */
 	atomic_t		refcnt;
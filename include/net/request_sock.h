@@ -65,14 +65,18 @@ struct request_sock {
 	struct sock			*sk;
 	u32				secid;
 	u32				peer_secid;
+	atomic_t			rsk_refcnt;
+	u32				rsk_hash; /* bucket in listen_sock->syn_table */
 };
 
 static inline struct request_sock *reqsk_alloc(const struct request_sock_ops *ops)
 {
 	struct request_sock *req = kmem_cache_alloc(ops->slab, GFP_ATOMIC);
 
-	if (req != NULL)
+	if (req != NULL) {
 		req->rsk_ops = ops;
+		atomic_set(&req->rsk_refcnt, 1);
+	}
 
 	return req;
 }
@@ -88,47 +92,83 @@ static inline void reqsk_free(struct request_sock *req)
 	__reqsk_free(req);
 }
 
+/*
+ * Lockless listeners look requests up without holding the listener lock,
+ * so a request may still be in use after it was unlinked from the SYN table.
+ * The SYN table (and later the accept queue) owns one reference, each
+ * lookup takes another one.
+ */
+static inline void reqsk_get(struct request_sock *req)
+{
+	atomic_inc(&req->rsk_refcnt);
+}
+
+static inline void reqsk_put(struct request_sock *req)
+{
+	if (atomic_dec_and_test(&req->rsk_refcnt))
+		reqsk_free(req);
+}
+
 extern int sysctl_max_syn_backlog;
 
-/** struct listen_sock - listen state
+/** struct listen_sock - SYN table of a listener
  *
- * @max_qlen_log - log_2 of maximal queued SYNs/REQUESTs
+ * Allocated by listen() and torn down when the listener closes, both
+ * under queue->syn_wait_lock.
  */
 struct listen_sock {
-	u8			max_qlen_log;
-	u8			synflood_warned;
-	/* 2 bytes hole, try to use */
-	int			qlen;
-	int			qlen_young;
 	int			clock_hand;
 	u32			hash_rnd;
 	u32			nr_table_entries;
 	struct request_sock	*syn_table[0];
 };
 
+/** struct fastopen_queue - TCP Fast Open state of a listener
+ *
+ * @qlen - children created from a SYN that still wait for the final ACK
+ * @max_qlen - limit on @qlen set by TCP_FASTOPEN, 0 disables Fast Open
+ *
+ * The children hold a reference on the listener until their handshake
+ * completes, so this stays valid for them even after the listener is closed.
+ */
+struct fastopen_queue {
+	atomic_t		qlen;
+	int			max_qlen;
+};
+
 /** struct request_sock_queue - queue of request_socks
  *
  * @rskq_accept_head - FIFO head of established children
  * @rskq_accept_tail - FIFO tail of established children
+ * @rskq_lock - protects the accept FIFO
+ * @syn_wait_lock - protects listen_opt and its SYN table
  * @rskq_defer_accept - User waits for some data after accept()
- * @syn_wait_lock - serializer
- *
- * %syn_wait_lock is necessary only to avoid proc interface having to grab the main
- * lock sock while browsing the listening hash (otherwise it's deadlock prone).
+ * @max_qlen_log - log_2 of maximal queued SYNs/REQUESTs
+ * @synflood_warned - the SYN flood warning was printed
+ * @qlen - requests in the SYN table
+ * @qlen_young - requests in the SYN table whose SYN-ACK was not resent yet
+ * @fastopenq - TCP Fast Open limits and accounting
  *
- * This lock is acquired in read mode only from listening_get_next() seq_file
- * op and it's acquired in write mode _only_ from code that is actively
- * changing rskq_accept_head. All readers that are holding the master sock lock
- * don't need to grab this lock in read mode too as rskq_accept_head. writes
- * are always protected from the main sock lock.
+ * SYNs and the ACKs completing handshakes are processed without the
+ * listener lock, on as many CPUs as the flows are spread to.  The SYN
+ * table is looked up under %syn_wait_lock in read mode, and changed in
+ * write mode; whoever unlinks a request from it owns the request.
+ * %rskq_lock serializes the softirqs queueing children with accept().
+ * The counters are read without locks to decide early drops.
  */
 struct request_sock_queue {
 	struct request_sock	*rskq_accept_head;
 	struct request_sock	*rskq_accept_tail;
+	spinlock_t		rskq_lock;
 	rwlock_t		syn_wait_lock;
 	u8			rskq_defer_accept;
-	/* 3 bytes hole, try to pack */
+	u8			max_qlen_log;
+	u8			synflood_warned;
+	/* 1 byte hole, try to pack */
+	atomic_t		qlen;
+	atomic_t		qlen_young;
 	struct listen_sock	*listen_opt;
+	struct fastopen_queue	fastopenq;
 };
 
 extern int reqsk_queue_alloc(struct request_sock_queue *queue,
@@ -140,9 +180,12 @@ extern void reqsk_queue_destroy(struct request_sock_queue *queue);
 static inline struct request_sock *
 	reqsk_queue_yank_acceptq(struct request_sock_queue *queue)
 {
-	struct request_sock *req = queue->rskq_accept_head;
+	struct request_sock *req;
 
+	spin_lock_bh(&queue->rskq_lock);
+	req = queue->rskq_accept_head;
 	queue->rskq_accept_head = NULL;
+	spin_unlock_bh(&queue->rskq_lock);
 	return req;
 }
 
@@ -151,13 +194,49 @@ static inline int reqsk_queue_empty(struct request_sock_queue *queue)
 	return queue->rskq_accept_head == NULL;
 }
 
-static inline void reqsk_queue_unlink(struct request_sock_queue *queue,
-				      struct request_sock *req,
-				      struct request_sock **prev_req)
+static inline int reqsk_queue_removed(struct request_sock_queue *queue,
+				      struct request_sock *req)
+{
+	if (req->retrans == 0)
+		atomic_dec(&queue->qlen_young);
+
+	return atomic_dec_return(&queue->qlen);
+}
+
+static inline int reqsk_queue_added(struct request_sock_queue *queue)
+{
+	atomic_inc(&queue->qlen_young);
+	return atomic_inc_return(&queue->qlen) - 1;
+}
+
+/*
+ * Take @req off the SYN table.  Returns false if somebody else did it
+ * first (or the listener is closing), in which case the caller must not
+ * turn it into a child.
+ */
+static inline bool reqsk_queue_unlink(struct request_sock_queue *queue,
+				      struct request_sock *req)
 {
+	struct listen_sock *lopt;
+	struct request_sock **prev;
+	bool found = false;
+
 	write_lock(&queue->syn_wait_lock);
-	*prev_req = req->dl_next;
+	lopt = queue->listen_opt;
+	if (lopt != NULL) {
+		for (prev = &lopt->syn_table[req->rsk_hash]; *prev != NULL;
+		     prev = &(*prev)->dl_next) {
+			if (*prev == req) {
+				*prev = req->dl_next;
+				reqsk_queue_removed(queue, req);
+				found = true;
+				break;
+			}
+		}
+	}
 	write_unlock(&queue->syn_wait_lock);
+
+	return found;
 }
 
 static inline void reqsk_queue_add(struct request_sock_queue *queue,
@@ -190,69 +269,63 @@ static inline struct request_sock *reqsk_queue_remove(struct request_sock_queue
 	return req;
 }
 
-static inline struct sock *reqsk_queue_get_child(struct request_sock_queue *queue,
-						 struct sock *parent)
+/* The options of a queued request now belong to its child */
+static inline void __reqsk_put(struct request_sock *req)
 {
-	struct request_sock *req = reqsk_queue_remove(queue);
-	struct sock *child = req->sk;
-
-	WARN_ON(child == NULL);
-
-	sk_acceptq_removed(parent);
-	__reqsk_free(req);
-	return child;
+	if (atomic_dec_and_test(&req->rsk_refcnt))
+		__reqsk_free(req);
 }
 
-static inline int reqsk_queue_removed(struct request_sock_queue *queue,
-				      struct request_sock *req)
+static inline struct sock *reqsk_queue_get_child(struct request_sock_queue *queue,
+						 struct sock *parent)
 {
-	struct listen_sock *lopt = queue->listen_opt;
-
-	if (req->retrans == 0)
-		--lopt->qlen_young;
+	struct request_sock *req;
+	struct sock *child;
 
-	return --lopt->qlen;
-}
+	spin_lock_bh(&queue->rskq_lock);
+	req = reqsk_queue_remove(queue);
+	child = req->sk;
+	sk_acceptq_removed(parent);
+	spin_unlock_bh(&queue->rskq_lock);
 
-static inline int reqsk_queue_added(struct request_sock_queue *queue)
-{
-	struct listen_sock *lopt = queue->listen_opt;
-	const int prev_qlen = lopt->qlen;
+	WARN_ON(child == NULL);
 
-	lopt->qlen_young++;
-	lopt->qlen++;
-	return prev_qlen;
+	__reqsk_put(req);
+	return child;
 }
 
 static inline int reqsk_queue_len(const struct request_sock_queue *queue)
 {
-	return queue->listen_opt != NULL ? queue->listen_opt->qlen : 0;
+	return atomic_read(&queue->qlen);
 }
 
 static inline int reqsk_queue_len_young(const struct request_sock_queue *queue)
 {
-	return queue->listen_opt->qlen_young;
+	return atomic_read(&queue->qlen_young);
 }
 
 static inline int reqsk_queue_is_full(const struct request_sock_queue *queue)
 {
-	return queue->listen_opt->qlen >> queue->listen_opt->max_qlen_log;
+	return reqsk_queue_len(queue) >> queue->max_qlen_log;
 }
 
-static inline void reqsk_queue_hash_req(struct request_sock_queue *queue,
-					u32 hash, struct request_sock *req,
-					unsigned long timeout)
+/* Called with queue->syn_wait_lock held for writing, and the listen_opt
+ * present.  Returns the number of requests queued before this one.
+ */
+static inline int reqsk_queue_hash_req(struct request_sock_queue *queue,
+				       u32 hash, struct request_sock *req,
+				       unsigned long timeout)
 {
 	struct listen_sock *lopt = queue->listen_opt;
 
 	req->expires = jiffies + timeout;
 	req->retrans = 0;
 	req->sk = NULL;
+	req->rsk_hash = hash;
 	req->dl_next = lopt->syn_table[hash];
-
-	write_lock(&queue->syn_wait_lock);
 	lopt->syn_table[hash] = req;
-	write_unlock(&queue->syn_wait_lock);
+
+	return reqsk_queue_added(queue);
 }
 
 #endif /* _REQUEST_SOCK_H */
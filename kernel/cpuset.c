@@ -2161,6 +2161,7 @@ void cpuset_cpus_allowed(struct task_struct *tsk, struct cpumask *pmask)
 	task_unlock(tsk);
 	mutex_unlock(&callback_mutex);
 }
+EXPORT_SYMBOL_GPL(cpuset_cpus_allowed);
 
 void cpuset_cpus_allowed_fallback(struct task_struct *tsk)
 {
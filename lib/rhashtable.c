@@ -0,0 +1,424 @@
+/*
+ * Resizable, RCU-protected hash table
+ *
+ * A resize allocates the new table, hangs it off the old one as
+ * future_tbl and then moves the entries over one at a time, always the
+ * last of a chain: a reader walking that chain either reaches the moved
+ * entry, whose next pointer now leads into the new table, or finds the
+ * chain ended before it and looks the entry up in future_tbl.  Insertions
+ * go to future_tbl while it exists, so every entry is in exactly one
+ * table at any time.  Once the old table is empty it is replaced and
+ * freed after a grace period.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/log2.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/random.h>
+#include <linux/module.h>
+#include <linux/rhashtable.h>
+
+#define RHT_MIN_SHIFT		2
+#define RHT_MAX_SHIFT		24
+
+static u32 obj_raw_hashfn(const struct rhashtable *ht, const void *obj)
+{
+	if (ht->p.key_len)
+		return ht->p.hashfn(obj + ht->p.key_offset, ht->p.key_len,
+				    ht->p.hash_rnd);
+	return ht->p.obj_hashfn(obj, ht->p.hash_rnd);
+}
+
+static u32 head_hashfn(const struct rhashtable *ht,
+		       const struct bucket_table *tbl,
+		       const struct rhash_head *he)
+{
+	return obj_raw_hashfn(ht, rht_obj(ht, he)) & (tbl->size - 1);
+}
+
+/**
+ * rhashtable_hashfn - hash a key the way the table does
+ * @ht: hash table
+ * @key: key to hash
+ * @len: length of the key
+ *
+ * For rhashtable_lookup_compare() on tables hashing a key of @len bytes.
+ */
+u32 rhashtable_hashfn(const struct rhashtable *ht, const void *key, u32 len)
+{
+	return ht->p.hashfn(key, len, ht->p.hash_rnd);
+}
+EXPORT_SYMBOL_GPL(rhashtable_hashfn);
+
+static struct bucket_table *bucket_table_alloc(size_t nbuckets)
+{
+	struct bucket_table *tbl;
+	size_t size;
+
+	size = sizeof(*tbl) + nbuckets * sizeof(tbl->buckets[0]);
+	tbl = kzalloc(size, GFP_KERNEL | __GFP_NOWARN);
+	if (tbl == NULL)
+		tbl = vzalloc(size);
+	if (tbl == NULL)
+		return NULL;
+
+	tbl->size = nbuckets;
+	return tbl;
+}
+
+static void bucket_table_free(const struct bucket_table *tbl)
+{
+	if (is_vmalloc_addr(tbl))
+		vfree(tbl);
+	else
+		kfree(tbl);
+}
+
+static bool rht_grow_above_75(const struct rhashtable *ht)
+{
+	size_t size = 1UL << ht->shift;
+
+	return ACCESS_ONCE(ht->nelems) > size / 4 * 3 &&
+	       ht->shift < ht->p.max_shift;
+}
+
+static bool rht_shrink_below_30(const struct rhashtable *ht)
+{
+	size_t size = 1UL << ht->shift;
+
+	return ACCESS_ONCE(ht->nelems) < size * 3 / 10 &&
+	       ht->shift > ht->p.min_shift;
+}
+
+/* Move all entries to a new table of 2^@shift buckets; ht->mutex held. */
+static int rhashtable_rehash(struct rhashtable *ht, unsigned int shift)
+{
+	struct bucket_table *old_tbl, *new_tbl;
+	struct rhash_head __rcu **pprev;
+	struct rhash_head *he;
+	unsigned int i;
+	u32 hash;
+
+	old_tbl = rht_dereference(ht->tbl, ht);
+	new_tbl = bucket_table_alloc(1UL << shift);
+	if (new_tbl == NULL)
+		return -ENOMEM;
+
+	spin_lock_bh(&ht->lock);
+	rcu_assign_pointer(old_tbl->future_tbl, new_tbl);
+	spin_unlock_bh(&ht->lock);
+
+	for (i = 0; i < old_tbl->size; i++) {
+		spin_lock_bh(&ht->lock);
+		for (;;) {
+			pprev = &old_tbl->buckets[i];
+			he = rht_dereference(*pprev, ht);
+			if (he == NULL)
+				break;
+			while (rht_dereference(he->next, ht)) {
+				pprev = &he->next;
+				he = rht_dereference(*pprev, ht);
+			}
+
+			hash = head_hashfn(ht, new_tbl, he);
+			rcu_assign_pointer(he->next,
+				rht_dereference(new_tbl->buckets[hash], ht));
+			rcu_assign_pointer(new_tbl->buckets[hash], he);
+
+			/* Unlink only once it is reachable in new_tbl. */
+			smp_wmb();
+			RCU_INIT_POINTER(*pprev, NULL);
+		}
+		spin_unlock_bh(&ht->lock);
+		cond_resched();
+	}
+
+	spin_lock_bh(&ht->lock);
+	rcu_assign_pointer(ht->tbl, new_tbl);
+	ht->shift = shift;
+	spin_unlock_bh(&ht->lock);
+
+	/* Readers may still be walking the old table. */
+	synchronize_rcu();
+	bucket_table_free(old_tbl);
+	return 0;
+}
+
+/**
+ * rhashtable_expand - double the number of buckets
+ * @ht: hash table
+ *
+ * Insertions do this on their own when the table gets 75% full; this is
+ * for callers which know better.  Must be called from process context.
+ */
+int rhashtable_expand(struct rhashtable *ht)
+{
+	int err = -E2BIG;
+
+	mutex_lock(&ht->mutex);
+	if (ht->shift < ht->p.max_shift)
+		err = rhashtable_rehash(ht, ht->shift + 1);
+	mutex_unlock(&ht->mutex);
+	return err;
+}
+EXPORT_SYMBOL_GPL(rhashtable_expand);
+
+/**
+ * rhashtable_shrink - halve the number of buckets
+ * @ht: hash table
+ *
+ * Removals do this on their own when the table gets below 30% full.
+ * Must be called from process context.
+ */
+int rhashtable_shrink(struct rhashtable *ht)
+{
+	int err = -EINVAL;
+
+	mutex_lock(&ht->mutex);
+	if (ht->shift > ht->p.min_shift)
+		err = rhashtable_rehash(ht, ht->shift - 1);
+	mutex_unlock(&ht->mutex);
+	return err;
+}
+EXPORT_SYMBOL_GPL(rhashtable_shrink);
+
+static void rht_deferred_worker(struct work_struct *work)
+{
+	struct rhashtable *ht = container_of(work, struct rhashtable,
+					     run_work);
+	int err = 0;
+
+	mutex_lock(&ht->mutex);
+	while (!ht->being_destroyed && !err) {
+		if (rht_grow_above_75(ht))
+			err = rhashtable_rehash(ht, ht->shift + 1);
+		else if (rht_shrink_below_30(ht))
+			err = rhashtable_rehash(ht, ht->shift - 1);
+		else
+			break;
+	}
+	mutex_unlock(&ht->mutex);
+}
+
+/**
+ * rhashtable_insert - insert an object into the hash table
+ * @ht: hash table
+ * @obj: struct rhash_head of the object
+ *
+ * Does not check for an object with the same key.  May be called from
+ * softirq context, but not with hardware interrupts disabled.
+ */
+void rhashtable_insert(struct rhashtable *ht, struct rhash_head *obj)
+{
+	struct bucket_table *tbl, *future_tbl;
+	u32 hash;
+
+	spin_lock_bh(&ht->lock);
+	tbl = rht_dereference(ht->tbl, ht);
+	future_tbl = rht_dereference(tbl->future_tbl, ht);
+	if (future_tbl)
+		tbl = future_tbl;
+
+	hash = head_hashfn(ht, tbl, obj);
+	RCU_INIT_POINTER(obj->next, rht_dereference(tbl->buckets[hash], ht));
+	rcu_assign_pointer(tbl->buckets[hash], obj);
+	ht->nelems++;
+
+	if (rht_grow_above_75(ht))
+		schedule_work(&ht->run_work);
+	spin_unlock_bh(&ht->lock);
+}
+EXPORT_SYMBOL_GPL(rhashtable_insert);
+
+static bool __rhashtable_remove(struct rhashtable *ht,
+				struct bucket_table *tbl,
+				struct rhash_head *obj)
+{
+	struct rhash_head __rcu **pprev;
+	struct rhash_head *he;
+
+	pprev = &tbl->buckets[head_hashfn(ht, tbl, obj)];
+	for (he = rht_dereference(*pprev, ht); he;
+	     pprev = &he->next, he = rht_dereference(*pprev, ht)) {
+		if (he != obj)
+			continue;
+
+		rcu_assign_pointer(*pprev, rht_dereference(obj->next, ht));
+		return true;
+	}
+	return false;
+}
+
+/**
+ * rhashtable_remove - remove an object from the hash table
+ * @ht: hash table
+ * @obj: struct rhash_head of the object
+ *
+ * Returns whether the object was found.  It must not be freed before
+ * the readers that might still see it are done, e.g. with kfree_rcu().
+ * Same calling context as rhashtable_insert().
+ */
+bool rhashtable_remove(struct rhashtable *ht, struct rhash_head *obj)
+{
+	struct bucket_table *tbl;
+	bool found;
+
+	spin_lock_bh(&ht->lock);
+	tbl = rht_dereference(ht->tbl, ht);
+	found = __rhashtable_remove(ht, tbl, obj);
+	if (!found) {
+		tbl = rht_dereference(tbl->future_tbl, ht);
+		found = tbl && __rhashtable_remove(ht, tbl, obj);
+	}
+	if (found) {
+		ht->nelems--;
+		if (rht_shrink_below_30(ht))
+			schedule_work(&ht->run_work);
+	}
+	spin_unlock_bh(&ht->lock);
+	return found;
+}
+EXPORT_SYMBOL_GPL(rhashtable_remove);
+
+/**
+ * rhashtable_lookup - look up an object by key
+ * @ht: hash table
+ * @key: pointer to the key
+ *
+ * For tables with a fixed key_len.  Call under rcu_read_lock().
+ * Returns the first object with the key or NULL.
+ */
+void *rhashtable_lookup(const struct rhashtable *ht, const void *key)
+{
+	const struct bucket_table *tbl = rht_dereference_rcu(ht->tbl, ht);
+	struct rhash_head *he;
+	u32 hash;
+
+	BUG_ON(!ht->p.key_len);
+
+	hash = rhashtable_hashfn(ht, key, ht->p.key_len);
+	do {
+		he = rht_dereference_rcu(tbl->buckets[hash & (tbl->size - 1)],
+					 ht);
+		for (; he; he = rht_dereference_rcu(he->next, ht)) {
+			if (!memcmp(rht_obj(ht, he) + ht->p.key_offset, key,
+				    ht->p.key_len))
+				return rht_obj(ht, he);
+		}
+
+		/* A resize may have moved it on: see future_tbl only
+		 * after the chain it left. */
+		smp_rmb();
+		tbl = rht_dereference_rcu(tbl->future_tbl, ht);
+	} while (tbl);
+
+	return NULL;
+}
+EXPORT_SYMBOL_GPL(rhashtable_lookup);
+
+/**
+ * rhashtable_lookup_compare - look up an object with a compare function
+ * @ht: hash table
+ * @hash: full hash of the key, see rhashtable_hashfn()
+ * @compare: returns true when an object (first argument) matches
+ * @arg: second argument to @compare
+ *
+ * Call under rcu_read_lock().  Returns the first matching object or NULL.
+ */
+void *rhashtable_lookup_compare(const struct rhashtable *ht, u32 hash,
+				bool (*compare)(void *, void *), void *arg)
+{
+	const struct bucket_table *tbl = rht_dereference_rcu(ht->tbl, ht);
+	struct rhash_head *he;
+
+	do {
+		he = rht_dereference_rcu(tbl->buckets[hash & (tbl->size - 1)],
+					 ht);
+		for (; he; he = rht_dereference_rcu(he->next, ht)) {
+			if (compare(rht_obj(ht, he), arg))
+				return rht_obj(ht, he);
+		}
+
+		smp_rmb();
+		tbl = rht_dereference_rcu(tbl->future_tbl, ht);
+	} while (tbl);
+
+	return NULL;
+}
+EXPORT_SYMBOL_GPL(rhashtable_lookup_compare);
+
+/**
+ * rhashtable_init - initialize a new hash table
+ * @ht: hash table to be initialized
+ * @params: configuration parameters
+ *
+ * Either @params->key_len and ->hashfn or ->obj_hashfn must be set.
+ * Must be called from process context.
+ */
+int rhashtable_init(struct rhashtable *ht,
+		    const struct rhashtable_params *params)
+{
+	struct bucket_table *tbl;
+	unsigned int shift;
+
+	if ((params->key_len && !params->hashfn) ||
+	    (!params->key_len && !params->obj_hashfn))
+		return -EINVAL;
+
+	memset(ht, 0, sizeof(*ht));
+	spin_lock_init(&ht->lock);
+	mutex_init(&ht->mutex);
+	INIT_WORK(&ht->run_work, rht_deferred_worker);
+	memcpy(&ht->p, params, sizeof(*params));
+
+	if (!ht->p.min_shift)
+		ht->p.min_shift = RHT_MIN_SHIFT;
+	if (!ht->p.max_shift || ht->p.max_shift > RHT_MAX_SHIFT)
+		ht->p.max_shift = RHT_MAX_SHIFT;
+	if (ht->p.min_shift > ht->p.max_shift)
+		return -EINVAL;
+
+	if (!ht->p.hash_rnd)
+		get_random_bytes(&ht->p.hash_rnd, sizeof(ht->p.hash_rnd));
+
+	/* Start out at most 75% full. */
+	shift = ht->p.min_shift;
+	while (shift < ht->p.max_shift &&
+	       (1UL << shift) / 4 * 3 < ht->p.nelem_hint)
+		shift++;
+
+	tbl = bucket_table_alloc(1UL << shift);
+	if (tbl == NULL)
+		return -ENOMEM;
+
+	ht->shift = shift;
+	RCU_INIT_POINTER(ht->tbl, tbl);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(rhashtable_init);
+
+/**
+ * rhashtable_destroy - free the bucket table of a hash table
+ * @ht: hash table
+ *
+ * The caller removes and frees the objects, and must not insert or
+ * remove any concurrently.  Must be called from process context.
+ */
+void rhashtable_destroy(struct rhashtable *ht)
+{
+	mutex_lock(&ht->mutex);
+	ht->being_destroyed = true;
+	mutex_unlock(&ht->mutex);
+
+	cancel_work_sync(&ht->run_work);
+	bucket_table_free(rcu_dereference_protected(ht->tbl, 1));
+}
+EXPORT_SYMBOL_GPL(rhashtable_destroy);
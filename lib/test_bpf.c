@@ -0,0 +1,288 @@
+/*
+ * Testsuite and benchmark for the BPF interpreter and JIT compiler
+ *
+ * Each test vector is run on a canned TCP/IPv4 frame, once through
+ * sk_run_filter() and once through the filter's bpf_func, which is the
+ * JIT image when /proc/sys/net/core/bpf_jit_enable was set at load time.
+ * Both must return the expected value; the module then times @runs
+ * invocations of each and reports nanoseconds and packets per second.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/filter.h>
+#include <linux/skbuff.h>
+#include <linux/netdevice.h>
+#include <linux/if_ether.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+
+static unsigned int runs = 1000000;
+module_param(runs, uint, 0444);
+MODULE_PARM_DESC(runs, "Number of timed runs of each filter");
+
+/* Ethernet, IPv4 (ihl 5, proto TCP) and TCP header, dst port 22 */
+static const u8 test_frame[] = {
+	0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+	0x88, 0x99, 0xaa, 0xbb, 0x08, 0x00,
+	0x45, 0x00, 0x00, 0x28, 0x12, 0x34, 0x40, 0x00,
+	0x40, 0x06, 0x00, 0x00, 0x0a, 0x00, 0x00, 0x01,
+	0x0a, 0x00, 0x00, 0x02,
+	0x9c, 0x40, 0x00, 0x16, 0x00, 0x00, 0x00, 0x01,
+	0x00, 0x00, 0x00, 0x00, 0x50, 0x02, 0x72, 0x10,
+	0x00, 0x00, 0x00, 0x00,
+};
+
+#define MAX_INSNS	16
+
+struct bpf_test {
+	const char *descr;
+	struct sock_filter insns[MAX_INSNS];
+	unsigned int result;
+};
+
+static struct bpf_test tests[] = {
+	{
+		"RET_K",
+		{
+			BPF_STMT(BPF_RET | BPF_K, 0xffff),
+		},
+		0xffff,
+	},
+	{
+		"LD_LEN",
+		{
+			BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+			BPF_STMT(BPF_RET | BPF_A, 0),
+		},
+		sizeof(test_frame),
+	},
+	{
+		"LD_ABS ethertype",
+		{
+			BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),
+			BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 0, 1),
+			BPF_STMT(BPF_RET | BPF_K, 1),
+			BPF_STMT(BPF_RET | BPF_K, 0),
+		},
+		1,
+	},
+	{
+		"LD_ABS out of bounds",
+		{
+			BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 1000),
+			BPF_STMT(BPF_RET | BPF_K, 1),
+		},
+		0,
+	},
+	{
+		"LD_IND protocol",
+		{
+			BPF_STMT(BPF_LDX | BPF_W | BPF_IMM, ETH_HLEN),
+			BPF_STMT(BPF_LD | BPF_B | BPF_IND, 9),
+			BPF_STMT(BPF_RET | BPF_A, 0),
+		},
+		IPPROTO_TCP,
+	},
+	{
+		"LDX_MSH",
+		{
+			BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, ETH_HLEN),
+			BPF_STMT(BPF_MISC | BPF_TXA, 0),
+			BPF_STMT(BPF_RET | BPF_A, 0),
+		},
+		20,
+	},
+	{
+		"ALU chain",
+		{
+			BPF_STMT(BPF_LD | BPF_IMM, 10),
+			BPF_STMT(BPF_ALU | BPF_ADD | BPF_K, 5),
+			BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 3),
+			BPF_STMT(BPF_ALU | BPF_SUB | BPF_K, 1),
+			BPF_STMT(BPF_ALU | BPF_DIV | BPF_K, 2),
+			BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0xff),
+			BPF_STMT(BPF_ALU | BPF_OR | BPF_K, 0x100),
+			BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 1),
+			BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 1),
+			BPF_STMT(BPF_RET | BPF_A, 0),
+		},
+		278,
+	},
+	{
+		"scratch memory and X",
+		{
+			BPF_STMT(BPF_LD | BPF_IMM, 7),
+			BPF_STMT(BPF_ST, 0),
+			BPF_STMT(BPF_LDX | BPF_IMM, 3),
+			BPF_STMT(BPF_LD | BPF_MEM, 0),
+			BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0),
+			BPF_STMT(BPF_MISC | BPF_TAX, 0),
+			BPF_STMT(BPF_MISC | BPF_TXA, 0),
+			BPF_STMT(BPF_RET | BPF_A, 0),
+		},
+		10,
+	},
+	{
+		"SKF_AD_PROTOCOL",
+		{
+			BPF_STMT(BPF_LD | BPF_H | BPF_ABS, SKF_AD_OFF + SKF_AD_PROTOCOL),
+			BPF_STMT(BPF_RET | BPF_A, 0),
+		},
+		ETH_P_IP,
+	},
+	{
+		"tcpdump ip and tcp dst port 22",
+		{
+			BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),
+			BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 0, 8),
+			BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 23),
+			BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, 0, 6),
+			BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 20),
+			BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, 4, 0),
+			BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, ETH_HLEN),
+			BPF_STMT(BPF_LD | BPF_H | BPF_IND, ETH_HLEN + 2),
+			BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 22, 0, 1),
+			BPF_STMT(BPF_RET | BPF_K, 0xffff),
+			BPF_STMT(BPF_RET | BPF_K, 0),
+		},
+		0xffff,
+	},
+};
+
+static struct sk_buff *populate_skb(void)
+{
+	struct sk_buff *skb;
+
+	skb = alloc_skb(sizeof(test_frame), GFP_KERNEL);
+	if (!skb)
+		return NULL;
+
+	memcpy(__skb_put(skb, sizeof(test_frame)), test_frame,
+	       sizeof(test_frame));
+	skb_reset_mac_header(skb);
+	skb_set_network_header(skb, ETH_HLEN);
+	skb->protocol = htons(ETH_P_IP);
+	skb->pkt_type = PACKET_HOST;
+
+	return skb;
+}
+
+static unsigned int filter_len(const struct bpf_test *test)
+{
+	unsigned int len;
+
+	for (len = MAX_INSNS; len > 0; len--)
+		if (test->insns[len - 1].code)
+			break;
+	return len;
+}
+
+/* Returns the average cost of one run, in nanoseconds */
+static u64 time_filter(const struct sk_filter *fp, const struct sk_buff *skb,
+		       bool jit)
+{
+	u64 start, elapsed;
+	unsigned int i;
+
+	preempt_disable();
+	start = ktime_to_ns(ktime_get());
+	if (jit) {
+		for (i = 0; i < runs; i++)
+			SK_RUN_FILTER(fp, skb);
+	} else {
+		for (i = 0; i < runs; i++)
+			sk_run_filter(skb, fp->insns);
+	}
+	elapsed = ktime_to_ns(ktime_get()) - start;
+	preempt_enable();
+
+	return div_u64(elapsed, runs);
+}
+
+static u64 pps(u64 ns)
+{
+	return ns ? div64_u64(NSEC_PER_SEC, ns) : 0;
+}
+
+static int run_one(int i, struct sk_buff *skb)
+{
+	const struct bpf_test *test = &tests[i];
+	struct sock_fprog fprog;
+	struct sk_filter *fp;
+	unsigned int ret_interp, ret_jit;
+	bool jited;
+	u64 ns_interp, ns_jit;
+	int err;
+
+	fprog.len = filter_len(test);
+	fprog.filter = (struct sock_filter __user *) test->insns;
+
+	err = sk_unattached_filter_create(&fp, &fprog);
+	if (err) {
+		pr_err("#%d %s: filter rejected (%d)\n", i, test->descr, err);
+		return err;
+	}
+	jited = fp->bpf_func != sk_run_filter;
+
+	ret_interp = sk_run_filter(skb, fp->insns);
+	ret_jit = SK_RUN_FILTER(fp, skb);
+	if (ret_interp != test->result || ret_jit != test->result) {
+		pr_err("#%d %s: FAIL interpreter %u jit %u expected %u\n",
+		       i, test->descr, ret_interp, ret_jit, test->result);
+		err = -EINVAL;
+		goto out;
+	}
+
+	if (runs) {
+		ns_interp = time_filter(fp, skb, false);
+		ns_jit = jited ? time_filter(fp, skb, true) : ns_interp;
+		pr_info("#%d %s: interpreter %llu ns %llu pps, %s %llu ns %llu pps\n",
+			i, test->descr, ns_interp, pps(ns_interp),
+			jited ? "jit" : "no jit", ns_jit, pps(ns_jit));
+	} else {
+		pr_info("#%d %s: PASS%s\n", i, test->descr,
+			jited ? " (jited)" : "");
+	}
+out:
+	sk_unattached_filter_destroy(fp);
+	return err;
+}
+
+static __init int test_bpf_init(void)
+{
+	struct sk_buff *skb;
+	int i, err, failed = 0;
+
+	skb = populate_skb();
+	if (!skb)
+		return -ENOMEM;
+
+	for (i = 0; i < ARRAY_SIZE(tests); i++) {
+		err = run_one(i, skb);
+		if (err)
+			failed++;
+	}
+	kfree_skb(skb);
+
+	if (failed) {
+		pr_err("%d of %zu tests failed\n", failed, ARRAY_SIZE(tests));
+		return -EINVAL;
+	}
+	pr_info("all %zu tests passed\n", ARRAY_SIZE(tests));
+	return 0;
+}
+
+static void __exit test_bpf_exit(void)
+{
+}
+
+module_init(test_bpf_init);
+module_exit(test_bpf_exit);
+MODULE_LICENSE("GPL");
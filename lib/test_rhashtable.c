@@ -0,0 +1,295 @@
+/*
+ * Torture test and benchmark for the resizable hash table
+ *
+ * The benchmark times @entries insertions, lookups and removals.  The
+ * torture test then keeps @entries objects in the table while a reader
+ * thread per online CPU looks them up at random, and the loading thread
+ * inserts and removes as many again @runs times, growing and shrinking
+ * the table under the readers.  A lookup of a stable object that fails
+ * is a bug.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/kthread.h>
+#include <linux/jhash.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/random.h>
+#include <linux/rhashtable.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+static unsigned int entries = 50000;
+module_param(entries, uint, 0444);
+MODULE_PARM_DESC(entries, "Number of objects in the table");
+
+static unsigned int runs = 4;
+module_param(runs, uint, 0444);
+MODULE_PARM_DESC(runs, "Number of grow and shrink rounds under the readers");
+
+struct test_obj {
+	int			value;
+	struct rhash_head	node;
+};
+
+struct test_reader {
+	struct task_struct	*task;
+	struct rhashtable	*ht;
+	unsigned long		lookups;
+	unsigned long		misses;
+};
+
+static struct test_obj *objs;
+
+/* Not on the stack: the table carries the deferred resize work item */
+static struct rhashtable test_ht;
+
+static const struct rhashtable_params test_params = {
+	.key_len	= sizeof(int),
+	.key_offset	= offsetof(struct test_obj, value),
+	.head_offset	= offsetof(struct test_obj, node),
+	.hashfn		= jhash,
+};
+
+static struct test_obj *test_lookup(struct rhashtable *ht, int value)
+{
+	return rhashtable_lookup(ht, &value);
+}
+
+static u64 ns_per_op(ktime_t start, unsigned int n)
+{
+	return div_u64(ktime_to_ns(ktime_sub(ktime_get(), start)), n ?: 1);
+}
+
+static void test_insert_range(struct rhashtable *ht, unsigned int from,
+			      unsigned int n)
+{
+	unsigned int i;
+
+	for (i = from; i < from + n; i++) {
+		objs[i].value = i;
+		rhashtable_insert(ht, &objs[i].node);
+	}
+}
+
+static int test_remove_range(struct rhashtable *ht, unsigned int from,
+			     unsigned int n)
+{
+	unsigned int i;
+
+	for (i = from; i < from + n; i++) {
+		if (!rhashtable_remove(ht, &objs[i].node)) {
+			pr_err("object %u not found for removal\n", i);
+			return -ENOENT;
+		}
+	}
+	return 0;
+}
+
+static int test_lookup_range(struct rhashtable *ht, unsigned int from,
+			     unsigned int n, bool present)
+{
+	struct test_obj *obj;
+	unsigned int i;
+	int err = 0;
+
+	rcu_read_lock();
+	for (i = from; i < from + n; i++) {
+		obj = test_lookup(ht, i);
+		if (present && (!obj || obj->value != i)) {
+			pr_err("lookup of %u failed\n", i);
+			err = -EINVAL;
+			break;
+		}
+		if (!present && obj) {
+			pr_err("removed object %u still found\n", i);
+			err = -EINVAL;
+			break;
+		}
+	}
+	rcu_read_unlock();
+	return err;
+}
+
+static int test_benchmark(struct rhashtable *ht)
+{
+	u64 ns_insert, ns_lookup, ns_remove;
+	ktime_t start;
+	int err;
+
+	start = ktime_get();
+	test_insert_range(ht, 0, entries);
+	ns_insert = ns_per_op(start, entries);
+
+	start = ktime_get();
+	err = test_lookup_range(ht, 0, entries, true);
+	ns_lookup = ns_per_op(start, entries);
+	if (err)
+		return err;
+
+	/* Let the deferred resizes finish before reporting the size. */
+	flush_work(&ht->run_work);
+	pr_info("%u objects in %zu buckets\n", entries,
+		(size_t)1 << ht->shift);
+
+	start = ktime_get();
+	err = test_remove_range(ht, 0, entries);
+	ns_remove = ns_per_op(start, entries);
+	if (err)
+		return err;
+
+	err = test_lookup_range(ht, 0, entries, false);
+	if (err)
+		return err;
+
+	pr_info("insert %llu ns, lookup %llu ns, remove %llu ns per object\n",
+		ns_insert, ns_lookup, ns_remove);
+	return 0;
+}
+
+static int test_reader_fn(void *data)
+{
+	struct test_reader *reader = data;
+	struct test_obj *obj;
+	unsigned int i;
+	int value;
+
+	while (!kthread_should_stop()) {
+		rcu_read_lock();
+		for (i = 0; i < 64; i++) {
+			value = random32() % entries;
+			obj = test_lookup(reader->ht, value);
+			if (unlikely(!obj || obj->value != value))
+				reader->misses++;
+		}
+		rcu_read_unlock();
+		reader->lookups += i;
+		cond_resched();
+	}
+	return 0;
+}
+
+static int test_torture(struct rhashtable *ht)
+{
+	struct test_reader *readers;
+	unsigned long lookups = 0, misses = 0;
+	unsigned int i, nr = 0;
+	ktime_t start;
+	int cpu, err = 0;
+
+	test_insert_range(ht, 0, entries);
+
+	readers = kcalloc(num_online_cpus(), sizeof(*readers), GFP_KERNEL);
+	if (!readers) {
+		err = -ENOMEM;
+		goto out_remove;
+	}
+
+	for_each_online_cpu(cpu) {
+		struct test_reader *reader = &readers[nr];
+
+		if (nr == num_online_cpus())
+			break;
+		reader->ht = ht;
+		reader->task = kthread_create(test_reader_fn, reader,
+					      "rht_reader/%d", cpu);
+		if (IS_ERR(reader->task)) {
+			err = PTR_ERR(reader->task);
+			goto out_stop;
+		}
+		kthread_bind(reader->task, cpu);
+		wake_up_process(reader->task);
+		nr++;
+	}
+
+	start = ktime_get();
+	for (i = 0; i < runs && !err; i++) {
+		/* Doubling the load grows the table, removing it again
+		 * shrinks it; the explicit resizes overlap the deferred
+		 * ones. */
+		test_insert_range(ht, entries, entries);
+		rhashtable_expand(ht);
+		err = test_lookup_range(ht, entries, entries, true);
+		if (!err)
+			err = test_remove_range(ht, entries, entries);
+		rhashtable_shrink(ht);
+		flush_work(&ht->run_work);
+	}
+
+out_stop:
+	while (nr--) {
+		kthread_stop(readers[nr].task);
+		lookups += readers[nr].lookups;
+		misses += readers[nr].misses;
+	}
+	kfree(readers);
+
+	if (!err && misses) {
+		pr_err("%lu of %lu lookups missed a stable object\n",
+		       misses, lookups);
+		err = -EINVAL;
+	}
+	if (!err)
+		pr_info("%u rounds, %lu lookups in %llu ms, table at %zu buckets\n",
+			runs, lookups,
+			div_u64(ktime_to_ns(ktime_sub(ktime_get(), start)),
+				NSEC_PER_MSEC),
+			(size_t)1 << ht->shift);
+
+out_remove:
+	if (!err)
+		err = test_remove_range(ht, 0, entries);
+	return err;
+}
+
+static __init int test_rhashtable_init(void)
+{
+	int err;
+
+	if (!entries)
+		return -EINVAL;
+
+	/* Room for the stable objects and the ones churned over them */
+	objs = vzalloc(2 * entries * sizeof(*objs));
+	if (!objs)
+		return -ENOMEM;
+
+	err = rhashtable_init(&test_ht, &test_params);
+	if (err)
+		goto out_free;
+
+	err = test_benchmark(&test_ht);
+	if (!err)
+		err = test_torture(&test_ht);
+
+	/* Also cancels a resize still pending from the last round */
+	rhashtable_destroy(&test_ht);
+
+	/* Readers of removed objects are gone, but be sure. */
+	synchronize_rcu();
+out_free:
+	vfree(objs);
+
+	if (err) {
+		pr_err("FAIL (%d)\n", err);
+		return err;
+	}
+	pr_info("all tests passed\n");
+	return 0;
+}
+
+static void __exit test_rhashtable_exit(void)
+{
+}
+
+module_init(test_rhashtable_init);
+module_exit(test_rhashtable_exit);
+MODULE_LICENSE("GPL");
@@ -135,6 +135,7 @@
 #include <linux/net_tstamp.h>
 #include <linux/static_key.h>
 #include <net/flow_keys.h>
+#include <net/busy_poll.h>
 
 #include "net-sysfs.h"
 
@@ -1600,12 +1601,10 @@ static inline bool is_skb_forwardable(struct net_device *dev,
  */
 int dev_forward_skb(struct net_device *dev, struct sk_buff *skb)
 {
-	if (skb_shinfo(skb)->tx_flags & SKBTX_DEV_ZEROCOPY) {
-		if (skb_copy_ubufs(skb, GFP_ATOMIC)) {
-			atomic_long_inc(&dev->rx_dropped);
-			kfree_skb(skb);
-			return NET_RX_DROP;
-		}
+	if (skb_orphan_frags_rx(skb, GFP_ATOMIC)) {
+		atomic_long_inc(&dev->rx_dropped);
+		kfree_skb(skb);
+		return NET_RX_DROP;
 	}
 
 	skb_orphan(skb);
@@ -1629,6 +1628,9 @@ static inline int deliver_skb(struct sk_buff *skb,
 			      struct packet_type *pt_prev,
 			      struct net_device *orig_dev)
 {
+	/* Receivers may hold on to the frags, never give them user pages */
+	if (unlikely(skb_orphan_frags_rx(skb, GFP_ATOMIC)))
+		return -ENOMEM;
 	atomic_inc(&skb->users);
 	return pt_prev->func(skb, skb->dev, pt_prev, orig_dev);
 }
@@ -1661,6 +1663,11 @@ static void dev_queue_xmit_nit(struct sk_buff *skb, struct net_device *dev)
 			skb2 = skb_clone(skb, GFP_ATOMIC);
 			if (!skb2)
 				break;
+			if (skb_orphan_frags_rx(skb2, GFP_ATOMIC)) {
+				kfree_skb(skb2);
+				skb2 = NULL;
+				break;
+			}
 
 			net_timestamp_set(skb2);
 
@@ -2117,25 +2124,6 @@ static int dev_gso_segment(struct sk_buff *skb, netdev_features_t features)
 	return 0;
 }
 
-/*
- * Try to orphan skb early, right before transmission by the device.
- * We cannot orphan skb if tx timestamp is requested or the sk-reference
- * is needed on driver level for other reasons, e.g. see net/can/raw.c
- */
-static inline void skb_orphan_try(struct sk_buff *skb)
-{
-	struct sock *sk = skb->sk;
-
-	if (sk && !skb_shinfo(skb)->tx_flags) {
-		/* skb_tx_hash() wont be able to get sk.
-		 * We copy sk_hash into skb->rxhash
-		 */
-		if (!skb->rxhash)
-			skb->rxhash = sk->sk_hash;
-		skb_orphan(skb);
-	}
-}
-
 static bool can_checksum_protocol(netdev_features_t features, __be16 protocol)
 {
 	return ((features & NETIF_F_GEN_CSUM) ||
@@ -2221,8 +2209,6 @@ int dev_hard_start_xmit(struct sk_buff *skb, struct net_device *dev,
 		if (!list_empty(&ptype_all))
 			dev_queue_xmit_nit(skb, dev);
 
-		skb_orphan_try(skb);
-
 		features = netif_skb_features(skb);
 
 		if (vlan_tx_tag_present(skb) &&
@@ -2390,6 +2376,42 @@ static inline int get_xps_queue(struct net_device *dev, struct sk_buff *skb)
 #endif
 }
 
+/**
+ *	__netdev_pick_tx - default transmit queue selection
+ *	@dev: device the packet is sent on
+ *	@skb: packet
+ *
+ *	Picks the queue the stack would use for a device without
+ *	ndo_select_queue(): the one cached in the socket, else XPS, else
+ *	a hash of the flow.  Drivers whose ndo_select_queue() only knows
+ *	better for some packets can fall back to it for the others.
+ */
+u16 __netdev_pick_tx(struct net_device *dev, struct sk_buff *skb)
+{
+	struct sock *sk = skb->sk;
+	int queue_index = sk_tx_queue_get(sk);
+
+	if (queue_index < 0 || skb->ooo_okay ||
+	    queue_index >= dev->real_num_tx_queues) {
+		int old_index = queue_index;
+
+		queue_index = get_xps_queue(dev, skb);
+		if (queue_index < 0)
+			queue_index = skb_tx_hash(dev, skb);
+
+		if (queue_index != old_index && sk) {
+			struct dst_entry *dst =
+			    rcu_dereference_check(sk->sk_dst_cache, 1);
+
+			if (dst && skb_dst(skb) == dst)
+				sk_tx_queue_set(sk, queue_index);
+		}
+	}
+
+	return queue_index;
+}
+EXPORT_SYMBOL(__netdev_pick_tx);
+
 static struct netdev_queue *dev_pick_tx(struct net_device *dev,
 					struct sk_buff *skb)
 {
@@ -2401,27 +2423,8 @@ static struct netdev_queue *dev_pick_tx(struct net_device *dev,
 	else if (ops->ndo_select_queue) {
 		queue_index = ops->ndo_select_queue(dev, skb);
 		queue_index = dev_cap_txqueue(dev, queue_index);
-	} else {
-		struct sock *sk = skb->sk;
-		queue_index = sk_tx_queue_get(sk);
-
-		if (queue_index < 0 || skb->ooo_okay ||
-		    queue_index >= dev->real_num_tx_queues) {
-			int old_index = queue_index;
-
-			queue_index = get_xps_queue(dev, skb);
-			if (queue_index < 0)
-				queue_index = skb_tx_hash(dev, skb);
-
-			if (queue_index != old_index && sk) {
-				struct dst_entry *dst =
-				    rcu_dereference_check(sk->sk_dst_cache, 1);
-
-				if (dst && skb_dst(skb) == dst)
-					sk_tx_queue_set(sk, queue_index);
-			}
-		}
-	}
+	} else
+		queue_index = __netdev_pick_tx(dev, skb);
 
 	skb_set_queue_mapping(skb, queue_index);
 	return netdev_get_tx_queue(dev, queue_index);
@@ -2622,6 +2625,7 @@ int netdev_max_backlog __read_mostly = 1000;
 int netdev_tstamp_prequeue __read_mostly = 1;
 int netdev_budget __read_mostly = 300;
 int weight_p __read_mostly = 64;            /* old backlog weight */
+int gro_normal_batch __read_mostly = 8;
 
 /* Called with irq disabled */
 static inline void ____napi_schedule(struct softnet_data *sd,
@@ -3173,8 +3177,16 @@ void netdev_rx_handler_unregister(struct net_device *dev)
 }
 EXPORT_SYMBOL_GPL(netdev_rx_handler_unregister);
 
-static int __netif_receive_skb(struct sk_buff *skb)
+/*
+ * Everything but the final protocol handler: deliver to the taps, the
+ * rx_handler and all matching ptypes but the last one, which is returned
+ * in *ppt_prev for the caller to run.  *pskb may have been replaced.
+ * Must be called under rcu_read_lock(), which also covers *ppt_prev.
+ */
+static int __netif_receive_skb_core(struct sk_buff **pskb,
+				    struct packet_type **ppt_prev)
 {
+	struct sk_buff *skb = *pskb;
 	struct packet_type *ptype, *pt_prev;
 	rx_handler_func_t *rx_handler;
 	struct net_device *orig_dev;
@@ -3191,8 +3203,6 @@ static int __netif_receive_skb(struct sk_buff *skb)
 	if (netpoll_receive_skb(skb))
 		return NET_RX_DROP;
 
-	if (!skb->skb_iif)
-		skb->skb_iif = skb->dev->ifindex;
 	orig_dev = skb->dev;
 
 	skb_reset_network_header(skb);
@@ -3201,9 +3211,8 @@ static int __netif_receive_skb(struct sk_buff *skb)
 
 	pt_prev = NULL;
 
-	rcu_read_lock();
-
 another_round:
+	skb->skb_iif = skb->dev->ifindex;
 
 	__this_cpu_inc(softnet_data.processed);
 
@@ -3282,8 +3291,11 @@ ncls:
 	}
 
 	if (pt_prev) {
-		ret = pt_prev->func(skb, skb->dev, pt_prev, orig_dev);
+		if (unlikely(skb_orphan_frags_rx(skb, GFP_ATOMIC)))
+			goto drop;
+		*ppt_prev = pt_prev;
 	} else {
+drop:
 		atomic_long_inc(&skb->dev->rx_dropped);
 		kfree_skb(skb);
 		/* Jamal, now you will not able to escape explaining
@@ -3293,10 +3305,86 @@ ncls:
 	}
 
 out:
+	/* The caller runs pt_prev->func() on the possibly new skb */
+	*pskb = skb;
+	return ret;
+}
+
+static int __netif_receive_skb(struct sk_buff *skb)
+{
+	struct net_device *orig_dev = skb->dev;
+	struct packet_type *pt_prev = NULL;
+	int ret;
+
+	rcu_read_lock();
+	ret = __netif_receive_skb_core(&skb, &pt_prev);
+	if (pt_prev)
+		ret = pt_prev->func(skb, skb->dev, pt_prev, orig_dev);
 	rcu_read_unlock();
 	return ret;
 }
 
+static void __netif_receive_skb_list_ptype(struct list_head *head,
+					   struct packet_type *pt_prev,
+					   struct net_device *orig_dev)
+{
+	struct sk_buff *skb, *next;
+
+	if (!pt_prev)
+		return;
+	if (list_empty(head))
+		return;
+	if (pt_prev->list_func != NULL)
+		pt_prev->list_func(head, pt_prev, orig_dev);
+	else
+		list_for_each_entry_safe(skb, next, head, list) {
+			skb_list_del_init(skb);
+			pt_prev->func(skb, skb->dev, pt_prev, orig_dev);
+		}
+}
+
+/*
+ * Fast path assumptions: there is no rx_handler and only one packet_type
+ * matches.  When either fails we do some per packet delivery inline and
+ * hand the sublist to the last ptype.  This cannot reorder packets for
+ * any single ptype: the last ptype is constant across a sublist and all
+ * the other ones are handled per packet.
+ */
+static void __netif_receive_skb_list(struct list_head *head)
+{
+	/* Current (common) ptype and orig_dev of sublist */
+	struct packet_type *pt_curr = NULL;
+	struct net_device *od_curr = NULL;
+	struct list_head sublist;
+	struct sk_buff *skb, *next;
+
+	INIT_LIST_HEAD(&sublist);
+	rcu_read_lock();
+	list_for_each_entry_safe(skb, next, head, list) {
+		struct net_device *orig_dev = skb->dev;
+		struct packet_type *pt_prev = NULL;
+
+		skb_list_del_init(skb);
+		__netif_receive_skb_core(&skb, &pt_prev);
+		if (!pt_prev)
+			continue;
+		if (pt_curr != pt_prev || od_curr != orig_dev) {
+			/* dispatch old sublist */
+			__netif_receive_skb_list_ptype(&sublist, pt_curr,
+						       od_curr);
+			/* start new sublist */
+			INIT_LIST_HEAD(&sublist);
+			pt_curr = pt_prev;
+			od_curr = orig_dev;
+		}
+		list_add_tail(&skb->list, &sublist);
+	}
+
+	/* dispatch final sublist */
+	__netif_receive_skb_list_ptype(&sublist, pt_curr, od_curr);
+	rcu_read_unlock();
+}
+
 /**
  *	netif_receive_skb - process receive buffer from network
  *	@skb: buffer to process
@@ -3340,6 +3428,54 @@ int netif_receive_skb(struct sk_buff *skb)
 }
 EXPORT_SYMBOL(netif_receive_skb);
 
+/**
+ *	netif_receive_skb_list - process many receive buffers from network
+ *	@head: list of skbs to process.
+ *
+ *	Since return value of netif_receive_skb() is normally ignored, and
+ *	wouldn't be meaningful for a list, this function returns void.
+ *
+ *	The skbs are run through each receive stage as a batch: protocols
+ *	that set packet_type->list_func get whole sublists of packets that
+ *	matched them from the same device.
+ *
+ *	This function may only be called from softirq context and interrupts
+ *	should be enabled.
+ */
+void netif_receive_skb_list(struct list_head *head)
+{
+	struct sk_buff *skb, *next;
+	struct list_head sublist;
+
+	INIT_LIST_HEAD(&sublist);
+	list_for_each_entry_safe(skb, next, head, list) {
+		net_timestamp_check(netdev_tstamp_prequeue, skb);
+		skb_list_del_init(skb);
+		if (!skb_defer_rx_timestamp(skb))
+			list_add_tail(&skb->list, &sublist);
+	}
+	list_splice_init(&sublist, head);
+
+#ifdef CONFIG_RPS
+	if (static_key_false(&rps_needed)) {
+		rcu_read_lock();
+		list_for_each_entry_safe(skb, next, head, list) {
+			struct rps_dev_flow voidflow, *rflow = &voidflow;
+			int cpu = get_rps_cpu(skb->dev, skb, &rflow);
+
+			if (cpu >= 0) {
+				/* Will be handled, remove from list */
+				skb_list_del_init(skb);
+				enqueue_to_backlog(skb, cpu, &rflow->last_qtail);
+			}
+		}
+		rcu_read_unlock();
+	}
+#endif
+	__netif_receive_skb_list(head);
+}
+EXPORT_SYMBOL(netif_receive_skb_list);
+
 /* Network device is going away, flush any packets still pending
  * Called with irqs disabled.
  */
@@ -3368,7 +3504,27 @@ static void flush_backlog(void *arg)
 	}
 }
 
-static int napi_gro_complete(struct sk_buff *skb)
+/* Pass the receive batch collected by gro_normal_one() up the stack */
+static void gro_normal_list(struct napi_struct *napi)
+{
+	if (!napi->rx_count)
+		return;
+	netif_receive_skb_list(&napi->rx_list);
+	INIT_LIST_HEAD(&napi->rx_list);
+	napi->rx_count = 0;
+}
+
+/* Queue one GRO_NORMAL skb up for list processing.  If batch size exceeded,
+ * pass the whole batch up to the stack.
+ */
+static void gro_normal_one(struct napi_struct *napi, struct sk_buff *skb)
+{
+	list_add_tail(&skb->list, &napi->rx_list);
+	if (++napi->rx_count >= gro_normal_batch)
+		gro_normal_list(napi);
+}
+
+static int napi_gro_complete(struct napi_struct *napi, struct sk_buff *skb)
 {
 	struct packet_type *ptype;
 	__be16 type = skb->protocol;
@@ -3397,7 +3553,8 @@ static int napi_gro_complete(struct sk_buff *skb)
 	}
 
 out:
-	return netif_receive_skb(skb);
+	gro_normal_one(napi, skb);
+	return NET_RX_SUCCESS;
 }
 
 inline void napi_gro_flush(struct napi_struct *napi)
@@ -3407,11 +3564,14 @@ inline void napi_gro_flush(struct napi_struct *napi)
 	for (skb = napi->gro_list; skb; skb = next) {
 		next = skb->next;
 		skb->next = NULL;
-		napi_gro_complete(skb);
+		napi_gro_complete(napi, skb);
 	}
 
 	napi->gro_count = 0;
 	napi->gro_list = NULL;
+
+	/* the merged packets were batched behind the GRO_NORMAL ones */
+	gro_normal_list(napi);
 }
 EXPORT_SYMBOL(napi_gro_flush);
 
@@ -3459,7 +3619,7 @@ enum gro_result dev_gro_receive(struct napi_struct *napi, struct sk_buff *skb)
 
 		*pp = nskb->next;
 		nskb->next = NULL;
-		napi_gro_complete(nskb);
+		napi_gro_complete(napi, nskb);
 		napi->gro_count--;
 	}
 
@@ -3532,12 +3692,12 @@ __napi_gro_receive(struct napi_struct *napi, struct sk_buff *skb)
 	return dev_gro_receive(napi, skb);
 }
 
-gro_result_t napi_skb_finish(gro_result_t ret, struct sk_buff *skb)
+gro_result_t napi_skb_finish(struct napi_struct *napi, gro_result_t ret,
+			     struct sk_buff *skb)
 {
 	switch (ret) {
 	case GRO_NORMAL:
-		if (netif_receive_skb(skb))
-			ret = GRO_DROP;
+		gro_normal_one(napi, skb);
 		break;
 
 	case GRO_DROP:
@@ -3571,9 +3731,10 @@ EXPORT_SYMBOL(skb_gro_reset_offset);
 
 gro_result_t napi_gro_receive(struct napi_struct *napi, struct sk_buff *skb)
 {
+	skb_mark_napi_id(skb, napi);
 	skb_gro_reset_offset(skb);
 
-	return napi_skb_finish(__napi_gro_receive(napi, skb), skb);
+	return napi_skb_finish(napi, __napi_gro_receive(napi, skb), skb);
 }
 EXPORT_SYMBOL(napi_gro_receive);
 
@@ -3612,8 +3773,8 @@ gro_result_t napi_frags_finish(struct napi_struct *napi, struct sk_buff *skb,
 
 		if (ret == GRO_HELD)
 			skb_gro_pull(skb, -ETH_HLEN);
-		else if (netif_receive_skb(skb))
-			ret = GRO_DROP;
+		else
+			gro_normal_one(napi, skb);
 		break;
 
 	case GRO_DROP:
@@ -3673,6 +3834,7 @@ gro_result_t napi_gro_frags(struct napi_struct *napi)
 	if (!skb)
 		return GRO_DROP;
 
+	skb_mark_napi_id(skb, napi);
 	return napi_frags_finish(napi, skb, __napi_gro_receive(napi, skb));
 }
 EXPORT_SYMBOL(napi_gro_frags);
@@ -3723,14 +3885,27 @@ static int process_backlog(struct napi_struct *napi, int quota)
 	local_irq_disable();
 	while (work < quota) {
 		struct sk_buff *skb;
-		unsigned int qlen;
+		struct list_head list;
+		unsigned int qlen, n;
 
-		while ((skb = __skb_dequeue(&sd->process_queue))) {
+		/* Hand the stack batches of up to gro_normal_batch packets.
+		 * The head counter only moves once they are processed, as RPS
+		 * flow migration relies on it.
+		 */
+		while (!skb_queue_empty(&sd->process_queue)) {
+			INIT_LIST_HEAD(&list);
+			n = 0;
+			while (n < quota - work && (!n || n < gro_normal_batch) &&
+			       (skb = __skb_dequeue(&sd->process_queue))) {
+				list_add_tail(&skb->list, &list);
+				n++;
+			}
 			local_irq_enable();
-			__netif_receive_skb(skb);
+			__netif_receive_skb_list(&list);
 			local_irq_disable();
-			input_queue_head_incr(sd);
-			if (++work >= quota) {
+			input_queue_head_add(sd, n);
+			work += n;
+			if (work >= quota) {
 				local_irq_enable();
 				return work;
 			}
@@ -3783,7 +3958,10 @@ void __napi_complete(struct napi_struct *n)
 	BUG_ON(!test_bit(NAPI_STATE_SCHED, &n->state));
 	BUG_ON(n->gro_list);
 
-	list_del(&n->poll_list);
+	/* list_del_init() so that a NAPI polled by sk_busy_loop() and
+	 * completed from there, off any poll_list, stays well formed.
+	 */
+	list_del_init(&n->poll_list);
 	smp_mb__before_clear_bit();
 	clear_bit(NAPI_STATE_SCHED, &n->state);
 }
@@ -3807,6 +3985,132 @@ void napi_complete(struct napi_struct *n)
 }
 EXPORT_SYMBOL(napi_complete);
 
+#ifdef CONFIG_NET_RX_BUSY_POLL
+
+#define NAPI_HASH_BITS	8
+
+/* NAPI contexts registered with netif_napi_add(), by napi_id */
+static struct hlist_head napi_hash[1 << NAPI_HASH_BITS];
+static DEFINE_SPINLOCK(napi_hash_lock);
+static unsigned int napi_gen_id;
+
+unsigned int sysctl_net_busy_read __read_mostly;
+unsigned int sysctl_net_busy_poll __read_mostly;
+
+/* must be called under rcu_read_lock(), as we dont take a reference */
+static struct napi_struct *napi_by_id(unsigned int napi_id)
+{
+	unsigned int hash = hash_32(napi_id, NAPI_HASH_BITS);
+	struct napi_struct *napi;
+	struct hlist_node *node;
+
+	hlist_for_each_entry_rcu(napi, node, &napi_hash[hash], napi_hash_node)
+		if (napi->napi_id == napi_id)
+			return napi;
+
+	return NULL;
+}
+
+static void napi_hash_add(struct napi_struct *napi)
+{
+	spin_lock(&napi_hash_lock);
+
+	/* 0 is "no id", skb->napi_id of an skb nobody marked */
+	do {
+		if (unlikely(++napi_gen_id == 0))
+			napi_gen_id = 1;
+	} while (napi_by_id(napi_gen_id));
+	napi->napi_id = napi_gen_id;
+
+	hlist_add_head_rcu(&napi->napi_hash_node,
+			   &napi_hash[hash_32(napi->napi_id, NAPI_HASH_BITS)]);
+
+	spin_unlock(&napi_hash_lock);
+}
+
+/* Returns true if @napi was hashed: the caller must then wait for an RCU
+ * grace period before freeing it, sk_busy_loop() may still be using it.
+ */
+static bool napi_hash_del(struct napi_struct *napi)
+{
+	bool hashed;
+
+	spin_lock(&napi_hash_lock);
+	hashed = !hlist_unhashed(&napi->napi_hash_node);
+	hlist_del_init_rcu(&napi->napi_hash_node);
+	spin_unlock(&napi_hash_lock);
+
+	return hashed;
+}
+
+/**
+ *	sk_busy_loop - poll the NAPI context a socket receives from
+ *	@sk: socket
+ *	@nonblock: poll only once
+ *
+ *	Runs ->poll() of the NAPI context that last fed @sk from process
+ *	context, until data is queued on @sk, sk_ll_usec expires or we
+ *	should give the CPU back.  If the NAPI context is already scheduled
+ *	(by an interrupt or another busy poller) we just spin and let its
+ *	owner deliver.  Returns true if the receive queue is not empty.
+ */
+bool sk_busy_loop(struct sock *sk, int nonblock)
+{
+	unsigned long end_time = !nonblock ? sk_busy_loop_end_time(sk) : 0;
+	struct napi_struct *napi;
+	bool rc = false;
+
+	rcu_read_lock();
+
+	napi = napi_by_id(sk->sk_napi_id);
+	if (!napi)
+		goto out;
+
+	do {
+		int work = 0;
+		void *have;
+
+		local_bh_disable();
+		have = netpoll_poll_lock(napi);
+		if (!test_and_set_bit(NAPI_STATE_SCHED, &napi->state)) {
+			work = napi->poll(napi, BUSY_POLL_BUDGET);
+			/* ->poll() did not napi_complete(): more work pending,
+			 * hand the context over to net_rx_action().
+			 */
+			if (work == BUSY_POLL_BUDGET) {
+				gro_normal_list(napi);
+				__napi_schedule(napi);
+			}
+		}
+		netpoll_poll_unlock(have);
+		if (work > 0)
+			NET_ADD_STATS_BH(sock_net(sk),
+					 LINUX_MIB_BUSYPOLLRXPACKETS, work);
+		local_bh_enable();
+
+		rc = !skb_queue_empty(&sk->sk_receive_queue);
+	} while (!nonblock && !rc && sk_can_busy_loop(sk) &&
+		 !busy_loop_timeout(end_time));
+
+out:
+	rcu_read_unlock();
+	return rc;
+}
+EXPORT_SYMBOL(sk_busy_loop);
+
+#else
+
+static inline void napi_hash_add(struct napi_struct *napi)
+{
+}
+
+static inline bool napi_hash_del(struct napi_struct *napi)
+{
+	return false;
+}
+
+#endif /* CONFIG_NET_RX_BUSY_POLL */
+
 void netif_napi_add(struct net_device *dev, struct napi_struct *napi,
 		    int (*poll)(struct napi_struct *, int), int weight)
 {
@@ -3814,6 +4118,8 @@ void netif_napi_add(struct net_device *dev, struct napi_struct *napi,
 	napi->gro_count = 0;
 	napi->gro_list = NULL;
 	napi->skb = NULL;
+	INIT_LIST_HEAD(&napi->rx_list);
+	napi->rx_count = 0;
 	napi->poll = poll;
 	napi->weight = weight;
 	list_add(&napi->dev_list, &dev->napi_list);
@@ -3823,6 +4129,7 @@ void netif_napi_add(struct net_device *dev, struct napi_struct *napi,
 	napi->poll_owner = -1;
 #endif
 	set_bit(NAPI_STATE_SCHED, &napi->state);
+	napi_hash_add(napi);
 }
 EXPORT_SYMBOL(netif_napi_add);
 
@@ -3831,6 +4138,8 @@ void netif_napi_del(struct napi_struct *napi)
 	struct sk_buff *skb, *next;
 
 	list_del_init(&napi->dev_list);
+	if (napi_hash_del(napi))
+		synchronize_net();
 	napi_free_frags(napi);
 
 	for (skb = napi->gro_list; skb; skb = next) {
@@ -3893,6 +4202,12 @@ static void net_rx_action(struct softirq_action *h)
 
 		budget -= work;
 
+		/* A ->poll() that used its whole weight did not complete the
+		 * NAPI context: flush the packets it batched ourselves.
+		 */
+		if (work == weight)
+			gro_normal_list(n);
+
 		local_irq_disable();
 
 		/* Drivers must not modify the NAPI state if they
@@ -53,13 +53,17 @@ int reqsk_queue_alloc(struct request_sock_queue *queue,
 	if (lopt == NULL)
 		return -ENOMEM;
 
-	for (lopt->max_qlen_log = 3;
-	     (1 << lopt->max_qlen_log) < nr_table_entries;
-	     lopt->max_qlen_log++);
+	for (queue->max_qlen_log = 3;
+	     (1 << queue->max_qlen_log) < nr_table_entries;
+	     queue->max_qlen_log++);
 
 	get_random_bytes(&lopt->hash_rnd, sizeof(lopt->hash_rnd));
+	spin_lock_init(&queue->rskq_lock);
 	rwlock_init(&queue->syn_wait_lock);
 	queue->rskq_accept_head = NULL;
+	queue->synflood_warned = 0;
+	atomic_set(&queue->qlen, 0);
+	atomic_set(&queue->qlen_young, 0);
 	lopt->nr_table_entries = nr_table_entries;
 
 	write_lock_bh(&queue->syn_wait_lock);
@@ -109,7 +113,7 @@ void reqsk_queue_destroy(struct request_sock_queue *queue)
 	size_t lopt_size = sizeof(struct listen_sock) +
 		lopt->nr_table_entries * sizeof(struct request_sock *);
 
-	if (lopt->qlen != 0) {
+	if (reqsk_queue_len(queue) != 0) {
 		unsigned int i;
 
 		for (i = 0; i < lopt->nr_table_entries; i++) {
@@ -117,13 +121,14 @@ void reqsk_queue_destroy(struct request_sock_queue *queue)
 
 			while ((req = lopt->syn_table[i]) != NULL) {
 				lopt->syn_table[i] = req->dl_next;
-				lopt->qlen--;
-				reqsk_free(req);
+				reqsk_queue_removed(queue, req);
+				/* may still be referenced by a softirq */
+				reqsk_put(req);
 			}
 		}
 	}
 
-	WARN_ON(lopt->qlen != 0);
+	WARN_ON(reqsk_queue_len(queue) != 0);
 	if (lopt_size > PAGE_SIZE)
 		vfree(lopt);
 	else
@@ -0,0 +1,156 @@
+/*
+ * TCP Fast Open: data in the SYN of a connection.
+ *
+ * A server hands out a cookie bound to the client address in its SYN-ACK.
+ * Once a client holds one, it may put data in the SYN of later connections
+ * and the server delivers that data before the three way handshake ends.
+ *
+ *	This program is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU General Public License
+ *      as published by the Free Software Foundation; either version
+ *      2 of the License, or (at your option) any later version.
+ */
+
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/percpu.h>
+#include <linux/random.h>
+#include <linux/seqlock.h>
+#include <linux/cryptohash.h>
+#include <net/inetpeer.h>
+#include <net/ipv6.h>
+#include <net/tcp.h>
+
+int sysctl_tcp_fastopen __read_mostly;
+
+/* Server secret the cookies are derived from, see tcp_fastopen_key sysctl */
+static u32 tcp_fastopen_secret[TCP_FASTOPEN_KEY_LENGTH / sizeof(u32)];
+static DEFINE_SEQLOCK(tcp_fastopen_secret_lock);
+
+static DEFINE_PER_CPU(__u32 [16 + SHA_DIGEST_WORDS + SHA_WORKSPACE_WORDS],
+		      tcp_fastopen_scratch);
+
+/* Protects the cookies cached in struct inet_peer */
+static DEFINE_SEQLOCK(tcp_fastopen_cache_lock);
+
+static __init int tcp_fastopen_init(void)
+{
+	get_random_bytes(tcp_fastopen_secret, sizeof(tcp_fastopen_secret));
+	return 0;
+}
+__initcall(tcp_fastopen_init);
+
+void tcp_fastopen_get_key(u32 *key)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&tcp_fastopen_secret_lock);
+		memcpy(key, tcp_fastopen_secret, sizeof(tcp_fastopen_secret));
+	} while (read_seqretry(&tcp_fastopen_secret_lock, seq));
+}
+
+void tcp_fastopen_reset_key(const u32 *key)
+{
+	write_seqlock_bh(&tcp_fastopen_secret_lock);
+	memcpy(tcp_fastopen_secret, key, sizeof(tcp_fastopen_secret));
+	write_sequnlock_bh(&tcp_fastopen_secret_lock);
+}
+
+/* Computes the cookie of client @addr: a truncated SHA1 over the secret
+ * and the address.  Uses a per-cpu scratch area, so it must be called with
+ * bottom halves disabled.
+ */
+void tcp_fastopen_cookie_gen(__be32 addr, struct tcp_fastopen_cookie *foc)
+{
+	__u32 *tmp = __get_cpu_var(tcp_fastopen_scratch);
+	__u32 *digest = tmp + 16;
+
+	memset(tmp, 0, 16 * sizeof(__u32));
+	tcp_fastopen_get_key(tmp);
+	tmp[TCP_FASTOPEN_KEY_LENGTH / sizeof(u32)] = (__force u32)addr;
+
+	sha_init(digest);
+	sha_transform(digest, (char *)tmp, digest + SHA_DIGEST_WORDS);
+
+	memcpy(foc->val, digest, TCP_FASTOPEN_COOKIE_SIZE);
+	foc->len = TCP_FASTOPEN_COOKIE_SIZE;
+}
+
+/* Clients remember the cookie and MSS of a server in its inet_peer entry,
+ * next to the timestamps TCP already keeps there.
+ */
+static struct inet_peer *tcp_fastopen_get_peer(struct sock *sk, int create)
+{
+#if IS_ENABLED(CONFIG_IPV6)
+	if (sk->sk_family == AF_INET6 &&
+	    !ipv6_addr_v4mapped(&inet6_sk(sk)->daddr))
+		return inet_getpeer_v6(&inet6_sk(sk)->daddr, create);
+#endif
+	return inet_getpeer_v4(inet_sk(sk)->inet_daddr, create);
+}
+
+void tcp_fastopen_cache_get(struct sock *sk, u16 *mss,
+			    struct tcp_fastopen_cookie *cookie)
+{
+	struct inet_peer *peer = tcp_fastopen_get_peer(sk, 0);
+	unsigned int seq;
+
+	if (peer == NULL)
+		return;
+
+	do {
+		seq = read_seqbegin(&tcp_fastopen_cache_lock);
+		if (peer->tcp_fastopen_mss)
+			*mss = peer->tcp_fastopen_mss;
+		cookie->len = peer->tcp_fastopen_cookie_len;
+		memcpy(cookie->val, peer->tcp_fastopen_cookie, cookie->len);
+	} while (read_seqretry(&tcp_fastopen_cache_lock, seq));
+
+	inet_putpeer(peer);
+}
+
+void tcp_fastopen_cache_set(struct sock *sk, u16 mss,
+			    struct tcp_fastopen_cookie *cookie)
+{
+	struct inet_peer *peer;
+
+	BUILD_BUG_ON(sizeof(peer->tcp_fastopen_cookie) <
+		     TCP_FASTOPEN_COOKIE_MAX);
+
+	peer = tcp_fastopen_get_peer(sk, 1);
+	if (peer == NULL)
+		return;
+
+	write_seqlock_bh(&tcp_fastopen_cache_lock);
+	if (mss)
+		peer->tcp_fastopen_mss = mss;
+	if (cookie->len > 0) {
+		peer->tcp_fastopen_cookie_len = cookie->len;
+		memcpy(peer->tcp_fastopen_cookie, cookie->val, cookie->len);
+	}
+	write_sequnlock_bh(&tcp_fastopen_cache_lock);
+
+	inet_putpeer(peer);
+}
+
+/* The child of a passive Fast Open got the final ACK of its handshake, or
+ * is going away before that: release the request it was created from and
+ * give the pending slot back to the listener.
+ */
+void tcp_fastopen_remove_req(struct sock *sk)
+{
+	struct tcp_sock *tp = tcp_sk(sk);
+	struct request_sock *req = tp->fastopen_rsk;
+	struct sock *lsk;
+
+	if (req == NULL)
+		return;
+
+	lsk = tcp_rsk(req)->listener;
+	atomic_dec(&inet_csk(lsk)->icsk_accept_queue.fastopenq.qlen);
+	sock_put(lsk);
+
+	tp->fastopen_rsk = NULL;
+	reqsk_free(req);
+}
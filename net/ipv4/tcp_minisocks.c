@@ -147,7 +147,7 @@ tcp_timewait_state_process(struct inet_timewait_sock *tw, struct sk_buff *skb,
 
 	tmp_opt.saw_tstamp = 0;
 	if (th->doff > (sizeof(*th) >> 2) && tcptw->tw_ts_recent_stamp) {
-		tcp_parse_options(skb, &tmp_opt, &hash_location, 0);
+		tcp_parse_options(skb, &tmp_opt, &hash_location, 0, NULL);
 
 		if (tmp_opt.saw_tstamp) {
 			tmp_opt.ts_recent	= tcptw->tw_ts_recent;
@@ -512,6 +512,12 @@ struct sock *tcp_create_openreq_child(struct sock *sk, struct request_sock *req,
 
 		newtp->urg_data = 0;
 
+		newtp->fastopen_req = NULL;
+		newtp->fastopen_rsk = NULL;
+		newtp->syn_fastopen = 0;
+		newtp->syn_data = 0;
+		newtp->syn_data_acked = 0;
+
 		if (sock_flag(newsk, SOCK_KEEPOPEN))
 			inet_csk_reset_keepalive_timer(newsk,
 						       keepalive_time_when(newtp));
@@ -566,8 +572,7 @@ EXPORT_SYMBOL(tcp_create_openreq_child);
  */
 
 struct sock *tcp_check_req(struct sock *sk, struct sk_buff *skb,
-			   struct request_sock *req,
-			   struct request_sock **prev)
+			   struct request_sock *req)
 {
 	struct tcp_options_received tmp_opt;
 	const u8 *hash_location;
@@ -578,7 +583,7 @@ struct sock *tcp_check_req(struct sock *sk, struct sk_buff *skb,
 
 	tmp_opt.saw_tstamp = 0;
 	if (th->doff > (sizeof(struct tcphdr)>>2)) {
-		tcp_parse_options(skb, &tmp_opt, &hash_location, 0);
+		tcp_parse_options(skb, &tmp_opt, &hash_location, 0, NULL);
 
 		if (tmp_opt.saw_tstamp) {
 			tmp_opt.ts_recent = req->ts_recent;
@@ -734,16 +739,29 @@ struct sock *tcp_check_req(struct sock *sk, struct sk_buff *skb,
 	 * the tests. THIS SEGMENT MUST MOVE SOCKET TO
 	 * ESTABLISHED STATE. If it will be dropped after
 	 * socket is created, wait for troubles.
+	 *
+	 * The listener is not locked: whoever takes the request off the
+	 * SYN table owns it, a duplicate ACK processed on another CPU or
+	 * the SYN-ACK timer lose and back off.  Check the accept queue
+	 * first so that an overflowing listener keeps the request around.
 	 */
-	child = inet_csk(sk)->icsk_af_ops->syn_recv_sock(sk, skb, req, NULL);
-	if (child == NULL)
+	if (sk_acceptq_is_full(sk)) {
+		NET_INC_STATS_BH(sock_net(sk), LINUX_MIB_LISTENOVERFLOWS);
+		NET_INC_STATS_BH(sock_net(sk), LINUX_MIB_LISTENDROPS);
 		goto listen_overflow;
+	}
 
-	inet_csk_reqsk_queue_unlink(sk, req, prev);
-	inet_csk_reqsk_queue_removed(sk, req);
+	if (!inet_csk_reqsk_queue_unlink(sk, req))
+		return NULL;
+
+	child = inet_csk(sk)->icsk_af_ops->syn_recv_sock(sk, skb, req, NULL);
+	if (child == NULL) {
+		/* Drop the reference the SYN table had */
+		reqsk_put(req);
+		return NULL;
+	}
 
-	inet_csk_reqsk_queue_add(sk, req, child);
-	return child;
+	return inet_csk_reqsk_queue_add(sk, req, child);
 
 listen_overflow:
 	if (!sysctl_tcp_abort_on_overflow) {
@@ -756,7 +774,7 @@ embryonic_reset:
 	if (!(flg & TCP_FLAG_RST))
 		req->rsk_ops->send_reset(sk, skb);
 
-	inet_csk_reqsk_queue_drop(sk, req, prev);
+	inet_csk_reqsk_queue_drop(sk, req);
 	return NULL;
 }
 EXPORT_SYMBOL(tcp_check_req);
@@ -529,7 +529,7 @@ const struct proto_ops inet6_stream_ops = {
 	.getsockopt	   = sock_common_getsockopt,	/* ok		*/
 	.sendmsg	   = inet_sendmsg,		/* ok		*/
 	.recvmsg	   = inet_recvmsg,		/* ok		*/
-	.mmap		   = sock_no_mmap,
+	.mmap		   = tcp_mmap,			/* ok		*/
 	.sendpage	   = inet_sendpage,
 	.splice_read	   = tcp_splice_read,
 #ifdef CONFIG_COMPAT
@@ -1104,6 +1104,11 @@ static int __init inet6_init(void)
 	if (err)
 		goto out_unregister_raw_proto;
 
+	/* TCP shares its recvmsg with IPv4 and reads the error queue
+	 * through this.
+	 */
+	inet6_recv_error = ipv6_recv_error;
+
 	/* Register the family here so that the init calls below will
 	 * be able to create sockets. (?? is this dangerous ??)
 	 */
@@ -1249,6 +1254,7 @@ static_sysctl_fail:
 	sock_unregister(PF_INET6);
 	rtnl_unregister_all(PF_INET6);
 out_sock_register_fail:
+	inet6_recv_error = NULL;
 	rawv6_exit();
 out_unregister_raw_proto:
 	proto_unregister(&rawv6_prot);
@@ -1269,6 +1275,7 @@ static void __exit inet6_exit(void)
 
 	/* First of all disallow new sockets creation. */
 	sock_unregister(PF_INET6);
+	inet6_recv_error = NULL;
 	/* Disallow any further netlink messages */
 	rtnl_unregister_all(PF_INET6);
 
@@ -13,12 +13,13 @@
 #include <linux/random.h>
 #include <linux/jhash.h>
 #include <linux/slab.h>
-#include <linux/vmalloc.h>
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
 #include <linux/list.h>
 #include <linux/skbuff.h>
 #include <linux/mm.h>
+#include <linux/log2.h>
+#include <linux/rhashtable.h>
 #include <linux/in.h>
 #include <linux/ip.h>
 #if IS_ENABLED(CONFIG_IP6_NF_IPTABLES)
@@ -77,7 +78,8 @@ struct dsthash_dst {
 
 struct dsthash_ent {
 	/* static / read-only parts in the beginning */
-	struct hlist_node node;
+	struct rhash_head node;
+	struct list_head list;		/* for gc and /proc, under ht->lock */
 	struct dsthash_dst dst;
 
 	/* modified structure members in the end */
@@ -95,63 +97,35 @@ struct xt_hashlimit_htable {
 	struct hlist_node node;		/* global list of all htables */
 	int use;
 	u_int8_t family;
-	bool rnd_initialized;
 
 	struct hashlimit_cfg1 cfg;	/* config */
 
 	/* used internally */
-	spinlock_t lock;		/* lock for list_head */
-	u_int32_t rnd;			/* random seed for hash */
+	spinlock_t lock;		/* lock for entries */
 	unsigned int count;		/* number entries in table */
+	struct list_head entries;	/* all entries, for gc and /proc */
 	struct timer_list timer;	/* timer for gc */
 
 	/* seq_file stuff */
 	struct proc_dir_entry *pde;
 	struct net *net;
 
-	struct hlist_head hash[0];	/* hashtable itself */
+	struct rhashtable hash;		/* hashtable itself */
 };
 
 static DEFINE_MUTEX(hashlimit_mutex);	/* protects htables list */
 static struct kmem_cache *hashlimit_cachep __read_mostly;
 
-static inline bool dst_cmp(const struct dsthash_ent *ent,
-			   const struct dsthash_dst *b)
-{
-	return !memcmp(&ent->dst, b, sizeof(ent->dst));
-}
-
-static u_int32_t
-hash_dst(const struct xt_hashlimit_htable *ht, const struct dsthash_dst *dst)
-{
-	u_int32_t hash = jhash2((const u32 *)dst,
-				sizeof(*dst)/sizeof(u32),
-				ht->rnd);
-	/*
-	 * Instead of returning hash % ht->cfg.size (implying a divide)
-	 * we return the high 32 bits of the (hash * ht->cfg.size) that will
-	 * give results between [0 and cfg.size-1] and same hash distribution,
-	 * but using a multiply, less expensive than a divide
-	 */
-	return ((u64)hash * ht->cfg.size) >> 32;
-}
-
 static struct dsthash_ent *
 dsthash_find(const struct xt_hashlimit_htable *ht,
 	     const struct dsthash_dst *dst)
 {
 	struct dsthash_ent *ent;
-	struct hlist_node *pos;
-	u_int32_t hash = hash_dst(ht, dst);
-
-	if (!hlist_empty(&ht->hash[hash])) {
-		hlist_for_each_entry_rcu(ent, pos, &ht->hash[hash], node)
-			if (dst_cmp(ent, dst)) {
-				spin_lock(&ent->lock);
-				return ent;
-			}
-	}
-	return NULL;
+
+	ent = rhashtable_lookup(&ht->hash, dst);
+	if (ent)
+		spin_lock(&ent->lock);
+	return ent;
 }
 
 /* allocate dsthash_ent, initialize dst, put in htable and lock it */
@@ -162,13 +136,6 @@ dsthash_alloc_init(struct xt_hashlimit_htable *ht,
 	struct dsthash_ent *ent;
 
 	spin_lock(&ht->lock);
-	/* initialize hash with random val at the time we allocate
-	 * the first hashtable entry */
-	if (unlikely(!ht->rnd_initialized)) {
-		get_random_bytes(&ht->rnd, sizeof(ht->rnd));
-		ht->rnd_initialized = true;
-	}
-
 	if (ht->cfg.max && ht->count >= ht->cfg.max) {
 		/* FIXME: do something. question is what.. */
 		if (net_ratelimit())
@@ -181,7 +148,8 @@ dsthash_alloc_init(struct xt_hashlimit_htable *ht,
 		spin_lock_init(&ent->lock);
 
 		spin_lock(&ent->lock);
-		hlist_add_head_rcu(&ent->node, &ht->hash[hash_dst(ht, dst)]);
+		rhashtable_insert(&ht->hash, &ent->node);
+		list_add(&ent->list, &ht->entries);
 		ht->count++;
 	}
 	spin_unlock(&ht->lock);
@@ -198,8 +166,9 @@ static void dsthash_free_rcu(struct rcu_head *head)
 static inline void
 dsthash_free(struct xt_hashlimit_htable *ht, struct dsthash_ent *ent)
 {
-	hlist_del_rcu(&ent->node);
-	call_rcu_bh(&ent->rcu, dsthash_free_rcu);
+	rhashtable_remove(&ht->hash, &ent->node);
+	list_del(&ent->list);
+	call_rcu(&ent->rcu, dsthash_free_rcu);
 	ht->count--;
 }
 static void htable_gc(unsigned long htlong);
@@ -208,9 +177,14 @@ static int htable_create(struct net *net, struct xt_hashlimit_mtinfo1 *minfo,
 			 u_int8_t family)
 {
 	struct hashlimit_net *hashlimit_net = hashlimit_pernet(net);
+	struct rhashtable_params params = {
+		.key_len	= sizeof(struct dsthash_dst),
+		.key_offset	= offsetof(struct dsthash_ent, dst),
+		.head_offset	= offsetof(struct dsthash_ent, node),
+		.hashfn		= jhash,
+	};
 	struct xt_hashlimit_htable *hinfo;
 	unsigned int size;
-	unsigned int i;
 
 	if (minfo->cfg.size) {
 		size = minfo->cfg.size;
@@ -222,12 +196,9 @@ static int htable_create(struct net *net, struct xt_hashlimit_mtinfo1 *minfo,
 		if (size < 16)
 			size = 16;
 	}
-	/* FIXME: don't use vmalloc() here or anywhere else -HW */
-	hinfo = vmalloc(sizeof(struct xt_hashlimit_htable) +
-	                sizeof(struct list_head) * size);
+	hinfo = kmalloc(sizeof(*hinfo), GFP_KERNEL);
 	if (hinfo == NULL)
 		return -ENOMEM;
-	minfo->hinfo = hinfo;
 
 	/* copy match config into hashtable config */
 	memcpy(&hinfo->cfg, &minfo->cfg, sizeof(hinfo->cfg));
@@ -237,24 +208,32 @@ static int htable_create(struct net *net, struct xt_hashlimit_mtinfo1 *minfo,
 	else if (hinfo->cfg.max < hinfo->cfg.size)
 		hinfo->cfg.max = hinfo->cfg.size;
 
-	for (i = 0; i < hinfo->cfg.size; i++)
-		INIT_HLIST_HEAD(&hinfo->hash[i]);
+	/* size only sizes the table to start with; it grows on demand up
+	 * to what max entries need */
+	params.nelem_hint = hinfo->cfg.size;
+	params.max_shift = ilog2(hinfo->cfg.max) + 1;
+	if (rhashtable_init(&hinfo->hash, &params) < 0) {
+		kfree(hinfo);
+		return -ENOMEM;
+	}
 
 	hinfo->use = 1;
 	hinfo->count = 0;
 	hinfo->family = family;
-	hinfo->rnd_initialized = false;
 	spin_lock_init(&hinfo->lock);
+	INIT_LIST_HEAD(&hinfo->entries);
 
 	hinfo->pde = proc_create_data(minfo->name, 0,
 		(family == NFPROTO_IPV4) ?
 		hashlimit_net->ipt_hashlimit : hashlimit_net->ip6t_hashlimit,
 		&dl_file_ops, hinfo);
 	if (hinfo->pde == NULL) {
-		vfree(hinfo);
+		rhashtable_destroy(&hinfo->hash);
+		kfree(hinfo);
 		return -ENOMEM;
 	}
 	hinfo->net = net;
+	minfo->hinfo = hinfo;
 
 	setup_timer(&hinfo->timer, htable_gc, (unsigned long)hinfo);
 	hinfo->timer.expires = jiffies + msecs_to_jiffies(hinfo->cfg.gc_interval);
@@ -281,17 +260,13 @@ static void htable_selective_cleanup(struct xt_hashlimit_htable *ht,
 			bool (*select)(const struct xt_hashlimit_htable *ht,
 				      const struct dsthash_ent *he))
 {
-	unsigned int i;
+	struct dsthash_ent *dh, *n;
 
 	/* lock hash table and iterate over it */
 	spin_lock_bh(&ht->lock);
-	for (i = 0; i < ht->cfg.size; i++) {
-		struct dsthash_ent *dh;
-		struct hlist_node *pos, *n;
-		hlist_for_each_entry_safe(dh, pos, n, &ht->hash[i], node) {
-			if ((*select)(ht, dh))
-				dsthash_free(ht, dh);
-		}
+	list_for_each_entry_safe(dh, n, &ht->entries, list) {
+		if ((*select)(ht, dh))
+			dsthash_free(ht, dh);
 	}
 	spin_unlock_bh(&ht->lock);
 }
@@ -321,7 +296,8 @@ static void htable_destroy(struct xt_hashlimit_htable *hinfo)
 		parent = hashlimit_net->ip6t_hashlimit;
 	remove_proc_entry(hinfo->pde->name, parent);
 	htable_selective_cleanup(hinfo, select_all);
-	vfree(hinfo);
+	rhashtable_destroy(&hinfo->hash);
+	kfree(hinfo);
 }
 
 static struct xt_hashlimit_htable *htable_find_get(struct net *net,
@@ -523,12 +499,12 @@ hashlimit_mt(const struct sk_buff *skb, struct xt_action_param *par)
 	if (hashlimit_init_dst(hinfo, &dst, skb, par->thoff) < 0)
 		goto hotdrop;
 
-	rcu_read_lock_bh();
+	rcu_read_lock();
 	dh = dsthash_find(hinfo, &dst);
 	if (dh == NULL) {
 		dh = dsthash_alloc_init(hinfo, &dst);
 		if (dh == NULL) {
-			rcu_read_unlock_bh();
+			rcu_read_unlock();
 			goto hotdrop;
 		}
 		dh->expires = jiffies + msecs_to_jiffies(hinfo->cfg.expire);
@@ -548,12 +524,12 @@ hashlimit_mt(const struct sk_buff *skb, struct xt_action_param *par)
 		/* below the limit */
 		dh->rateinfo.credit -= dh->rateinfo.cost;
 		spin_unlock(&dh->lock);
-		rcu_read_unlock_bh();
+		rcu_read_unlock();
 		return !(info->cfg.mode & XT_HASHLIMIT_INVERT);
 	}
 
 	spin_unlock(&dh->lock);
-	rcu_read_unlock_bh();
+	rcu_read_unlock();
 	/* default match is underlimit - so over the limit, we need to invert */
 	return info->cfg.mode & XT_HASHLIMIT_INVERT;
 
@@ -638,41 +614,23 @@ static void *dl_seq_start(struct seq_file *s, loff_t *pos)
 	__acquires(htable->lock)
 {
 	struct xt_hashlimit_htable *htable = s->private;
-	unsigned int *bucket;
 
 	spin_lock_bh(&htable->lock);
-	if (*pos >= htable->cfg.size)
-		return NULL;
-
-	bucket = kmalloc(sizeof(unsigned int), GFP_ATOMIC);
-	if (!bucket)
-		return ERR_PTR(-ENOMEM);
-
-	*bucket = *pos;
-	return bucket;
+	return seq_list_start(&htable->entries, *pos);
 }
 
 static void *dl_seq_next(struct seq_file *s, void *v, loff_t *pos)
 {
 	struct xt_hashlimit_htable *htable = s->private;
-	unsigned int *bucket = (unsigned int *)v;
 
-	*pos = ++(*bucket);
-	if (*pos >= htable->cfg.size) {
-		kfree(v);
-		return NULL;
-	}
-	return bucket;
+	return seq_list_next(v, &htable->entries, pos);
 }
 
 static void dl_seq_stop(struct seq_file *s, void *v)
 	__releases(htable->lock)
 {
 	struct xt_hashlimit_htable *htable = s->private;
-	unsigned int *bucket = (unsigned int *)v;
 
-	if (!IS_ERR(bucket))
-		kfree(bucket);
 	spin_unlock_bh(&htable->lock);
 }
 
@@ -719,15 +677,10 @@ static int dl_seq_real_show(struct dsthash_ent *ent, u_int8_t family,
 static int dl_seq_show(struct seq_file *s, void *v)
 {
 	struct xt_hashlimit_htable *htable = s->private;
-	unsigned int *bucket = (unsigned int *)v;
-	struct dsthash_ent *ent;
-	struct hlist_node *pos;
+	struct dsthash_ent *ent = list_entry(v, struct dsthash_ent, list);
 
-	if (!hlist_empty(&htable->hash[*bucket])) {
-		hlist_for_each_entry(ent, pos, &htable->hash[*bucket], node)
-			if (dl_seq_real_show(ent, htable->family, s))
-				return -1;
-	}
+	if (dl_seq_real_show(ent, htable->family, s))
+		return -1;
 	return 0;
 }
 
@@ -840,7 +793,7 @@ static void __exit hashlimit_mt_exit(void)
 	xt_unregister_matches(hashlimit_mt_reg, ARRAY_SIZE(hashlimit_mt_reg));
 	unregister_pernet_subsys(&hashlimit_net_ops);
 
-	rcu_barrier_bh();
+	rcu_barrier();
 	kmem_cache_destroy(hashlimit_cachep);
 }
 
@@ -48,6 +48,7 @@
 #include <linux/notifier.h>
 #include <linux/security.h>
 #include <linux/jhash.h>
+#include <linux/rhashtable.h>
 #include <linux/jiffies.h>
 #include <linux/random.h>
 #include <linux/bitops.h>
@@ -81,6 +82,8 @@ struct netlink_sock {
 	struct mutex		cb_def_mutex;
 	void			(*netlink_rcv)(struct sk_buff *skb);
 	struct module		*module;
+	struct rhash_head	node;
+	struct rcu_head		rcu;
 };
 
 struct listeners {
@@ -103,21 +106,8 @@ static inline int netlink_is_kernel(struct sock *sk)
 	return nlk_sk(sk)->flags & NETLINK_KERNEL_SOCKET;
 }
 
-struct nl_pid_hash {
-	struct hlist_head *table;
-	unsigned long rehash_time;
-
-	unsigned int mask;
-	unsigned int shift;
-
-	unsigned int entries;
-	unsigned int max_shift;
-
-	u32 rnd;
-};
-
 struct netlink_table {
-	struct nl_pid_hash hash;
+	struct rhashtable hash;
 	struct hlist_head mc_list;
 	struct listeners __rcu *listeners;
 	unsigned int nl_nonroot;
@@ -137,6 +127,10 @@ static void netlink_destroy_callback(struct netlink_callback *cb);
 static DEFINE_RWLOCK(nl_table_lock);
 static atomic_t nl_table_users = ATOMIC_INIT(0);
 
+/* Serializes insertions into and removals from the pid hashes, which
+ * nl_table_lock cannot do: rhashtable updates need interrupts enabled. */
+static DEFINE_MUTEX(nl_sk_hash_lock);
+
 static ATOMIC_NOTIFIER_HEAD(netlink_chain);
 
 static inline u32 netlink_group_mask(u32 group)
@@ -144,11 +138,6 @@ static inline u32 netlink_group_mask(u32 group)
 	return group ? 1 << (group - 1) : 0;
 }
 
-static inline struct hlist_head *nl_pid_hashfn(struct nl_pid_hash *hash, u32 pid)
-{
-	return &hash->table[jhash_1word(pid, hash->rnd) & hash->mask];
-}
-
 static void netlink_sock_destruct(struct sock *sk)
 {
 	struct netlink_sock *nlk = nlk_sk(sk);
@@ -226,99 +215,46 @@ netlink_unlock_table(void)
 		wake_up(&nl_table_wait);
 }
 
-static struct sock *netlink_lookup(struct net *net, int protocol, u32 pid)
-{
-	struct nl_pid_hash *hash = &nl_table[protocol].hash;
-	struct hlist_head *head;
-	struct sock *sk;
-	struct hlist_node *node;
-
-	read_lock(&nl_table_lock);
-	head = nl_pid_hashfn(hash, pid);
-	sk_for_each(sk, node, head) {
-		if (net_eq(sock_net(sk), net) && (nlk_sk(sk)->pid == pid)) {
-			sock_hold(sk);
-			goto found;
-		}
-	}
-	sk = NULL;
-found:
-	read_unlock(&nl_table_lock);
-	return sk;
-}
+struct netlink_compare_arg {
+	struct net *net;
+	u32 pid;
+};
 
-static struct hlist_head *nl_pid_hash_zalloc(size_t size)
+static bool netlink_compare(void *ptr, void *arg)
 {
-	if (size <= PAGE_SIZE)
-		return kzalloc(size, GFP_ATOMIC);
-	else
-		return (struct hlist_head *)
-			__get_free_pages(GFP_ATOMIC | __GFP_ZERO,
-					 get_order(size));
-}
+	struct netlink_compare_arg *x = arg;
+	struct netlink_sock *nlk = ptr;
 
-static void nl_pid_hash_free(struct hlist_head *table, size_t size)
-{
-	if (size <= PAGE_SIZE)
-		kfree(table);
-	else
-		free_pages((unsigned long)table, get_order(size));
+	return nlk->pid == x->pid && net_eq(sock_net(&nlk->sk), x->net);
 }
 
-static int nl_pid_hash_rehash(struct nl_pid_hash *hash, int grow)
+/* Called under rcu_read_lock() */
+static struct sock *__netlink_lookup(struct netlink_table *table, u32 pid,
+				     struct net *net)
 {
-	unsigned int omask, mask, shift;
-	size_t osize, size;
-	struct hlist_head *otable, *table;
-	int i;
-
-	omask = mask = hash->mask;
-	osize = size = (mask + 1) * sizeof(*table);
-	shift = hash->shift;
+	struct netlink_compare_arg arg = {
+		.net = net,
+		.pid = pid,
+	};
+	u32 hash;
 
-	if (grow) {
-		if (++shift > hash->max_shift)
-			return 0;
-		mask = mask * 2 + 1;
-		size *= 2;
-	}
-
-	table = nl_pid_hash_zalloc(size);
-	if (!table)
-		return 0;
-
-	otable = hash->table;
-	hash->table = table;
-	hash->mask = mask;
-	hash->shift = shift;
-	get_random_bytes(&hash->rnd, sizeof(hash->rnd));
-
-	for (i = 0; i <= omask; i++) {
-		struct sock *sk;
-		struct hlist_node *node, *tmp;
-
-		sk_for_each_safe(sk, node, tmp, &otable[i])
-			__sk_add_node(sk, nl_pid_hashfn(hash, nlk_sk(sk)->pid));
-	}
-
-	nl_pid_hash_free(otable, osize);
-	hash->rehash_time = jiffies + 10 * 60 * HZ;
-	return 1;
+	hash = rhashtable_hashfn(&table->hash, &pid, sizeof(pid));
+	return rhashtable_lookup_compare(&table->hash, hash,
+					 &netlink_compare, &arg);
 }
 
-static inline int nl_pid_hash_dilute(struct nl_pid_hash *hash, int len)
+static struct sock *netlink_lookup(struct net *net, int protocol, u32 pid)
 {
-	int avg = hash->entries >> hash->shift;
-
-	if (unlikely(avg > 1) && nl_pid_hash_rehash(hash, 1))
-		return 1;
+	struct netlink_table *table = &nl_table[protocol];
+	struct sock *sk;
 
-	if (unlikely(len > avg) && time_after(jiffies, hash->rehash_time)) {
-		nl_pid_hash_rehash(hash, 0);
-		return 1;
-	}
+	rcu_read_lock();
+	sk = __netlink_lookup(table, pid, net);
+	if (sk)
+		sock_hold(sk);
+	rcu_read_unlock();
 
-	return 0;
+	return sk;
 }
 
 static const struct proto_ops netlink_ops;
@@ -345,22 +281,15 @@ netlink_update_listeners(struct sock *sk)
 
 static int netlink_insert(struct sock *sk, struct net *net, u32 pid)
 {
-	struct nl_pid_hash *hash = &nl_table[sk->sk_protocol].hash;
-	struct hlist_head *head;
-	int err = -EADDRINUSE;
+	struct netlink_table *table = &nl_table[sk->sk_protocol];
 	struct sock *osk;
-	struct hlist_node *node;
-	int len;
+	int err = -EADDRINUSE;
 
-	netlink_table_grab();
-	head = nl_pid_hashfn(hash, pid);
-	len = 0;
-	sk_for_each(osk, node, head) {
-		if (net_eq(sock_net(osk), net) && (nlk_sk(osk)->pid == pid))
-			break;
-		len++;
-	}
-	if (node)
+	mutex_lock(&nl_sk_hash_lock);
+	rcu_read_lock();
+	osk = __netlink_lookup(table, pid, net);
+	rcu_read_unlock();
+	if (osk)
 		goto err;
 
 	err = -EBUSY;
@@ -368,26 +297,31 @@ static int netlink_insert(struct sock *sk, struct net *net, u32 pid)
 		goto err;
 
 	err = -ENOMEM;
-	if (BITS_PER_LONG > 32 && unlikely(hash->entries >= UINT_MAX))
+	if (BITS_PER_LONG > 32 && unlikely(table->hash.nelems >= UINT_MAX))
 		goto err;
 
-	if (len && nl_pid_hash_dilute(hash, len))
-		head = nl_pid_hashfn(hash, pid);
-	hash->entries++;
 	nlk_sk(sk)->pid = pid;
-	sk_add_node(sk, head);
+	sock_hold(sk);
+	rhashtable_insert(&table->hash, &nlk_sk(sk)->node);
 	err = 0;
 
 err:
-	netlink_table_ungrab();
+	mutex_unlock(&nl_sk_hash_lock);
 	return err;
 }
 
 static void netlink_remove(struct sock *sk)
 {
+	struct netlink_table *table = &nl_table[sk->sk_protocol];
+
+	mutex_lock(&nl_sk_hash_lock);
+	if (rhashtable_remove(&table->hash, &nlk_sk(sk)->node)) {
+		WARN_ON(atomic_read(&sk->sk_refcnt) == 1);
+		__sock_put(sk);
+	}
+	mutex_unlock(&nl_sk_hash_lock);
+
 	netlink_table_grab();
-	if (sk_del_node_init(sk))
-		nl_table[sk->sk_protocol].hash.entries--;
 	if (nlk_sk(sk)->subscriptions)
 		__sk_del_bind_node(sk);
 	netlink_table_ungrab();
@@ -480,6 +414,13 @@ out_module:
 	goto out;
 }
 
+static void deferred_put_nlk_sk(struct rcu_head *head)
+{
+	struct netlink_sock *nlk = container_of(head, struct netlink_sock, rcu);
+
+	sock_put(&nlk->sk);
+}
+
 static int netlink_release(struct socket *sock)
 {
 	struct sock *sk = sock->sk;
@@ -492,6 +433,23 @@ static int netlink_release(struct socket *sock)
 	sock_orphan(sk);
 	nlk = nlk_sk(sk);
 
+	/*
+	 * The final sock_put() may come from softirq context, but done
+	 * handlers may sleep: end a dump in progress here.  The socket is
+	 * dead now, so netlink_dump_start() will not install another.
+	 * Kernel sockets are never the target of a dump.
+	 */
+	if (!netlink_is_kernel(sk)) {
+		mutex_lock(nlk->cb_mutex);
+		if (nlk->cb) {
+			if (nlk->cb->done)
+				nlk->cb->done(nlk->cb);
+			netlink_destroy_callback(nlk->cb);
+			nlk->cb = NULL;
+		}
+		mutex_unlock(nlk->cb_mutex);
+	}
+
 	/*
 	 * OK. Socket is unlinked, any packets that arrive now
 	 * will be purged.
@@ -532,7 +490,8 @@ static int netlink_release(struct socket *sock)
 	local_bh_disable();
 	sock_prot_inuse_add(sock_net(sk), &netlink_proto, -1);
 	local_bh_enable();
-	sock_put(sk);
+	/* Lockless lookups may still hold on to the socket. */
+	call_rcu(&nlk->rcu, deferred_put_nlk_sk);
 	return 0;
 }
 
@@ -540,31 +499,23 @@ static int netlink_autobind(struct socket *sock)
 {
 	struct sock *sk = sock->sk;
 	struct net *net = sock_net(sk);
-	struct nl_pid_hash *hash = &nl_table[sk->sk_protocol].hash;
-	struct hlist_head *head;
-	struct sock *osk;
-	struct hlist_node *node;
+	struct netlink_table *table = &nl_table[sk->sk_protocol];
 	s32 pid = task_tgid_vnr(current);
 	int err;
 	static s32 rover = -4097;
 
 retry:
 	cond_resched();
-	netlink_table_grab();
-	head = nl_pid_hashfn(hash, pid);
-	sk_for_each(osk, node, head) {
-		if (!net_eq(sock_net(osk), net))
-			continue;
-		if (nlk_sk(osk)->pid == pid) {
-			/* Bind collision, search negative pid values. */
-			pid = rover--;
-			if (rover > -4097)
-				rover = -4097;
-			netlink_table_ungrab();
-			goto retry;
-		}
+	rcu_read_lock();
+	if (__netlink_lookup(table, pid, net)) {
+		/* Bind collision, search negative pid values. */
+		pid = rover--;
+		if (rover > -4097)
+			rover = -4097;
+		rcu_read_unlock();
+		goto retry;
 	}
-	netlink_table_ungrab();
+	rcu_read_unlock();
 
 	err = netlink_insert(sk, net, pid);
 	if (err == -EADDRINUSE)
@@ -1763,8 +1714,15 @@ int netlink_dump_start(struct sock *ssk, struct sk_buff *skb,
 		return -ECONNREFUSED;
 	}
 	nlk = nlk_sk(sk);
-	/* A dump is in progress... */
 	mutex_lock(nlk->cb_mutex);
+	/* Found by a lookup that raced with netlink_release() */
+	if (sock_flag(sk, SOCK_DEAD)) {
+		mutex_unlock(nlk->cb_mutex);
+		netlink_destroy_callback(cb);
+		sock_put(sk);
+		return -ECONNREFUSED;
+	}
+	/* A dump is in progress... */
 	if (nlk->cb) {
 		mutex_unlock(nlk->cb_mutex);
 		netlink_destroy_callback(cb);
@@ -1908,89 +1866,88 @@ EXPORT_SYMBOL(nlmsg_notify);
 struct nl_seq_iter {
 	struct seq_net_private p;
 	int link;
+	struct bucket_table *tbl;
 	int hash_idx;
 };
 
-static struct sock *netlink_seq_socket_idx(struct seq_file *seq, loff_t pos)
+/* Returns the first socket of the namespace at or after @he, going on to
+ * the following buckets, the table of a resize in progress and the
+ * following links.  A socket being moved by a resize may show up twice,
+ * but none is missed.
+ */
+static struct sock *netlink_seq_skip(struct seq_file *seq,
+				     struct rhash_head *he)
 {
 	struct nl_seq_iter *iter = seq->private;
-	int i, j;
-	struct sock *s;
-	struct hlist_node *node;
-	loff_t off = 0;
+	struct rhashtable *ht = &nl_table[iter->link].hash;
+	struct netlink_sock *nlk;
 
-	for (i = 0; i < MAX_LINKS; i++) {
-		struct nl_pid_hash *hash = &nl_table[i].hash;
-
-		for (j = 0; j <= hash->mask; j++) {
-			sk_for_each(s, node, &hash->table[j]) {
-				if (sock_net(s) != seq_file_net(seq))
-					continue;
-				if (off == pos) {
-					iter->link = i;
-					iter->hash_idx = j;
-					return s;
-				}
-				++off;
+	for (;;) {
+		for (; he; he = rht_dereference_rcu(he->next, ht)) {
+			nlk = rht_obj(ht, he);
+			if (net_eq(sock_net(&nlk->sk), seq_file_net(seq)))
+				return &nlk->sk;
+		}
+
+		if (++iter->hash_idx >= iter->tbl->size) {
+			iter->hash_idx = 0;
+			smp_rmb();
+			iter->tbl = rht_dereference_rcu(iter->tbl->future_tbl,
+							ht);
+			if (!iter->tbl) {
+				if (++iter->link >= MAX_LINKS)
+					return NULL;
+				ht = &nl_table[iter->link].hash;
+				iter->tbl = rht_dereference_rcu(ht->tbl, ht);
 			}
 		}
+		he = rht_dereference_rcu(iter->tbl->buckets[iter->hash_idx], ht);
 	}
-	return NULL;
+}
+
+static struct sock *netlink_seq_next_sock(struct seq_file *seq,
+					  struct sock *s)
+{
+	return netlink_seq_skip(seq, rcu_dereference(nlk_sk(s)->node.next));
+}
+
+static struct sock *netlink_seq_socket_idx(struct seq_file *seq, loff_t pos)
+{
+	struct nl_seq_iter *iter = seq->private;
+	struct rhashtable *ht = &nl_table[0].hash;
+	struct sock *s;
+
+	iter->link = 0;
+	iter->tbl = rht_dereference_rcu(ht->tbl, ht);
+	iter->hash_idx = 0;
+
+	s = netlink_seq_skip(seq, rht_dereference_rcu(iter->tbl->buckets[0], ht));
+	while (s && pos-- > 0)
+		s = netlink_seq_next_sock(seq, s);
+	return s;
 }
 
 static void *netlink_seq_start(struct seq_file *seq, loff_t *pos)
-	__acquires(nl_table_lock)
+	__acquires(RCU)
 {
-	read_lock(&nl_table_lock);
+	rcu_read_lock();
 	return *pos ? netlink_seq_socket_idx(seq, *pos - 1) : SEQ_START_TOKEN;
 }
 
 static void *netlink_seq_next(struct seq_file *seq, void *v, loff_t *pos)
 {
-	struct sock *s;
-	struct nl_seq_iter *iter;
-	int i, j;
-
 	++*pos;
 
 	if (v == SEQ_START_TOKEN)
 		return netlink_seq_socket_idx(seq, 0);
 
-	iter = seq->private;
-	s = v;
-	do {
-		s = sk_next(s);
-	} while (s && sock_net(s) != seq_file_net(seq));
-	if (s)
-		return s;
-
-	i = iter->link;
-	j = iter->hash_idx + 1;
-
-	do {
-		struct nl_pid_hash *hash = &nl_table[i].hash;
-
-		for (; j <= hash->mask; j++) {
-			s = sk_head(&hash->table[j]);
-			while (s && sock_net(s) != seq_file_net(seq))
-				s = sk_next(s);
-			if (s) {
-				iter->link = i;
-				iter->hash_idx = j;
-				return s;
-			}
-		}
-
-		j = 0;
-	} while (++i < MAX_LINKS);
-
-	return NULL;
+	return netlink_seq_next_sock(seq, v);
 }
 
 static void netlink_seq_stop(struct seq_file *seq, void *v)
-	__releases(nl_table_lock)
+	__releases(RCU)
 {
-	read_unlock(&nl_table_lock);
+	rcu_read_unlock();
 }
 
 
@@ -2151,20 +2108,20 @@ static int __init netlink_proto_init(void)
 	order = get_bitmask_order(min(limit, (unsigned long)UINT_MAX)) - 1;
 
 	for (i = 0; i < MAX_LINKS; i++) {
-		struct nl_pid_hash *hash = &nl_table[i].hash;
-
-		hash->table = nl_pid_hash_zalloc(1 * sizeof(*hash->table));
-		if (!hash->table) {
+		struct rhashtable_params ht_params = {
+			.key_len = sizeof(u32),
+			.key_offset = offsetof(struct netlink_sock, pid),
+			.head_offset = offsetof(struct netlink_sock, node),
+			.hashfn = jhash,
+			.max_shift = max(order, 2U),
+		};
+
+		if (rhashtable_init(&nl_table[i].hash, &ht_params) < 0) {
 			while (i-- > 0)
-				nl_pid_hash_free(nl_table[i].hash.table,
-						 1 * sizeof(*hash->table));
+				rhashtable_destroy(&nl_table[i].hash);
 			kfree(nl_table);
 			goto panic;
 		}
-		hash->max_shift = order;
-		hash->shift = 0;
-		hash->mask = 0;
-		hash->rehash_time = jiffies;
 	}
 
 	netlink_add_usersock_entry();
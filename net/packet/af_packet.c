@@ -88,6 +88,8 @@
 #include <linux/virtio_net.h>
 #include <linux/errqueue.h>
 #include <linux/net_tstamp.h>
+#include <linux/filter.h>
+#include <linux/compat.h>
 
 #ifdef CONFIG_INET
 #include <net/inet_common.h>
@@ -309,6 +311,7 @@ struct packet_fanout {
 	u8			defrag;
 	atomic_t		rr_cur;
 	struct list_head	list;
+	struct sk_filter __rcu	*bpf_prog;
 	struct sock		*arr[PACKET_FANOUT_MAX];
 	spinlock_t		lock;
 	atomic_t		sk_ref;
@@ -1212,6 +1215,35 @@ static struct sock *fanout_demux_cpu(struct packet_fanout *f, struct sk_buff *sk
 	return f->arr[cpu % num];
 }
 
+/* Keeps the flow on the socket matching the NIC queue RSS placed it on */
+static struct sock *fanout_demux_qm(struct packet_fanout *f, struct sk_buff *skb, unsigned int num)
+{
+	unsigned int queue = 0;
+
+	if (skb_rx_queue_recorded(skb))
+		queue = skb_get_rx_queue(skb);
+
+	return f->arr[queue % num];
+}
+
+/* The program sees the packet from its network header on, as a socket
+ * filter would; link layer headers are reachable through SKF_LL_OFF.
+ * It returns the index of the member socket.
+ */
+static struct sock *fanout_demux_bpf(struct packet_fanout *f, struct sk_buff *skb, unsigned int num)
+{
+	struct sk_filter *prog;
+	unsigned int ret = 0;
+
+	rcu_read_lock();
+	prog = rcu_dereference(f->bpf_prog);
+	if (prog)
+		ret = SK_RUN_FILTER(prog, skb) % num;
+	rcu_read_unlock();
+
+	return f->arr[ret];
+}
+
 static int packet_rcv_fanout(struct sk_buff *skb, struct net_device *dev,
 			     struct packet_type *pt, struct net_device *orig_dev)
 {
@@ -1243,6 +1275,12 @@ static int packet_rcv_fanout(struct sk_buff *skb, struct net_device *dev,
 	case PACKET_FANOUT_CPU:
 		sk = fanout_demux_cpu(f, skb, num);
 		break;
+	case PACKET_FANOUT_QM:
+		sk = fanout_demux_qm(f, skb, num);
+		break;
+	case PACKET_FANOUT_CBPF:
+		sk = fanout_demux_bpf(f, skb, num);
+		break;
 	}
 
 	po = pkt_sk(sk);
@@ -1292,6 +1330,8 @@ static int fanout_add(struct sock *sk, u16 id, u16 type_flags)
 	case PACKET_FANOUT_HASH:
 	case PACKET_FANOUT_LB:
 	case PACKET_FANOUT_CPU:
+	case PACKET_FANOUT_QM:
+	case PACKET_FANOUT_CBPF:
 		break;
 	default:
 		return -EINVAL;
@@ -1357,6 +1397,7 @@ static void fanout_release(struct sock *sk)
 {
 	struct packet_sock *po = pkt_sk(sk);
 	struct packet_fanout *f;
+	struct sk_filter *prog;
 
 	f = po->fanout;
 	if (!f)
@@ -1368,11 +1409,66 @@ static void fanout_release(struct sock *sk)
 	if (atomic_dec_and_test(&f->sk_ref)) {
 		list_del(&f->list);
 		dev_remove_pack(&f->prot_hook);
+		prog = rcu_dereference_protected(f->bpf_prog,
+						 lockdep_is_held(&fanout_mutex));
+		if (prog)
+			sk_unattached_filter_destroy(prog);
 		kfree(f);
 	}
 	mutex_unlock(&fanout_mutex);
 }
 
+/* Installs the program of a PACKET_FANOUT_CBPF group; any member may
+ * replace it.  @fprog->filter points to user memory.
+ */
+static int fanout_set_data_cbpf(struct packet_sock *po,
+				struct sock_fprog *fprog)
+{
+	struct packet_fanout *f = po->fanout;
+	struct sk_filter *new, *old;
+	struct sock_filter *insns;
+	struct sock_fprog kprog;
+	int err;
+
+	if (fprog->len == 0 || fprog->len > BPF_MAXINSNS)
+		return -EINVAL;
+
+	insns = memdup_user(fprog->filter,
+			    fprog->len * sizeof(struct sock_filter));
+	if (IS_ERR(insns))
+		return PTR_ERR(insns);
+
+	kprog.len = fprog->len;
+	kprog.filter = (struct sock_filter __user *)insns;
+	err = sk_unattached_filter_create(&new, &kprog);
+	kfree(insns);
+	if (err)
+		return err;
+
+	mutex_lock(&fanout_mutex);
+	old = rcu_dereference_protected(f->bpf_prog,
+					lockdep_is_held(&fanout_mutex));
+	rcu_assign_pointer(f->bpf_prog, new);
+	mutex_unlock(&fanout_mutex);
+
+	if (old)
+		sk_unattached_filter_destroy(old);
+	return 0;
+}
+
+static int fanout_set_data(struct packet_sock *po, struct sock_fprog *fprog)
+{
+	if (!po->fanout)
+		return -EINVAL;
+
+	switch (po->fanout->type) {
+	case PACKET_FANOUT_CBPF:
+		return fanout_set_data_cbpf(po, fprog);
+	default:
+		return -EINVAL;
+	}
+}
+
 static const struct proto_ops packet_ops;
 
 static const struct proto_ops packet_ops_spkt;
@@ -3215,11 +3311,47 @@ packet_setsockopt(struct socket *sock, int level, int optname, char __user *optv
 
 		return fanout_add(sk, val & 0xffff, val >> 16);
 	}
+	case PACKET_FANOUT_DATA:
+	{
+		struct sock_fprog fprog;
+
+		if (optlen != sizeof(fprog))
+			return -EINVAL;
+		if (copy_from_user(&fprog, optval, sizeof(fprog)))
+			return -EFAULT;
+
+		return fanout_set_data(po, &fprog);
+	}
 	default:
 		return -ENOPROTOOPT;
 	}
 }
 
+#ifdef CONFIG_COMPAT
+static int compat_packet_setsockopt(struct socket *sock, int level,
+				    int optname, char __user *optval,
+				    unsigned int optlen)
+{
+	struct packet_sock *po = pkt_sk(sock->sk);
+
+	if (level == SOL_PACKET && optname == PACKET_FANOUT_DATA) {
+		struct compat_sock_fprog fprog32;
+		struct sock_fprog fprog;
+
+		if (optlen != sizeof(fprog32))
+			return -EINVAL;
+		if (copy_from_user(&fprog32, optval, sizeof(fprog32)))
+			return -EFAULT;
+
+		fprog.len = fprog32.len;
+		fprog.filter = compat_ptr(fprog32.filter);
+		return fanout_set_data(po, &fprog);
+	}
+
+	return packet_setsockopt(sock, level, optname, optval, optlen);
+}
+#endif
+
 static int packet_getsockopt(struct socket *sock, int level, int optname,
 			     char __user *optval, int __user *optlen)
 {
@@ -3827,6 +3959,9 @@ static const struct proto_ops packet_ops = {
 	.shutdown =	sock_no_shutdown,
 	.setsockopt =	packet_setsockopt,
 	.getsockopt =	packet_getsockopt,
+#ifdef CONFIG_COMPAT
+	.compat_setsockopt = compat_packet_setsockopt,
+#endif
 	.sendmsg =	packet_sendmsg,
 	.recvmsg =	packet_recvmsg,
 	.mmap =		packet_mmap,
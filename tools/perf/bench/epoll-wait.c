@@ -0,0 +1,224 @@
+/*
+ *
+ * epoll-wait.c
+ *
+ * wait: Benchmark for epoll_wait() scalability
+ *
+ * A set of writer threads keeps signalling eventfds that are all watched
+ * by one epoll instance, while a set of waiter threads harvests them with
+ * epoll_wait().  This stresses the wakeup path (ep_poll_callback) against
+ * the harvest path (ep_scan_ready_list) of a single, shared epoll set.
+ *
+ */
+
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/parse-options.h"
+#include "../builtin.h"
+#include "bench.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/time.h>
+
+#define MAX_EVENTS 16
+
+static unsigned int nwaiters;
+static unsigned int nwriters = 1;
+static unsigned int nfds = 64;
+static unsigned int runtime = 5;
+static bool edge_triggered = false;
+
+static int epfd;
+static int *fds;
+static volatile int done;
+
+struct worker {
+	pthread_t thread;
+	unsigned int id;
+	unsigned long long ops;
+};
+
+static const struct option options[] = {
+	OPT_UINTEGER('t', "waiters", &nwaiters,
+		     "Specify number of epoll_wait() threads (default: online cpus)"),
+	OPT_UINTEGER('w', "writers", &nwriters,
+		     "Specify number of writer threads"),
+	OPT_UINTEGER('f', "nfds", &nfds,
+		     "Specify number of watched eventfds"),
+	OPT_UINTEGER('r', "runtime", &runtime,
+		     "Specify runtime in seconds"),
+	OPT_BOOLEAN('e', "edge", &edge_triggered,
+		    "Use edge-triggered (EPOLLET) watches"),
+	OPT_END()
+};
+
+static const char * const bench_epoll_wait_usage[] = {
+	"perf bench epoll wait <options>",
+	NULL
+};
+
+static void barf(const char *msg)
+{
+	fprintf(stderr, "%s (error: %s)\n", msg, strerror(errno));
+	exit(1);
+}
+
+static void *waiter(void *arg)
+{
+	struct worker *w = arg;
+	struct epoll_event ev[MAX_EVENTS];
+	uint64_t val;
+	int i, n, __used ret;
+
+	while (!done) {
+		n = epoll_wait(epfd, ev, MAX_EVENTS, 100);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			barf("epoll_wait");
+		}
+
+		for (i = 0; i < n; i++) {
+			/* eventfds are non blocking, another waiter may win */
+			ret = read(ev[i].data.fd, &val, sizeof(val));
+		}
+		w->ops += n;
+	}
+
+	return NULL;
+}
+
+static void *writer(void *arg)
+{
+	struct worker *w = arg;
+	uint64_t val = 1;
+	unsigned int i = w->id;
+	int __used ret;
+
+	while (!done) {
+		ret = write(fds[i % nfds], &val, sizeof(val));
+		i += nwriters;
+		w->ops++;
+	}
+
+	return NULL;
+}
+
+static unsigned long long run_workers(struct worker *workers,
+				      unsigned int nr)
+{
+	unsigned long long total = 0;
+	unsigned int i;
+
+	for (i = 0; i < nr; i++) {
+		pthread_join(workers[i].thread, NULL);
+		total += workers[i].ops;
+	}
+
+	return total;
+}
+
+int bench_epoll_wait(int argc, const char **argv,
+		     const char *prefix __used)
+{
+	struct worker *waiters, *writers;
+	unsigned long long events, writes, usecs;
+	struct timeval start, stop, diff;
+	struct epoll_event ev;
+	unsigned int i;
+
+	argc = parse_options(argc, argv, options,
+			     bench_epoll_wait_usage, 0);
+
+	if (!nwaiters)
+		nwaiters = sysconf(_SC_NPROCESSORS_ONLN);
+	if (!nwriters || !nfds || !runtime)
+		usage_with_options(bench_epoll_wait_usage, options);
+
+	epfd = epoll_create(nfds);
+	if (epfd < 0)
+		barf("epoll_create");
+
+	fds = calloc(nfds, sizeof(*fds));
+	waiters = calloc(nwaiters, sizeof(*waiters));
+	writers = calloc(nwriters, sizeof(*writers));
+	if (!fds || !waiters || !writers)
+		barf("calloc");
+
+	for (i = 0; i < nfds; i++) {
+		fds[i] = eventfd(0, EFD_NONBLOCK);
+		if (fds[i] < 0)
+			barf("eventfd");
+
+		ev.events = EPOLLIN | (edge_triggered ? EPOLLET : 0);
+		ev.data.fd = fds[i];
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &ev))
+			barf("epoll_ctl");
+	}
+
+	gettimeofday(&start, NULL);
+
+	for (i = 0; i < nwaiters; i++) {
+		waiters[i].id = i;
+		if (pthread_create(&waiters[i].thread, NULL, waiter, &waiters[i]))
+			barf("pthread_create");
+	}
+	for (i = 0; i < nwriters; i++) {
+		writers[i].id = i;
+		if (pthread_create(&writers[i].thread, NULL, writer, &writers[i]))
+			barf("pthread_create");
+	}
+
+	sleep(runtime);
+	done = 1;
+
+	writes = run_workers(writers, nwriters);
+	events = run_workers(waiters, nwaiters);
+
+	gettimeofday(&stop, NULL);
+	timersub(&stop, &start, &diff);
+	usecs = diff.tv_sec * 1000000ULL + diff.tv_usec;
+
+	switch (bench_format) {
+	case BENCH_FORMAT_DEFAULT:
+		printf("# %u waiter and %u writer threads on %u %s eventfds\n\n",
+		       nwaiters, nwriters, nfds,
+		       edge_triggered ? "edge-triggered" : "level-triggered");
+
+		printf(" %14s: %lu.%03lu [sec]\n\n", "Total time",
+		       diff.tv_sec, (unsigned long) (diff.tv_usec / 1000));
+
+		printf(" %14llu events/sec\n", events * 1000000ULL / usecs);
+		printf(" %14llu events/sec/waiter\n",
+		       events * 1000000ULL / usecs / nwaiters);
+		printf(" %14llu writes/sec\n", writes * 1000000ULL / usecs);
+		break;
+
+	case BENCH_FORMAT_SIMPLE:
+		printf("%llu\n", events * 1000000ULL / usecs);
+		break;
+
+	default:
+		/* reaching here is something disaster */
+		fprintf(stderr, "Unknown format:%d\n", bench_format);
+		exit(1);
+		break;
+	}
+
+	for (i = 0; i < nfds; i++)
+		close(fds[i]);
+	close(epfd);
+	free(writers);
+	free(waiters);
+	free(fds);
+
+	return 0;
+}
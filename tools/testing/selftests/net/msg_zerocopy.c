@@ -0,0 +1,246 @@
+/*
+ * msg_zerocopy: send with MSG_ZEROCOPY over loopback and read back the
+ * completion notifications from the error queue
+ *
+ * A TCP connection to itself is set up over IPv4 and IPv6.  The sender
+ * makes a number of MSG_ZEROCOPY calls while the data is drained on the
+ * other end, then reads notifications until every call is reported
+ * completed exactly once.  Loopback makes the kernel copy the data, so
+ * the notifications are expected to carry SO_EE_CODE_ZEROCOPY_COPIED.
+ *
+ *	./msg_zerocopy [-4|-6] [-n calls] [-s size]
+ *
+ * Released under the terms of the GNU GPL v2.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/errqueue.h>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY		44
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY		0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY	5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED	1
+#endif
+
+static int calls = 1000;
+static size_t size = 64 * 1024;
+
+static void error(const char *msg)
+{
+	perror(msg);
+	exit(1);
+}
+
+static void connect_pair(int family, int *tx, int *rx)
+{
+	struct sockaddr_storage ss;
+	socklen_t len;
+	int lfd, one = 1;
+
+	memset(&ss, 0, sizeof(ss));
+	if (family == AF_INET) {
+		struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+
+		sin->sin_family = AF_INET;
+		sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		len = sizeof(*sin);
+	} else {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_addr = in6addr_loopback;
+		len = sizeof(*sin6);
+	}
+
+	lfd = socket(family, SOCK_STREAM, 0);
+	if (lfd == -1)
+		error("socket");
+	if (bind(lfd, (struct sockaddr *)&ss, len) == -1)
+		error("bind");
+	if (listen(lfd, 1) == -1)
+		error("listen");
+	if (getsockname(lfd, (struct sockaddr *)&ss, &len) == -1)
+		error("getsockname");
+
+	*tx = socket(family, SOCK_STREAM, 0);
+	if (*tx == -1)
+		error("socket");
+	if (setsockopt(*tx, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)))
+		error("setsockopt SO_ZEROCOPY");
+	if (connect(*tx, (struct sockaddr *)&ss, len) == -1)
+		error("connect");
+
+	*rx = accept(lfd, NULL, NULL);
+	if (*rx == -1)
+		error("accept");
+	close(lfd);
+}
+
+static void drain(int fd)
+{
+	static char buf[256 * 1024];
+
+	while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+		;
+}
+
+/* Reads one notification; returns 0 when the queue is empty. */
+static int read_notification(int fd, uint32_t *next, int *copied)
+{
+	char control[128];
+	struct sock_extended_err *serr;
+	struct msghdr msg;
+	struct cmsghdr *cm;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+		if (errno == EAGAIN)
+			return 0;
+		error("recvmsg MSG_ERRQUEUE");
+	}
+
+	cm = CMSG_FIRSTHDR(&msg);
+	if (!cm) {
+		fprintf(stderr, "notification without cmsg\n");
+		exit(1);
+	}
+	if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+	    !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+		fprintf(stderr, "unexpected cmsg %d/%d\n",
+			cm->cmsg_level, cm->cmsg_type);
+		exit(1);
+	}
+
+	serr = (void *)CMSG_DATA(cm);
+	if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+		fprintf(stderr, "unexpected origin %u\n", serr->ee_origin);
+		exit(1);
+	}
+	if (serr->ee_errno != 0) {
+		fprintf(stderr, "notification with errno %u\n",
+			serr->ee_errno);
+		exit(1);
+	}
+	if (serr->ee_info != *next || serr->ee_data < serr->ee_info) {
+		fprintf(stderr, "range [%u, %u], expected to start at %u\n",
+			serr->ee_info, serr->ee_data, *next);
+		exit(1);
+	}
+
+	*next = serr->ee_data + 1;
+	if (serr->ee_code == SO_EE_CODE_ZEROCOPY_COPIED)
+		(*copied)++;
+	return 1;
+}
+
+static void run(int family)
+{
+	struct pollfd pfd;
+	uint32_t next = 0;
+	int tx, rx, i, notifications = 0, copied = 0;
+	char *buf;
+
+	buf = malloc(size);
+	if (!buf)
+		error("malloc");
+	memset(buf, 'z', size);
+
+	connect_pair(family, &tx, &rx);
+
+	for (i = 0; i < calls; ) {
+		if (send(tx, buf, size, MSG_ZEROCOPY | MSG_DONTWAIT) == -1) {
+			if (errno != EAGAIN && errno != ENOBUFS)
+				error("send");
+			/* Make room: let the data and notifications go. */
+			drain(rx);
+			while (read_notification(tx, &next, &copied))
+				notifications++;
+			continue;
+		}
+		i++;
+		drain(rx);
+	}
+
+	pfd.fd = tx;
+	pfd.events = 0;
+	while (next < (uint32_t)calls) {
+		drain(rx);
+		if (read_notification(tx, &next, &copied)) {
+			notifications++;
+			continue;
+		}
+		if (poll(&pfd, 1, 1000) == -1)
+			error("poll");
+		if (!(pfd.revents & POLLERR)) {
+			fprintf(stderr, "%s: timed out with %u of %d calls "
+				"completed\n", family == AF_INET ? "ipv4" : "ipv6",
+				next, calls);
+			exit(1);
+		}
+	}
+
+	if (read_notification(tx, &next, &copied)) {
+		fprintf(stderr, "notification beyond the last call\n");
+		exit(1);
+	}
+
+	printf("%s: %d calls completed in %d notifications, %d copied\n",
+	       family == AF_INET ? "ipv4" : "ipv6", calls, notifications,
+	       copied);
+
+	close(tx);
+	close(rx);
+	free(buf);
+}
+
+int main(int argc, char **argv)
+{
+	int c, family = 0;
+
+	while ((c = getopt(argc, argv, "46n:s:")) != -1) {
+		switch (c) {
+		case '4':
+			family = AF_INET;
+			break;
+		case '6':
+			family = AF_INET6;
+			break;
+		case 'n':
+			calls = atoi(optarg);
+			break;
+		case 's':
+			size = atol(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-4|-6] [-n calls] "
+				"[-s size]\n", argv[0]);
+			exit(1);
+		}
+	}
+
+	if (family != AF_INET6)
+		run(AF_INET);
+	if (family != AF_INET)
+		run(AF_INET6);
+	return 0;
+}
@@ -0,0 +1,297 @@
+/*
+ * tcp_mmap: compare TCP_ZEROCOPY_RECEIVE with plain recvmsg()
+ *
+ * The server accepts one connection and reads everything the client
+ * sends, either with read() or, with -z, by mapping whole payload pages
+ * into a mmap()ed window of the socket.  Bytes that cannot be mapped
+ * (headers split into the linear part, partial pages) are read with
+ * read() as the kernel hints in recv_skip_hint.  It then reports the
+ * throughput and the CPU cycles spent per received byte, as counted by
+ * a perf cycles counter on the receiving process, or the CPU time when
+ * the counter is not available.
+ *
+ *	./tcp_mmap -s [-z] [-p port]
+ *	./tcp_mmap -H host [-p port] [-l MB]
+ *
+ * Released under the terms of the GNU GPL v2.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <linux/perf_event.h>
+
+#ifndef TCP_ZEROCOPY_RECEIVE
+#define TCP_ZEROCOPY_RECEIVE	35
+#endif
+
+/* struct tcp_zerocopy_receive from <linux/tcp.h> */
+struct zc_receive {
+	uint64_t address;
+	uint32_t length;
+	uint32_t recv_skip_hint;
+};
+
+static size_t chunk_size = 512 * 1024;
+static int zflg;
+static int port = 34343;
+static long total_mb = 4096;
+
+static void error(const char *msg)
+{
+	perror(msg);
+	exit(1);
+}
+
+static int cycles_open(void)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CPU_CYCLES;
+	attr.disabled = 1;
+
+	return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t cycles_read(int fd)
+{
+	uint64_t val;
+
+	if (fd < 0 || read(fd, &val, sizeof(val)) != sizeof(val))
+		return 0;
+	return val;
+}
+
+static double tv_us(const struct timeval *tv)
+{
+	return tv->tv_sec * 1000000.0 + tv->tv_usec;
+}
+
+static void receive(int fd)
+{
+	struct rusage ru0, ru1;
+	struct timeval t0, t1;
+	uint64_t total = 0, total_mmap = 0, cycles;
+	double elapsed, cpu_us;
+	char *buffer;
+	void *addr = NULL;
+	int perf_fd;
+	ssize_t lu;
+
+	buffer = malloc(chunk_size);
+	if (!buffer)
+		error("malloc");
+
+	if (zflg) {
+		addr = mmap(NULL, chunk_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (addr == MAP_FAILED) {
+			perror("mmap, falling back to read()");
+			zflg = 0;
+		}
+	}
+
+	perf_fd = cycles_open();
+	getrusage(RUSAGE_SELF, &ru0);
+	gettimeofday(&t0, NULL);
+	if (perf_fd >= 0)
+		ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+
+	for (;;) {
+		if (zflg) {
+			struct zc_receive zc;
+			socklen_t zc_len = sizeof(zc);
+
+			memset(&zc, 0, sizeof(zc));
+			zc.address = (unsigned long)addr;
+			zc.length = chunk_size;
+
+			if (getsockopt(fd, IPPROTO_TCP, TCP_ZEROCOPY_RECEIVE,
+				       &zc, &zc_len) == -1) {
+				if (errno == EIO)
+					break;
+				error("getsockopt(TCP_ZEROCOPY_RECEIVE)");
+			}
+			total += zc.length;
+			total_mmap += zc.length;
+
+			/* Nothing to map: copy what the kernel says, or block
+			 * in read() until more data or EOF arrives.
+			 */
+			if (zc.recv_skip_hint || !zc.length) {
+				size_t len = zc.recv_skip_hint ? : chunk_size;
+
+				if (len > chunk_size)
+					len = chunk_size;
+				lu = read(fd, buffer, len);
+				if (lu == 0)
+					break;
+				if (lu < 0)
+					error("read");
+				total += lu;
+			}
+			continue;
+		}
+		lu = read(fd, buffer, chunk_size);
+		if (lu == 0)
+			break;
+		if (lu < 0)
+			error("read");
+		total += lu;
+	}
+
+	if (perf_fd >= 0)
+		ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+	gettimeofday(&t1, NULL);
+	getrusage(RUSAGE_SELF, &ru1);
+	cycles = cycles_read(perf_fd);
+
+	elapsed = (tv_us(&t1) - tv_us(&t0)) / 1000000.0;
+	cpu_us = tv_us(&ru1.ru_utime) - tv_us(&ru0.ru_utime) +
+		 tv_us(&ru1.ru_stime) - tv_us(&ru0.ru_stime);
+
+	printf("%s: received %g MB (%g %% mmap'ed) in %g s, %g Gbit\n",
+	       zflg ? "mmap" : "read", total / (1024.0 * 1024.0),
+	       total ? 100.0 * total_mmap / total : 0.0, elapsed,
+	       elapsed ? total * 8.0 / elapsed / 1e9 : 0.0);
+	if (cycles)
+		printf("  %g cycles per byte, ", (double)cycles / total);
+	else
+		printf("  no cycles counter, ");
+	printf("cpu user %g s sys %g s, %g usec per MB\n",
+	       (tv_us(&ru1.ru_utime) - tv_us(&ru0.ru_utime)) / 1000000.0,
+	       (tv_us(&ru1.ru_stime) - tv_us(&ru0.ru_stime)) / 1000000.0,
+	       total ? cpu_us / (total / (1024.0 * 1024.0)) : 0.0);
+
+	if (perf_fd >= 0)
+		close(perf_fd);
+	if (zflg)
+		munmap(addr, chunk_size);
+	free(buffer);
+}
+
+static void do_server(void)
+{
+	struct sockaddr_in6 addr;
+	int fd, lfd, on = 1;
+
+	lfd = socket(AF_INET6, SOCK_STREAM, 0);
+	if (lfd == -1)
+		error("socket");
+	setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin6_family = AF_INET6;
+	addr.sin6_addr = in6addr_any;
+	addr.sin6_port = htons(port);
+	if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+		error("bind");
+	if (listen(lfd, 1) == -1)
+		error("listen");
+
+	fd = accept(lfd, NULL, NULL);
+	if (fd == -1)
+		error("accept");
+	close(lfd);
+
+	receive(fd);
+	close(fd);
+}
+
+static void do_client(const char *host)
+{
+	struct addrinfo hints, *res;
+	char service[16];
+	char *buffer;
+	long long left = total_mb * 1024LL * 1024LL;
+	int fd;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(service, sizeof(service), "%d", port);
+	if (getaddrinfo(host, service, &hints, &res))
+		error("getaddrinfo");
+
+	fd = socket(res->ai_family, SOCK_STREAM, 0);
+	if (fd == -1)
+		error("socket");
+	if (connect(fd, res->ai_addr, res->ai_addrlen) == -1)
+		error("connect");
+	freeaddrinfo(res);
+
+	buffer = malloc(chunk_size);
+	if (!buffer)
+		error("malloc");
+	memset(buffer, 0x5a, chunk_size);
+
+	while (left > 0) {
+		size_t len = chunk_size;
+		ssize_t wr;
+
+		if (left < (long long)len)
+			len = left;
+		wr = write(fd, buffer, len);
+
+		if (wr <= 0)
+			error("write");
+		left -= wr;
+	}
+	close(fd);
+	free(buffer);
+}
+
+int main(int argc, char **argv)
+{
+	const char *host = NULL;
+	int sflg = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "szH:p:l:")) != -1) {
+		switch (c) {
+		case 's':
+			sflg = 1;
+			break;
+		case 'z':
+			zflg = 1;
+			break;
+		case 'H':
+			host = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'l':
+			total_mb = atol(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s -s [-z] [-p port] | "
+				"-H host [-p port] [-l MB]\n", argv[0]);
+			exit(1);
+		}
+	}
+
+	if (sflg)
+		do_server();
+	else if (host)
+		do_client(host);
+	else
+		error("need -s or -H host");
+
+	return 0;
+}
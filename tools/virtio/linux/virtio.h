@@ -96,6 +96,11 @@ static inline void *kmalloc(size_t s, gfp_t gfp)
 	return malloc(s);
 }
 
+static inline void *kcalloc(size_t n, size_t s, gfp_t gfp)
+{
+	return calloc(n, s);
+}
+
 static inline void kfree(void *p)
 {
 	free(p);
@@ -205,6 +210,8 @@ void virtqueue_disable_cb(struct virtqueue *vq);
 bool virtqueue_enable_cb(struct virtqueue *vq);
 
 void *virtqueue_detach_unused_buf(struct virtqueue *vq);
+
+unsigned int virtqueue_get_vring_size(struct virtqueue *vq);
 struct virtqueue *vring_new_virtqueue(unsigned int num,
 				      unsigned int vring_align,
 				      struct virtio_device *vdev,